@@ -0,0 +1,105 @@
+// Resident memory under a long run of small-value churn, compressed: each
+// "hour" overwrites and deletes keys at random while the value sizes drift
+// from one range to another, as when a workload's payloads change through
+// the day. The shard's map (FlatMap on slabs) is measured against a
+// std::unordered_map on malloc, each in its own process so neither inherits
+// the other's heap. FlatMap is compacted between operations the way a worker
+// does between requests.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_churn bench/bench_churn.cpp
+// Usage: ./bench_churn [keys] [hours] [ops_per_hour]
+//   defaults: 1000000 24 4000000
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+struct StdMap {
+    std::unordered_map<std::string, std::string> map;
+    void put(const std::string& key, const std::string& value) { map.insert_or_assign(key, value); }
+    void remove(const std::string& key) { map.erase(key); }
+    size_t size() const { return map.size(); }
+    size_t used() const { return 0; }
+    void maintain() {}
+};
+
+struct Flat {
+    FlatMap map;
+    void put(const std::string& key, const std::string& value) { map.insertOrAssign(key, value); }
+    void remove(const std::string& key) { map.erase(key); }
+    size_t size() const { return map.size(); }
+    size_t used() const { return map.memoryUsage(); }
+    // What a worker does between requests: compact a slice while fragmented
+    void maintain() {
+        if (compacting || map.allocator().fragmented()) compacting = !map.defragment(4096);
+    }
+    bool compacting = false;
+};
+
+static std::string makeKey(uint64_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "churn:%010llu", (unsigned long long)i);
+    return buf;
+}
+
+// Value sizes for an hour: the range slides from 20-60 bytes up to 400-800
+// and back, so the size classes in use keep changing
+static std::pair<size_t, size_t> sizeRange(size_t hour, size_t hours) {
+    double phase = hours > 1 ? double(hour) / (hours - 1) : 0;
+    double t = phase < 0.5 ? phase * 2 : (1 - phase) * 2;
+    size_t low = 20 + static_cast<size_t>(t * 380);
+    return {low, low * 2 + 20};
+}
+
+template<typename Map>
+static void run(const char* label, size_t keys, size_t hours, size_t ops) {
+    auto map = std::make_unique<Map>();
+    std::mt19937_64 rng(1);
+    std::string value(1600, 'v');
+    auto randomValue = [&](std::pair<size_t, size_t> range) {
+        return value.substr(0, range.first + rng() % (range.second - range.first + 1));
+    };
+    auto sizes = sizeRange(0, hours);
+    for (size_t i = 0; i < keys; ++i) map->put(makeKey(i), randomValue(sizes));
+    std::printf("%-14s %6s %12.1f %12zu %12.1f\n", label, "load", residentBytes() / 1048576.0, map->size(),
+                map->used() / 1048576.0);
+
+    for (size_t hour = 0; hour < hours; ++hour) {
+        sizes = sizeRange(hour, hours);
+        for (size_t op = 0; op < ops; ++op) {
+            std::string key = makeKey(rng() % keys);
+            // Mostly overwrites; deletes and re-inserts keep the key count near steady
+            if (rng() % 4 == 0) {
+                map->remove(key);
+            } else {
+                map->put(key, randomValue(sizes));
+            }
+            if (op % 64 == 0) map->maintain();
+        }
+        std::printf("%-14s %6zu %12.1f %12zu %12.1f\n", label, hour + 1, residentBytes() / 1048576.0, map->size(),
+                    map->used() / 1048576.0);
+        std::fflush(stdout);
+    }
+}
+
+template<typename Map>
+static void runIsolated(const char* label, size_t keys, size_t hours, size_t ops) {
+    std::fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        run<Map>(label, keys, hours, ops);
+        std::fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char* argv[]) {
+    size_t keys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    size_t hours = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 24;
+    size_t ops = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 4000000;
+
+    std::printf("%-14s %6s %12s %12s %12s\n", "map", "hour", "rss_MB", "keys", "reserved_MB");
+    runIsolated<StdMap>("unordered_map", keys, hours, ops);
+    runIsolated<Flat>("FlatMap", keys, hours, ops);
+    return 0;
+}
@@ -0,0 +1,135 @@
+// What routing in the client saves against a running cluster. Loads keys
+// through KVClient, then measures:
+//   - GET latency sent straight to each key's owner and sent to another node
+//     that forwards it (one extra hop), interleaved key by key
+//   - pipelined GET throughput with routing on, and with every request sent
+//     to the first node as a client without the ring would
+//   - MGET latency split by owner, and sent whole to the first node
+// Build: g++ -O2 -std=c++17 -pthread -o bench_client bench/bench_client.cpp
+// Usage: ./bench_client host:port,... [keys] [samples] [pipeline]   (defaults 10000 20000 64)
+#include "../kvclient.cpp"
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+
+using Clock = std::chrono::steady_clock;
+
+struct Percentiles {
+    std::vector<double> us;
+
+    void add(Clock::duration d) {
+        us.push_back(std::chrono::duration<double, std::micro>(d).count());
+    }
+
+    void print(const char* name) {
+        std::sort(us.begin(), us.end());
+        double sum = 0;
+        for (double v : us) sum += v;
+        std::printf("%24s %10.1f %10.1f %10.1f %10.1f\n", name, sum / us.size(), us[us.size() / 2],
+                    us[us.size() * 99 / 100], us[us.size() * 999 / 1000]);
+    }
+};
+
+static std::string keyName(size_t i) {
+    return "bench:" + std::to_string(i);
+}
+
+// Sends count GETs with up to depth in flight; returns requests per second
+static double pipelinedGets(KVClient& client, size_t keys, size_t count, size_t depth) {
+    std::mt19937_64 rng(7);
+    size_t sent = 0, errors = 0;
+    auto start = Clock::now();
+    while (sent < count || client.outstanding() > 0) {
+        while (sent < count && client.outstanding() < depth) {
+            client.get(keyName(rng() % keys), [&errors](Reply&& reply) { errors += reply.status != Status::Ok; });
+            ++sent;
+        }
+        client.poll();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (errors) std::printf("(%zu errors)\n", errors);
+    return count / seconds;
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s host:port,... [keys] [samples] [pipeline]\n", argv[0]);
+        return 1;
+    }
+    std::vector<std::string> seeds;
+    std::istringstream list(argv[1]);
+    for (std::string seed; std::getline(list, seed, ',');) seeds.push_back(seed);
+    size_t keys = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 10000;
+    size_t samples = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 20000;
+    size_t depth = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 64;
+
+    KVClient client(seeds);
+    if (!client.connect() || client.members().size() < 2) {
+        std::fprintf(stderr, "Need a cluster of at least two nodes\n");
+        return 1;
+    }
+    std::printf("members: %zu, keys: %zu\n", client.members().size(), keys);
+
+    for (size_t i = 0; i < keys; i += 100) {
+        std::vector<std::pair<std::string, std::string>> batch;
+        for (size_t j = i; j < std::min(keys, i + 100); ++j) batch.emplace_back(keyName(j), "value" + std::to_string(j));
+        client.mput(batch, [](Reply&& reply) {
+            if (reply.status != Status::Ok) std::fprintf(stderr, "MPUT failed: %s\n", reply.value.c_str());
+        });
+    }
+    client.wait();
+
+    // One request at a time, so each sample is a full round trip
+    Percentiles direct, hop;
+    std::mt19937_64 rng(42);
+    const std::vector<Node>& members = client.members();
+    for (size_t s = 0; s < samples; ++s) {
+        std::string key = keyName(rng() % keys);
+        std::string owner = client.ownerOf(key);
+        std::string other = members[s % members.size()].id();
+        if (other == owner) other = members[(s + 1) % members.size()].id();
+        Command get;
+        get.op = Op::Get;
+        get.key = key;
+        for (int pass = 0; pass < 2; ++pass) {
+            bool found = false;
+            auto t0 = Clock::now();
+            client.send(pass == 0 ? owner : other, get, [&found](Reply&& reply) { found = reply.status == Status::Ok; });
+            client.wait();
+            (pass == 0 ? direct : hop).add(Clock::now() - t0);
+            if (!found) std::fprintf(stderr, "GET %s failed\n", key.c_str());
+        }
+    }
+    std::printf("%24s %10s %10s %10s %10s\n", "GET latency (us)", "mean", "p50", "p99", "p999");
+    direct.print("to owner");
+    hop.print("via another node");
+
+    ClientOptions unrouted;
+    unrouted.route = false;
+    KVClient single({seeds.front()}, unrouted);
+    single.connect();
+    std::printf("\npipelined GETs, %zu in flight:\n", depth);
+    std::printf("%24s %10.0f ops/s\n", "routed", pipelinedGets(client, keys, samples * 5, depth));
+    std::printf("%24s %10.0f ops/s\n", "all to first node", pipelinedGets(single, keys, samples * 5, depth));
+
+    Percentiles split, whole;
+    for (size_t s = 0; s < samples / 10; ++s) {
+        std::vector<std::string> batch;
+        for (int j = 0; j < 100; ++j) batch.push_back(keyName(rng() % keys));
+        for (int pass = 0; pass < 2; ++pass) {
+            KVClient& via = pass == 0 ? client : single;
+            auto t0 = Clock::now();
+            via.mget(batch, [](Reply&& reply) {
+                if (reply.status != Status::Ok) std::fprintf(stderr, "MGET failed: %s\n", reply.value.c_str());
+            });
+            via.wait();
+            (pass == 0 ? split : whole).add(Clock::now() - t0);
+        }
+    }
+    std::printf("\n%24s %10s %10s %10s %10s\n", "MGET 100 keys (us)", "mean", "p50", "p99", "p999");
+    split.print("split by owner");
+    whole.print("all to first node");
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Forwarding-heavy GET benchmark on a local two-node cluster.
+# Runs the same load against both nodes; requests sent to the node that
+# does not own a key pay one extra hop to its owner.
+# Usage: bench/bench_forward.sh [kvstore_binary] [loadgen_binary] [seconds]
+# Extra loadgen flags can be passed in LOADGEN_FLAGS (e.g. --reconnect when
+# measuring a build that closes connections after every reply).
+KVSTORE=${1:-./kvstore}
+LOADGEN=${2:-./loadgen}
+SECONDS_PER_RUN=${3:-10}
+PORT1=${PORT1:-9201}
+PORT2=${PORT2:-9202}
+
+export NODES="0.0.0.0:$PORT1,0.0.0.0:$PORT2"
+$KVSTORE $PORT1 2>/dev/null &
+NODE1=$!
+$KVSTORE $PORT2 2>/dev/null &
+NODE2=$!
+trap 'kill $NODE1 $NODE2 2>/dev/null' EXIT
+sleep 1
+
+# Populate through node 1 so both runs read the same keys
+$LOADGEN --port $PORT1 --connections 4 --seconds 2 --keys 10000 --get-ratio 0 $LOADGEN_FLAGS > /dev/null
+
+for port in $PORT1 $PORT2; do
+    echo "== GET load against node on port $port"
+    $LOADGEN --port $port --connections 8 --seconds $SECONDS_PER_RUN --keys 10000 --get-ratio 1 $LOADGEN_FLAGS
+done
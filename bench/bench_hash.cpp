@@ -0,0 +1,77 @@
+// Per-key cost of the hashing and key comparison kernels across key lengths:
+// the two ring hashes (MurmurHash3, CRC-32C through the table and through
+// the CPU's CRC instruction), the batch form used by MGET/MPUT/MDEL, and the
+// common-prefix and compare helpers the ordered index uses against their
+// byte-at-a-time and memcmp equivalents. Compared keys differ only in their
+// last byte, so every byte is examined.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_hash bench/bench_hash.cpp
+// Usage: ./bench_hash [rounds]   (default 200)
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+static volatile uint64_t sink;
+
+// ns per call of fn(i) over i in [0, n), best of rounds
+template<typename Fn>
+static double timeIt(size_t n, size_t rounds, Fn&& fn) {
+    double best = 1e30;
+    for (size_t r = 0; r < rounds; ++r) {
+        uint64_t acc = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n; ++i) acc += fn(i);
+        auto t1 = std::chrono::steady_clock::now();
+        sink = acc;
+        best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count() / n);
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    size_t rounds = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200;
+    const size_t n = 1024;
+    std::mt19937_64 rng(42);
+
+    std::printf("CRC instruction: %s\n", hasCrc32cInstructions() ? "yes" : "no (table used)");
+    std::printf("%6s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "bytes", "murmur3", "crc_table", "crc_hw",
+                "ring_crc", "batch_crc", "lcp_byte", "lcp_simd", "cmp_memcmp", "cmp_simd");
+    for (size_t len : {8, 16, 32, 64, 128, 256, 512, 1024}) {
+        std::vector<std::string> keys(n), twins(n);
+        for (size_t i = 0; i < n; ++i) {
+            keys[i].resize(len);
+            for (char& c : keys[i]) c = static_cast<char>('a' + rng() % 26);
+            twins[i] = keys[i];
+            twins[i].back() ^= 1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (crc32cHardware(keys[i].data(), len, 0) != crc32cTable(keys[i].data(), len, 0)) {
+                std::fprintf(stderr, "CRC mismatch at %zu bytes\n", len);
+                return 1;
+            }
+        }
+
+        double murmur = timeIt(n, rounds, [&](size_t i) {
+            return MurmurHash3_x86_32(keys[i].data(), static_cast<int>(len), 0);
+        });
+        double table = timeIt(n, rounds, [&](size_t i) { return crc32cTable(keys[i].data(), len, 0); });
+        double hardware = timeIt(n, rounds, [&](size_t i) { return crc32c(keys[i].data(), len); });
+        double ring = timeIt(n, rounds, [&](size_t i) { return ringHash(RingHash::Crc32c, keys[i]); });
+        std::vector<uint32_t> hashes;
+        double batch = timeIt(1, rounds, [&](size_t) {
+            ringHashes(RingHash::Crc32c, n, [&](size_t i) -> std::string_view { return keys[i]; }, hashes);
+            return hashes[n - 1];
+        }) / n;
+        double lcp_byte = timeIt(n, rounds, [&](size_t i) {
+            return static_cast<size_t>(std::mismatch(keys[i].begin(), keys[i].end(), twins[i].begin()).first -
+                                       keys[i].begin());
+        });
+        double lcp_simd = timeIt(n, rounds, [&](size_t i) { return commonPrefixLength(keys[i], twins[i]); });
+        double cmp_memcmp = timeIt(n, rounds, [&](size_t i) { return keys[i].compare(twins[i]) < 0; });
+        double cmp_simd = timeIt(n, rounds, [&](size_t i) { return compareKeys(keys[i], twins[i]) < 0; });
+        std::printf("%6zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", len, murmur, table,
+                    hardware, ring, batch, lcp_byte, lcp_simd, cmp_memcmp, cmp_simd);
+    }
+    std::printf("(ns per key)\n");
+    return 0;
+}
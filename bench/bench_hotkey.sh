@@ -0,0 +1,82 @@
+#!/bin/bash
+# Skewed reads on a local three-node cluster, with and without the near
+# cache. A zipfian GET-only load (YCSB workload c) runs against every node at
+# once, so two thirds of the requests each node coordinates are for keys held
+# elsewhere and the hottest keys pile up on their owners. Prints each run's
+# throughput, then per node how many GETs it served for its peers (the owner
+# load), how many it answered from its near cache and how many joined a GET
+# already in flight.
+# Usage: bench/bench_hotkey.sh [kvstore_binary] [loadgen_binary] [seconds]
+# NEAR_CACHE_KEYS sets the cached run's NEAR_CACHE, NEAR_CACHE_LEASE its lease.
+KVSTORE=${1:-./kvstore}
+LOADGEN=${2:-./loadgen}
+SECONDS_PER_RUN=${3:-10}
+PORTS=${PORTS:-"9801 9802 9803"}
+KEYS=${KEYS:-100000}
+CONNECTIONS=${CONNECTIONS:-8}
+NEAR_CACHE_KEYS=${NEAR_CACHE_KEYS:-10000}
+
+NODES=""
+for port in $PORTS; do NODES="$NODES${NODES:+,}127.0.0.1:$port"; done
+export NODES
+FIRST=${PORTS%% *}
+OUT=$(mktemp -d)
+
+# Sends one text command to a node and prints the reply line
+send() {
+    exec 3<>/dev/tcp/127.0.0.1/$1
+    echo "$2" >&3
+    read -r line <&3
+    exec 3<&-
+    echo "$line"
+}
+
+# The value of one field of a node's STATS line, 0 if absent
+stat() {
+    local value
+    value=$(send $1 STATS | tr ' ' '\n' | grep "^$2:" | cut -d: -f2)
+    echo ${value:-0}
+}
+
+stop_cluster() {
+    kill $PIDS 2>/dev/null
+    wait $PIDS 2>/dev/null
+}
+trap 'stop_cluster; rm -rf $OUT' EXIT
+
+for near_cache in 0 $NEAR_CACHE_KEYS; do
+    PIDS=""
+    for port in $PORTS; do
+        NEAR_CACHE=$near_cache $KVSTORE $port 2>/dev/null &
+        PIDS="$PIDS $!"
+    done
+    sleep 1
+    $LOADGEN --port $FIRST --connections 4 --seconds 1 --keys $KEYS --preload --get-ratio 0 > /dev/null
+
+    echo "== NEAR_CACHE=$near_cache: zipfian GETs against every node"
+    before=""
+    for port in $PORTS; do before="$before $(stat $port peer_get_calls)"; done
+    LOADS=""
+    for port in $PORTS; do
+        $LOADGEN --port $port --connections $CONNECTIONS --seconds $SECONDS_PER_RUN --keys $KEYS \
+            --workload c --distribution zipfian > $OUT/$port &
+        LOADS="$LOADS $!"
+    done
+    wait $LOADS
+    total=0
+    for port in $PORTS; do
+        ops=$(grep '^ops/s:' $OUT/$port | awk '{print $2}')
+        p99=$(grep '^p99 us:' $OUT/$port | awk '{print $3}')
+        echo "node $port: $ops ops/s, p99 $p99 us"
+        total=$((total + ops))
+    done
+    echo "total: $total ops/s"
+    set -- $before
+    for port in $PORTS; do
+        served=$(( $(stat $port peer_get_calls) - $1 ))
+        shift
+        echo "node $port: served $served GETs for peers, $(stat $port near_cache_hits) near-cache hits," \
+             "$(stat $port coalesced_gets) coalesced"
+    done
+    stop_cluster
+done
@@ -0,0 +1,49 @@
+// PUT latency vs keyspace size for the local store + ordered index.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_index bench/bench_index.cpp
+// Usage: ./bench_index [max_keys]   (default 10000000)
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+
+static std::string makeKey(uint64_t i) {
+    // Scramble the insertion order so keys land all over the tree
+    uint64_t x = i * 0x9E3779B97F4A7C15ull;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "user:%016llx", (unsigned long long)x);
+    return buf;
+}
+
+int main(int argc, char* argv[]) {
+    size_t max_keys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000000;
+    const size_t samples = 20000;
+    Shard shard;
+
+    std::printf("%12s %12s %12s %12s %12s\n", "keys", "fill_s", "avg_ns", "p50_ns", "p99_ns");
+    uint64_t next = 0;
+    for (size_t target = 10000; target <= max_keys; target *= 10) {
+        auto fill_start = std::chrono::steady_clock::now();
+        while (next < target) {
+            shard.put(makeKey(next), "value");
+            ++next;
+        }
+        double fill_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - fill_start).count();
+
+        std::vector<uint64_t> lat;
+        lat.reserve(samples);
+        for (size_t i = 0; i < samples; ++i) {
+            std::string key = makeKey(next++);
+            auto t0 = std::chrono::steady_clock::now();
+            shard.put(key, "value");
+            auto t1 = std::chrono::steady_clock::now();
+            lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        }
+        uint64_t sum = 0;
+        for (uint64_t v : lat) sum += v;
+        std::sort(lat.begin(), lat.end());
+        std::printf("%12zu %12.2f %12llu %12llu %12llu\n", target, fill_s,
+                    (unsigned long long)(sum / lat.size()),
+                    (unsigned long long)lat[lat.size() / 2],
+                    (unsigned long long)lat[lat.size() * 99 / 100]);
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Cost of logging on the request path. Runs the same mixed load against a
+# single node with stderr going to a file, at the default INFO level and with
+# DEBUG=true (every request, reply and connection logged). Given a second
+# binary, runs it the same way for comparison.
+# Usage: bench/bench_logging.sh [kvstore_binary] [loadgen_binary] [seconds] [baseline_kvstore_binary]
+KVSTORE=${1:-./kvstore}
+LOADGEN=${2:-./loadgen}
+SECONDS_PER_RUN=${3:-10}
+BASELINE=$4
+PORT=${PORT:-9601}
+LOG=$(mktemp)
+trap 'rm -f $LOG' EXIT
+
+run() {
+    local binary=$1 label=$2
+    shift 2
+    env NODES=127.0.0.1:$PORT "$@" $binary $PORT 2>$LOG &
+    local pid=$!
+    sleep 1
+    echo "== $label"
+    $LOADGEN --port $PORT --connections 8 --seconds $SECONDS_PER_RUN --keys 10000 --get-ratio 0.9
+    kill $pid
+    wait $pid 2>/dev/null
+    echo "stderr: $(wc -c < $LOG) bytes"
+}
+
+run $KVSTORE "INFO"
+run $KVSTORE "DEBUG=true" DEBUG=true
+if [ -n "$BASELINE" ]; then
+    run $BASELINE "baseline"
+fi
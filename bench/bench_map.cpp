@@ -0,0 +1,86 @@
+// The shard's key/value map (FlatMap) against the std::unordered_map it
+// replaced: PUT and GET throughput and bytes per entry, as reported by malloc
+// plus the slabs FlatMap maps for its out-of-line entries, at 1M and 10M keys.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_map bench/bench_map.cpp
+// Usage: ./bench_map [value_bytes] [max_keys]
+//   defaults: 32 10000000
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <random>
+
+static size_t heapInUse() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static std::string makeKey(uint64_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key:%012llu", (unsigned long long)i);
+    return buf;
+}
+
+struct StdMap {
+    std::unordered_map<std::string, std::string> map;
+    void put(const std::string& key, const std::string& value) { map.insert_or_assign(key, value); }
+    bool get(const std::string& key, std::string& value) const {
+        auto it = map.find(key);
+        if (it == map.end()) return false;
+        value = it->second;
+        return true;
+    }
+    size_t slabBytes() const { return 0; }
+};
+
+struct Flat {
+    FlatMap map;
+    void put(const std::string& key, const std::string& value) { map.insertOrAssign(key, value); }
+    bool get(const std::string& key, std::string& value) const {
+        std::string_view found;
+        if (!map.find(key, &found)) return false;
+        value.assign(found);
+        return true;
+    }
+    size_t slabBytes() const { return map.allocator().reservedBytes(); }
+};
+
+template<typename Map>
+static void run(const char* label, const std::vector<std::string>& keys, const std::string& value) {
+    size_t base = heapInUse();
+    auto map = std::make_unique<Map>();
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& key : keys) map->put(key, value);
+    double put_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double bytes = double(heapInUse() - base + map->slabBytes()) / keys.size();
+
+    std::mt19937_64 rng(7);
+    std::vector<uint32_t> order(keys.size());
+    for (auto& i : order) i = rng() % keys.size();
+    std::string out;
+    size_t hits = 0;
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i : order) hits += map->get(keys[i], out);
+    double get_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (hits != keys.size()) std::printf("lost keys\n");
+
+    std::printf("%-14s %10zu %12.2f %12.2f %14.1f\n", label, keys.size(), keys.size() / put_s / 1e6,
+                keys.size() / get_s / 1e6, bytes);
+}
+
+int main(int argc, char* argv[]) {
+    size_t value_bytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 32;
+    size_t max_keys = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 10000000;
+    std::string value(value_bytes, 'v');
+
+    std::printf("%-14s %10s %12s %12s %14s\n", "map", "keys", "put_Mops", "get_Mops", "bytes/entry");
+    for (size_t n = 1000000; n <= max_keys; n *= 10) {
+        std::vector<std::string> keys;
+        keys.reserve(n);
+        std::mt19937_64 rng(n);
+        for (size_t i = 0; i < n; ++i) keys.push_back(makeKey(rng()));
+        run<StdMap>("unordered_map", keys, value);
+        run<Flat>("FlatMap", keys, value);
+    }
+    return 0;
+}
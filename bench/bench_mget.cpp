@@ -0,0 +1,111 @@
+// Fetching a page's worth of keys from a running cluster: 100 GETs one after
+// another, 100 GETs pipelined on one connection, and a single 100-key MGET.
+// Keys are spread over every node, so most of them need a hop to their owner.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_mget bench/bench_mget.cpp
+// Usage: ./bench_mget [host:port] [batch] [iterations]
+//   defaults: 127.0.0.1:8081 100 1000
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+static int fd = -1;
+static std::string in;
+
+static void sendAll(const std::string& data) {
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+        if (n <= 0) std::exit(1);
+        sent += n;
+    }
+}
+
+static std::string readLine() {
+    size_t end;
+    char buf[65536];
+    while ((end = in.find('\n')) == std::string::npos) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) std::exit(1);
+        in.append(buf, n);
+    }
+    std::string line = in.substr(0, end);
+    in.erase(0, end + 1);
+    return line;
+}
+
+static std::string makeKey(size_t i) {
+    return "mget:" + std::to_string(i);
+}
+
+template<typename Fn>
+static void measure(const char* label, size_t iterations, Fn&& fn) {
+    std::vector<double> us;
+    for (size_t i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(us.begin(), us.end());
+    std::printf("%-14s %10.0f %10.0f\n", label, us[us.size() / 2], us[std::min(us.size() - 1, us.size() * 99 / 100)]);
+}
+
+int main(int argc, char* argv[]) {
+    std::string target = argc > 1 ? argv[1] : "127.0.0.1:8081";
+    size_t batch = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100;
+    size_t iterations = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1000;
+    const size_t keys = 10000;
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(std::stoi(target.substr(target.find(':') + 1)));
+    inet_pton(AF_INET, target.substr(0, target.find(':')).c_str(), &addr.sin_addr);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        std::perror("connect");
+        return 1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    for (size_t base = 0; base < keys; base += 500) {
+        std::string request = "MPUT";
+        for (size_t i = base; i < base + 500; ++i) request += " " + makeKey(i) + " value" + std::to_string(i);
+        sendAll(request + "\n");
+        if (readLine() != "OK") {
+            std::fprintf(stderr, "MPUT failed\n");
+            return 1;
+        }
+    }
+
+    std::mt19937 rng(42);
+    std::vector<std::string> page(batch);
+    auto pick = [&] {
+        for (auto& key : page) key = makeKey(rng() % keys);
+    };
+
+    std::printf("%-14s %10s %10s   (%zu keys per request)\n", "method", "p50_us", "p99_us", batch);
+    measure("GET x N", iterations, [&] {
+        pick();
+        for (const auto& key : page) {
+            sendAll("GET " + key + "\n");
+            readLine();
+        }
+    });
+    measure("GET pipelined", iterations, [&] {
+        pick();
+        std::string request;
+        for (const auto& key : page) request += "GET " + key + "\n";
+        sendAll(request);
+        for (size_t i = 0; i < batch; ++i) readLine();
+    });
+    measure("MGET", iterations, [&] {
+        pick();
+        std::string request = "MGET";
+        for (const auto& key : page) request += " " + key;
+        sendAll(request + "\n");
+        readLine();
+    });
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Parse-only comparison of the request parsers: the original istringstream
+// text parser, the string_view text parser and the binary protocol.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_parse bench/bench_parse.cpp
+// Usage: ./bench_parse [requests]   (default 1000000)
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+
+// The parser run() used before the binary protocol: copy, strip, tokenize
+static bool parseLegacy(const char* data, size_t len, Command& cmd) {
+    std::string request(data, len);
+    request.erase(std::remove(request.begin(), request.end(), '\n'), request.end());
+    std::istringstream iss(request);
+    std::string command;
+    iss >> command;
+    if (command == "PUT") {
+        cmd.op = Op::Put;
+        iss >> cmd.key >> cmd.value;
+    } else {
+        cmd.op = Op::Get;
+        iss >> cmd.key;
+    }
+    return !cmd.key.empty();
+}
+
+template<typename Fn>
+static void report(const char* name, size_t requests, size_t bytes, Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    size_t parsed = fn();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (parsed != requests) std::fprintf(stderr, "%s parsed %zu of %zu requests\n", name, parsed, requests);
+    std::printf("%-10s %10.1f ns/req %10.2f Mreq/s %8.1f MB/s\n", name, secs * 1e9 / requests,
+                requests / secs / 1e6, bytes / secs / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+    size_t requests = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+
+    // Half PUTs with 100-byte values, half GETs, over 24-byte keys
+    std::string text, binary;
+    std::string value(100, 'v');
+    for (size_t i = 0; i < requests; ++i) {
+        Command cmd;
+        char key[48];
+        snprintf(key, sizeof(key), "session:user%012zu", i);
+        cmd.key = key;
+        if (i % 2 == 0) {
+            cmd.op = Op::Put;
+            cmd.value = value;
+            text += "PUT " + cmd.key + " " + value + "\n";
+        } else {
+            cmd.op = Op::Get;
+            text += "GET " + cmd.key + "\n";
+        }
+        appendBinaryRequest(binary, static_cast<uint32_t>(i), 0, cmd);
+    }
+
+    report("legacy", requests, text.size(), [&]() {
+        size_t parsed = 0, pos = 0;
+        while (pos < text.size()) {
+            size_t newline = text.find('\n', pos);
+            Command cmd;
+            parsed += parseLegacy(text.data() + pos, newline + 1 - pos, cmd);
+            pos = newline + 1;
+        }
+        return parsed;
+    });
+
+    report("text", requests, text.size(), [&]() {
+        size_t parsed = 0;
+        std::string_view pending(text);
+        std::string error;
+        while (!pending.empty()) {
+            size_t newline = pending.find('\n');
+            RequestView req;
+            parsed += parseTextRequest(pending.substr(0, newline), req, error);
+            pending.remove_prefix(newline + 1);
+        }
+        return parsed;
+    });
+
+    report("binary", requests, binary.size(), [&]() {
+        size_t parsed = 0;
+        std::string_view pending(binary);
+        std::string error;
+        while (!pending.empty()) {
+            RequestView req;
+            size_t consumed = 0;
+            if (parseBinaryRequest(pending, req, consumed, error) != ParseStatus::Ok) break;
+            ++parsed;
+            pending.remove_prefix(consumed);
+        }
+        return parsed;
+    });
+    return 0;
+}
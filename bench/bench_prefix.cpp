@@ -0,0 +1,95 @@
+// Cost of the ordered key index on its own: build time, heap bytes per key
+// and PREFIX latency at several selectivities. Keys follow the shapes the
+// store sees in practice (session:<hex>, user:<id>:<field>, order:<id>), in
+// scrambled order, so leaves fill the way they do under live traffic.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_prefix bench/bench_prefix.cpp
+// Usage: ./bench_prefix [keys] [queries]   (defaults 1000000 2000)
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+
+static const char* kFields[] = {"profile", "settings", "cart", "avatar"};
+
+static std::string makeKey(uint64_t i) {
+    uint64_t x = i * 0x9E3779B97F4A7C15ull;
+    char buf[64];
+    switch (x % 4) {
+    case 0:
+        snprintf(buf, sizeof(buf), "session:%016llx", (unsigned long long)x);
+        break;
+    case 1:
+    case 2:
+        snprintf(buf, sizeof(buf), "user:%08llu:%s", (unsigned long long)(x >> 40) % 10000000,
+                 kFields[(x >> 8) % 4]);
+        break;
+    default:
+        snprintf(buf, sizeof(buf), "order:%010llu", (unsigned long long)(x >> 20) % 10000000000ull);
+        break;
+    }
+    return buf;
+}
+
+static size_t heapBytes() {
+    return mallinfo2().uordblks;
+}
+
+int main(int argc, char* argv[]) {
+    size_t keys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    size_t queries = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 2000;
+
+    std::vector<std::string> input;
+    input.reserve(keys);
+    size_t key_bytes = 0;
+    for (uint64_t i = 0; i < keys; ++i) {
+        input.push_back(makeKey(i));
+        key_bytes += input.back().size();
+    }
+
+    size_t heap_before = heapBytes();
+    auto build_start = std::chrono::steady_clock::now();
+    auto* index = new RIndex();
+    for (const std::string& key : input) index->insert(key);
+    double build_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+    size_t index_bytes = heapBytes() - heap_before;
+
+    std::printf("keys: %zu (%zu distinct, %.1f bytes avg)\n", keys, index->size(),
+                double(key_bytes) / keys);
+    std::printf("build: %.2f s, %.0f ns/key\n", build_s, build_s * 1e9 / keys);
+    std::printf("index bytes/key: %.1f\n", double(index_bytes) / index->size());
+
+    // Each query takes the prefix of a random existing key, cut to a length
+    // that sets how many keys match
+    struct Selectivity {
+        const char* name;
+        size_t (*cut)(const std::string&);
+    };
+    Selectivity selectivities[] = {
+        {"exact key", [](const std::string& key) { return key.size(); }},
+        {"7 chars after ':'", [](const std::string& key) { return key.find(':') + 7; }},
+        {"6 chars after ':'", [](const std::string& key) { return key.find(':') + 6; }},
+        {"5 chars after ':'", [](const std::string& key) { return key.find(':') + 5; }},
+        {"4 chars after ':'", [](const std::string& key) { return key.find(':') + 4; }},
+    };
+    std::printf("%20s %12s %12s %12s %12s\n", "prefix", "avg_keys", "avg_us", "p50_us", "p99_us");
+    for (const Selectivity& sel : selectivities) {
+        std::vector<double> lat;
+        size_t matched = 0;
+        for (size_t q = 0; q < queries; ++q) {
+            const std::string& key = input[(q * 7919 + 13) % keys];
+            std::string prefix = key.substr(0, std::min(key.size(), sel.cut(key)));
+            auto t0 = std::chrono::steady_clock::now();
+            std::vector<std::string> result = index->prefixScan(prefix);
+            auto t1 = std::chrono::steady_clock::now();
+            matched += result.size();
+            lat.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        }
+        double sum = 0;
+        for (double v : lat) sum += v;
+        std::sort(lat.begin(), lat.end());
+        std::printf("%20s %12.1f %12.2f %12.2f %12.2f\n", sel.name, double(matched) / queries,
+                    sum / lat.size(), lat[lat.size() / 2], lat[lat.size() * 99 / 100]);
+    }
+    delete index;
+    return 0;
+}
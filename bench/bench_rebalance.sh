@@ -0,0 +1,62 @@
+#!/bin/bash
+# Throughput and latency of a local cluster while a node joins it. Three
+# nodes are loaded with keys, then a 90% GET load runs against node 1 twice:
+# once undisturbed, and once with a fourth node added a second into the run,
+# so the keys it takes over stream to it while the load goes on. Prints how
+# long the rebalance took to settle.
+# Usage: bench/bench_rebalance.sh [kvstore_binary] [loadgen_binary] [seconds]
+# MIGRATE_RATE (bytes per second, k/m/g suffix) limits the transfer.
+KVSTORE=${1:-./kvstore}
+LOADGEN=${2:-./loadgen}
+SECONDS_PER_RUN=${3:-10}
+PORTS=${PORTS:-"9501 9502 9503"}
+JOINING=${JOINING:-9504}
+KEYS=${KEYS:-200000}
+
+NODES=""
+for port in $PORTS; do NODES="$NODES${NODES:+,}127.0.0.1:$port"; done
+FIRST=${PORTS%% *}
+
+# Sends one text command to a node and prints the reply line
+send() {
+    exec 3<>/dev/tcp/127.0.0.1/$1
+    echo "$2" >&3
+    read -r line <&3
+    exec 3<&-
+    echo "$line"
+}
+
+run_cluster() {
+    PIDS=""
+    for port in $PORTS; do
+        NODES=$NODES $KVSTORE $port 2>/dev/null &
+        PIDS="$PIDS $!"
+    done
+    NODES=127.0.0.1:$JOINING $KVSTORE $JOINING 2>/dev/null &
+    PIDS="$PIDS $!"
+    sleep 1
+    $LOADGEN --port $FIRST --connections 8 --seconds 3 --keys $KEYS --get-ratio 0 > /dev/null
+}
+
+stop_cluster() {
+    kill $PIDS 2>/dev/null
+    wait $PIDS 2>/dev/null
+}
+trap 'stop_cluster' EXIT
+
+run_cluster
+echo "== steady state"
+$LOADGEN --port $FIRST --connections 8 --seconds $SECONDS_PER_RUN --keys $KEYS --get-ratio 0.9
+stop_cluster
+
+run_cluster
+echo "== NODE ADD 127.0.0.1:$JOINING after 1 s"
+$LOADGEN --port $FIRST --connections 8 --seconds $SECONDS_PER_RUN --keys $KEYS --get-ratio 0.9 &
+LOAD=$!
+sleep 1
+started=$(date +%s%N)
+send $FIRST "NODE ADD 127.0.0.1:$JOINING"
+while [[ $(send $FIRST "NODE LIST") == *rebalancing:1* ]]; do sleep 0.1; done
+echo "rebalance settled in $(( ($(date +%s%N) - started) / 1000000 )) ms"
+wait $LOAD
+send $FIRST "NODE LIST"
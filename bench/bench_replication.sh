@@ -0,0 +1,49 @@
+#!/bin/bash
+# Write latency and read throughput on a local three-node cluster with one,
+# two and three copies of each key. For every replication factor it runs a
+# PUT-only load and then a GET-only load against node 1, once with reads
+# going to each key's primary and once with READ_FROM=replica.
+# Usage: bench/bench_replication.sh [kvstore_binary] [loadgen_binary] [seconds]
+# WRITE_ACK (one, quorum or all) sets when a write is acknowledged.
+KVSTORE=${1:-./kvstore}
+LOADGEN=${2:-./loadgen}
+SECONDS_PER_RUN=${3:-10}
+PORTS=${PORTS:-"9401 9402 9403"}
+export WRITE_ACK=${WRITE_ACK:-quorum}
+
+NODES=""
+for port in $PORTS; do NODES="$NODES${NODES:+,}0.0.0.0:$port"; done
+export NODES
+FIRST=${PORTS%% *}
+
+run_cluster() {
+    PIDS=""
+    for port in $PORTS; do
+        $KVSTORE $port 2>/dev/null &
+        PIDS="$PIDS $!"
+    done
+    sleep 1
+}
+
+stop_cluster() {
+    kill $PIDS 2>/dev/null
+    wait $PIDS 2>/dev/null
+}
+trap 'stop_cluster' EXIT
+
+for replicas in 1 2 3; do
+    export REPLICAS=$replicas
+    for read_from in primary replica; do
+        export READ_FROM=$read_from
+        run_cluster
+        if [ "$read_from" = primary ]; then
+            echo "== REPLICAS=$replicas WRITE_ACK=$WRITE_ACK: PUT load"
+            $LOADGEN --port $FIRST --connections 8 --seconds $SECONDS_PER_RUN --keys 10000 --get-ratio 0
+        else
+            $LOADGEN --port $FIRST --connections 4 --seconds 2 --keys 10000 --get-ratio 0 > /dev/null
+        fi
+        echo "== REPLICAS=$replicas READ_FROM=$read_from: GET load"
+        $LOADGEN --port $FIRST --connections 8 --seconds $SECONDS_PER_RUN --keys 10000 --get-ratio 1
+        stop_cluster
+    done
+done
@@ -0,0 +1,90 @@
+// Key spread and lookup cost of the consistent hash ring.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_ring bench/bench_ring.cpp
+// Usage: ./bench_ring [nodes] [keys]
+//   nodes defaults to the compose cluster, e.g. "kvstore1:8081,kvstore2:8082:2"
+//   (an optional third field is the node's weight); keys defaults to 1000000.
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+
+static std::vector<Node> parseNodes(const std::string& list) {
+    std::vector<Node> nodes;
+    std::istringstream iss(list);
+    std::string entry;
+    while (std::getline(iss, entry, ',')) {
+        size_t colon = entry.find(':');
+        size_t weight_colon = entry.find(':', colon + 1);
+        int port = std::stoi(entry.substr(colon + 1, weight_colon - colon - 1));
+        uint32_t weight = weight_colon == std::string::npos ? 1 : std::stoul(entry.substr(weight_colon + 1));
+        nodes.emplace_back(entry.substr(0, colon), port, weight);
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const Node& a, const Node& b) { return a.id() < b.id(); });
+    return nodes;
+}
+
+// Ownership as computed before virtual nodes: one hash per node and a linear
+// scan whose comparison never wraps around the ring
+static size_t legacyOwner(const std::vector<uint32_t>& node_hashes, uint32_t key_hash) {
+    size_t target = 0;
+    for (size_t i = 0; i < node_hashes.size(); ++i) {
+        if (node_hashes[i] >= key_hash && node_hashes[i] < node_hashes[target]) target = i;
+    }
+    return target;
+}
+
+static void printSpread(const char* label, const std::vector<Node>& nodes, const std::vector<size_t>& counts,
+                        size_t keys, double ns_per_lookup) {
+    uint32_t total_weight = 0;
+    for (const auto& node : nodes) total_weight += node.weight;
+    double worst = 0;
+    std::printf("%-14s", label);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        double share = 100.0 * counts[i] / keys;
+        double fair = 100.0 * nodes[i].weight / total_weight;
+        worst = std::max(worst, std::abs(share - fair) / fair);
+        std::printf(" %7.2f%%", share);
+    }
+    std::printf("   max dev %6.1f%%   %6.1f ns/lookup\n", 100 * worst, ns_per_lookup);
+}
+
+int main(int argc, char* argv[]) {
+    std::string list = argc > 1 ? argv[1] : "kvstore1:8081,kvstore2:8082,kvstore3:8083";
+    size_t keys = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    std::vector<Node> nodes = parseNodes(list);
+
+    std::vector<uint32_t> key_hashes(keys);
+    for (size_t i = 0; i < keys; ++i) {
+        std::string key = "session:user" + std::to_string(i);
+        key_hashes[i] = MurmurHash3_x86_32(key.c_str(), key.length(), 0);
+    }
+
+    std::printf("%-14s", "vnodes");
+    for (const auto& node : nodes) std::printf(" %8s", node.id().substr(0, 8).c_str());
+    std::printf("\n");
+
+    {
+        std::vector<uint32_t> node_hashes;
+        for (const auto& node : nodes) {
+            std::string id = node.id();
+            node_hashes.push_back(MurmurHash3_x86_32(id.c_str(), id.length(), 0));
+        }
+        std::vector<size_t> counts(nodes.size());
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t h : key_hashes) ++counts[legacyOwner(node_hashes, h)];
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / keys;
+        printSpread("legacy", nodes, counts, keys, ns);
+    }
+
+    for (size_t vnodes : {1, 16, 64, 256, 1024, 4096}) {
+        HashRing ring;
+        ring.build(nodes, vnodes);
+        std::vector<size_t> counts(nodes.size());
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t h : key_hashes) ++counts[ring.ownerOf(h)];
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / keys;
+        char label[32];
+        snprintf(label, sizeof(label), "%zu (%zu tok)", vnodes, ring.size());
+        printSpread(label, nodes, counts, keys, ns);
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+// Latency of a cluster-wide PREFIX against the same scan served by each node
+// alone. Loads N keys through the first node, then times a local-only PREFIX
+// on every node (the binary peer flag) and the full scan through the first
+// node, which fans out to its peers and merges their pages.
+// Build: g++ -O2 -std=c++17 -pthread -o bench_scan bench/bench_scan.cpp
+// Usage: ./bench_scan [nodes] [keys] [iterations]
+//   defaults: 127.0.0.1:8081,127.0.0.1:8082,127.0.0.1:8083 100000 50
+#include "../kvstore.cpp"
+#include <cstdio>
+#include <cstdlib>
+
+static int connectTo(const Node& node) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(node.port);
+    inet_pton(AF_INET, node.ip.c_str(), &addr.sin_addr);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        std::perror("connect");
+        std::exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void sendAll(int fd, const std::string& data) {
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+        if (n <= 0) std::exit(1);
+        sent += n;
+    }
+}
+
+// Reads replies until `count` final frames have arrived; returns the keys received
+static size_t readReplies(int fd, std::string& in, size_t count, bool& incomplete) {
+    size_t keys = 0;
+    char buf[65536];
+    while (count > 0) {
+        uint32_t id;
+        Reply reply;
+        size_t consumed;
+        ParseStatus status = parseBinaryReply(in, id, reply, consumed);
+        if (status == ParseStatus::Invalid) std::exit(1);
+        if (status == ParseStatus::Incomplete) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) std::exit(1);
+            in.append(buf, n);
+            continue;
+        }
+        in.erase(0, consumed);
+        keys += reply.keys.size();
+        if (reply.status != Status::Partial) {
+            incomplete |= reply.incomplete;
+            --count;
+        }
+    }
+    return keys;
+}
+
+struct Result {
+    double p50_ms, p99_ms;
+    size_t keys;
+    bool incomplete;
+};
+
+static Result timeScan(int fd, uint16_t flags, size_t iterations) {
+    Command cmd;
+    cmd.op = Op::Prefix;
+    cmd.key = "scan:";
+    std::vector<double> ms;
+    std::string in;
+    Result result{0, 0, 0, false};
+    for (size_t i = 0; i < iterations; ++i) {
+        std::string request;
+        appendBinaryRequest(request, i + 1, flags, cmd);
+        auto start = std::chrono::steady_clock::now();
+        sendAll(fd, request);
+        result.keys = readReplies(fd, in, 1, result.incomplete);
+        ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(ms.begin(), ms.end());
+    result.p50_ms = ms[ms.size() / 2];
+    result.p99_ms = ms[std::min(ms.size() - 1, ms.size() * 99 / 100)];
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    std::string list = argc > 1 ? argv[1] : "127.0.0.1:8081,127.0.0.1:8082,127.0.0.1:8083";
+    size_t keys = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100000;
+    size_t iterations = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 50;
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<Node> nodes;
+    std::istringstream iss(list);
+    std::string entry;
+    while (std::getline(iss, entry, ',')) {
+        size_t colon = entry.find(':');
+        nodes.emplace_back(entry.substr(0, colon), std::stoi(entry.substr(colon + 1)));
+    }
+
+    // Load in pipelined batches through the first node, which routes each key
+    int loader = connectTo(nodes[0]);
+    std::string in;
+    bool ignored = false;
+    for (size_t base = 0; base < keys; base += 1000) {
+        std::string batch;
+        size_t count = std::min<size_t>(1000, keys - base);
+        for (size_t i = base; i < base + count; ++i) {
+            char key[32];
+            snprintf(key, sizeof(key), "scan:%010zu", i);
+            Command put;
+            put.op = Op::Put;
+            put.key = key;
+            put.value = "v";
+            appendBinaryRequest(batch, i + 1, 0, put);
+        }
+        sendAll(loader, batch);
+        readReplies(loader, in, count, ignored);
+    }
+    close(loader);
+
+    std::printf("%-24s %10s %10s %10s\n", "scan", "keys", "p50_ms", "p99_ms");
+    double slowest = 0, sum = 0;
+    for (const auto& node : nodes) {
+        int fd = connectTo(node);
+        Result r = timeScan(fd, kFlagLocal, iterations);
+        close(fd);
+        std::printf("%-24s %10zu %10.2f %10.2f\n", ("local " + node.id()).c_str(), r.keys, r.p50_ms, r.p99_ms);
+        slowest = std::max(slowest, r.p50_ms);
+        sum += r.p50_ms;
+    }
+    int fd = connectTo(nodes[0]);
+    Result r = timeScan(fd, 0, iterations);
+    close(fd);
+    std::printf("%-24s %10zu %10.2f %10.2f%s\n", "cluster", r.keys, r.p50_ms, r.p99_ms,
+                r.incomplete ? " (incomplete)" : "");
+    std::printf("slowest node p50 %.2f ms, sum of nodes p50 %.2f ms\n", slowest, sum);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Write throughput and latency under each write-ahead log fsync policy.
+# Runs a PUT-only load against a single node for every policy, first with
+# one connection and then with many, so the group-commit effect of batching
+# concurrent writes into one fdatasync shows up in the "always" rows.
+# Usage: bench/bench_wal.sh [kvstore_binary] [loadgen_binary] [seconds] [data_dir]
+# data_dir should be on the disk being measured; it is wiped before every run.
+KVSTORE=${1:-./kvstore}
+LOADGEN=${2:-./loadgen}
+SECONDS_PER_RUN=${3:-10}
+DATA=${4:-$(mktemp -d)}
+PORT=${PORT:-9301}
+CONNECTIONS=${CONNECTIONS:-"1 32"}
+
+export NODES="0.0.0.0:$PORT"
+for policy in memory never 1000 10 always; do
+    rm -rf "$DATA"/wal-*.log
+    if [ "$policy" = memory ]; then
+        DATA_DIR= $KVSTORE $PORT 2>/dev/null &
+    else
+        DATA_DIR=$DATA FSYNC=$policy $KVSTORE $PORT 2>/dev/null &
+    fi
+    NODE=$!
+    sleep 1
+    for connections in $CONNECTIONS; do
+        echo "== FSYNC=$policy, $connections connections"
+        $LOADGEN --port $PORT --connections $connections --seconds $SECONDS_PER_RUN --keys 100000 --get-ratio 0
+    done
+    kill $NODE
+    wait $NODE 2>/dev/null
+done
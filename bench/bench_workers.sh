@@ -0,0 +1,45 @@
+#!/bin/bash
+# How throughput scales with worker threads on one node. Starts the node with
+# each WORKERS count in turn (default 1, 2, 4, ... up to the number of cores),
+# preloads the keys, then runs the same mixed load and prints ops/s, p99 and
+# the speedup over the first count. Keep the load generator's threads off the
+# node's cores (e.g. with taskset) when the machine has cores to spare, or it
+# competes with the workers it is measuring.
+# Usage: bench/bench_workers.sh [kvstore_binary] [loadgen_binary] [seconds]
+# WORKER_COUNTS overrides the counts; GET_RATIO (default 0.9), CONNECTIONS
+# (default 32) and KEYS (default 100000) shape the load.
+KVSTORE=${1:-./kvstore}
+LOADGEN=${2:-./loadgen}
+SECONDS_PER_RUN=${3:-10}
+PORT=${PORT:-9901}
+KEYS=${KEYS:-100000}
+CONNECTIONS=${CONNECTIONS:-32}
+GET_RATIO=${GET_RATIO:-0.9}
+if [ -z "$WORKER_COUNTS" ]; then
+    cores=$(nproc)
+    for ((w = 1; w <= cores; w *= 2)); do WORKER_COUNTS="$WORKER_COUNTS $w"; done
+fi
+OUT=$(mktemp)
+
+stop_node() {
+    kill $PID 2>/dev/null
+    wait $PID 2>/dev/null
+}
+trap 'stop_node; rm -f $OUT' EXIT
+
+echo "cores: $(nproc)"
+printf "%8s %12s %10s %8s\n" workers "ops/s" "p99 us" speedup
+base=""
+for workers in $WORKER_COUNTS; do
+    WORKERS=$workers $KVSTORE $PORT 2>/dev/null &
+    PID=$!
+    sleep 1
+    $LOADGEN --port $PORT --connections 4 --seconds 1 --keys $KEYS --preload --get-ratio 0 > /dev/null
+    $LOADGEN --port $PORT --connections $CONNECTIONS --seconds $SECONDS_PER_RUN --keys $KEYS \
+        --get-ratio $GET_RATIO > $OUT
+    stop_node
+    ops=$(grep '^ops/s:' $OUT | awk '{print $2}')
+    p99=$(grep '^p99 us:' $OUT | awk '{print $3}')
+    base=${base:-$ops}
+    printf "%8s %12s %10s %8s\n" $workers $ops $p99 $(awk "BEGIN {printf \"%.2f\", $ops / $base}")
+done
@@ -1,123 +1,45 @@
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <sys/time.h>
-#include <unistd.h>
+// Interactive client. Reads text protocol commands from stdin and sends each
+// one through KVClient, straight to the node that owns its key.
+// Build: g++ -O2 -std=c++17 -pthread -o client client.cpp
+// Usage: ./client [host:port,...]   (default 127.0.0.1:8081)
+#include "kvclient.cpp"
 #include <iostream>
-#include <string>
-#include <cstring>
-#include <vector>
-#include <poll.h>
+#include <sstream>
 
-bool connectToServer(int& sock) {
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        std::cerr << "Failed to create socket: " << strerror(errno) << std::endl;
-        return false;
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<std::string> seeds;
+    std::istringstream list(argc > 1 ? argv[1] : "127.0.0.1:8081");
+    for (std::string seed; std::getline(list, seed, ',');) {
+        if (!seed.empty()) seeds.push_back(seed);
     }
-   
-    sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_port = htons(8081);
-    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
-
-    if (connect(sock, (sockaddr*)&server, sizeof(server)) == -1) {
-        std::cerr << "Failed to connect to server: " << strerror(errno) << std::endl;
-        close(sock);
-        return false;
-    }
-    std::cerr << "Connected to server 127.0.0.1:8081" << std::endl;
-    return true;
-}
-
-std::string sendRequest(int sock, const std::string& request) {
-    std::string msg = request + "\n";
-    if (write(sock, msg.c_str(), msg.length()) == -1) {
-        std::cerr << "Failed to send request: " << strerror(errno) << std::endl;
-        return "";
-    }
-    std::cerr << "Sent request: " << request << std::endl;
-
-    std::vector<char> buffer(1024);
-    std::string response;
-    struct pollfd fd;
-    fd.fd = sock;
-    fd.events = POLLIN;
-
-    // Retry up to 3 times with timeout
-    for (int attempt = 0; attempt < 3; ++attempt) {
-        int ret = poll(&fd, 1, 1000); // 1-second timeout
-        if (ret == -1) {
-            std::cerr << "Poll error: " << strerror(errno) << std::endl;
-            return "";
-        }
-        if (ret == 0) {
-            std::cerr << "Timeout waiting for response, attempt " << attempt + 1 << std::endl;
-            continue;
-        }
-
-        ssize_t bytes = read(sock, buffer.data(), buffer.size() - 1);
-        if (bytes == -1) {
-            std::cerr << "Failed to read response: " << strerror(errno) << std::endl;
-            return "";
-        }
-        if (bytes == 0) {
-            std::cerr << "Server disconnected" << std::endl;
-            return "";
-        }
-
-        buffer[bytes] = '\0';
-        response += buffer.data();
-        if (response.back() == '\n') break; // Stop at newline
+    if (seeds.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [host:port,...]" << std::endl;
+        return 1;
     }
 
-    if (response.empty()) {
-        std::cerr << "No response after retries" << std::endl;
-        return "";
+    KVClient client(seeds);
+    if (!client.connect()) {
+        std::cerr << "No node answered NODE LIST; sending requests to " << seeds.front() << std::endl;
+    } else {
+        std::cerr << "Connected to " << client.members().size() << " nodes" << std::endl;
     }
 
-    // Remove trailing newline
-    if (!response.empty() && response.back() == '\n') {
-        response.pop_back();
-    }
-    std::cerr << "Received response: " << response << std::endl;
-    return response;
-}
-
-int main() {
-    int sock = -1;
-    if (!connectToServer(sock)) {
-        return 1;
-    }
-
-    std::string command;
+    std::string line;
     while (true) {
         std::cout << "Enter command (PUT <key> <value>, GET <key>, RANGE <start> <end>, PREFIX <prefix>, or QUIT): ";
-        std::getline(std::cin, command);
-        if (command == "QUIT") break;
-        if (command.empty()) continue;
-
-        std::string response = sendRequest(sock, command);
-        if (response.empty()) {
-            std::cerr << "Connection lost, attempting to reconnect" << std::endl;
-            close(sock);
-            if (!connectToServer(sock)) {
-                std::cerr << "Reconnection failed, exiting" << std::endl;
-                break;
-            }
-            // Retry the command
-            response = sendRequest(sock, command);
-        }
+        if (!std::getline(std::cin, line) || line == "QUIT") break;
+        if (line.empty()) continue;
 
-        if (!response.empty()) {
-            std::cout << "Response: " << response << std::endl;
-        } else {
-            std::cout << "No response received" << std::endl;
+        RequestView req;
+        std::string error;
+        if (!parseTextRequest(line, req, error)) {
+            std::cout << "Response: " << error << std::endl;
+            continue;
         }
-    }
-
-    if (sock != -1) {
-        close(sock);
-        std::cerr << "Closed client socket" << std::endl;
+        Command cmd = toCommand(req);
+        Reply reply = client.call(cmd);
+        std::cout << "Response: " << formatReply(cmd.op, reply) << std::endl;
     }
     return 0;
 }
@@ -0,0 +1,483 @@
+// Client library for the binary protocol. It reads the member list from any
+// node (NODE LIST), places keys on the same consistent hash ring the nodes
+// use, and sends each request straight to the node that owns its key, so no
+// node has to forward it. Each node gets one persistent connection with any
+// number of requests in flight. MGET, MPUT and MDEL are split into one
+// sub-batch per owner and sent all at once.
+//
+// Calls only queue requests; poll() sends them and runs the callbacks of the
+// replies that have arrived, and wait() polls until none are outstanding. A
+// KVClient is not thread-safe; use one per thread.
+//
+// The ring is only a hint. Requests go out as ordinary client requests, so a
+// node whose ring differs still routes them correctly, at the cost of a hop.
+// The member list is read again every ClientOptions::refresh and whenever a node
+// cannot be reached; until then that node's keys go through another node.
+#include "kvstore.cpp"
+#include <netdb.h>
+#include <poll.h>
+
+struct ClientOptions {
+    bool route = true; // Send keys to their owners; false sends everything to the first seed
+    std::chrono::milliseconds timeout{1000}; // A request not answered by then fails
+    std::chrono::milliseconds refresh{1000}; // How often the member list is read again
+    std::chrono::milliseconds retry{1000};   // Wait before reconnecting to a node that failed
+};
+
+class KVClient {
+public:
+    using Callback = std::function<void(Reply&&)>;
+    using Clock = std::chrono::steady_clock;
+    using Options = ClientOptions;
+
+private:
+    struct Call {
+        Callback done;
+        Clock::time_point deadline;
+        Reply partial; // Keys of a streamed scan received so far
+    };
+
+    // A persistent connection to one node
+    struct Link {
+        std::string id; // host:port
+        std::string host;
+        int port = 0;
+        int fd = -1;
+        std::string out;
+        size_t out_offset = 0;
+        std::string in;
+        std::unordered_map<uint32_t, Call> inflight;
+        uint32_t next_id = 1;
+        Clock::time_point retry_after;
+    };
+
+    Options options;
+    std::vector<std::string> seeds; // host:port
+    std::unordered_map<std::string, std::unique_ptr<Link>> links;
+    // The cluster as of the last NODE LIST
+    std::vector<Node> nodes;
+    HashRing ring;
+    RingHash hash = RingHash::Murmur3;
+    uint64_t version = 0;
+    bool fetching = false; // A NODE LIST is in flight
+    Clock::time_point next_refresh;
+    size_t outstanding_ = 0;
+
+    Link& link(const std::string& id) {
+        auto it = links.find(id);
+        if (it != links.end()) return *it->second;
+        auto l = std::make_unique<Link>();
+        l->id = id;
+        uint32_t weight;
+        if (!parseNodeSpec(id, l->host, l->port, weight)) l->port = 0;
+        return *links.emplace(id, std::move(l)).first->second;
+    }
+
+    // Connects in blocking mode, then switches the socket to non-blocking
+    bool open(Link& l) {
+        if (l.fd != -1) return true;
+        if (l.port == 0 || Clock::now() < l.retry_after) return false;
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        std::string service = std::to_string(l.port);
+        if (getaddrinfo(l.host.c_str(), service.c_str(), &hints, &result) != 0 || !result) {
+            l.retry_after = Clock::now() + options.retry;
+            return false;
+        }
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd != -1 && ::connect(fd, result->ai_addr, result->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        if (fd == -1) {
+            l.retry_after = Clock::now() + options.retry;
+            return false;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        l.fd = fd;
+        return true;
+    }
+
+    // Fails every request in flight on l and closes it
+    void fail(Link& l, const char* why) {
+        if (l.fd != -1) close(l.fd);
+        l.fd = -1;
+        l.out.clear();
+        l.out_offset = 0;
+        l.in.clear();
+        l.retry_after = Clock::now() + options.retry;
+        next_refresh = Clock::now(); // The membership may have changed
+        std::unordered_map<uint32_t, Call> calls;
+        calls.swap(l.inflight);
+        for (auto& [id, call] : calls) finish(call, errorReply(why));
+    }
+
+    void finish(Call& call, Reply&& reply) {
+        --outstanding_;
+        call.done(std::move(reply));
+    }
+
+    static Reply errorReply(const char* message) {
+        Reply reply;
+        reply.status = Status::Error;
+        reply.value = message;
+        return reply;
+    }
+
+    // The node a request for key goes to, or empty if none can be reached
+    std::string target(std::string_view key) {
+        if (options.route && !nodes.empty() && !key.empty()) {
+            Link& owner = link(nodes[ring.ownerOf(ringHash(hash, key))].id());
+            if (open(owner)) return owner.id;
+        }
+        for (const std::string& seed : seeds) {
+            if (open(link(seed))) return seed;
+        }
+        for (const Node& node : nodes) {
+            if (open(link(node.id()))) return node.id();
+        }
+        return std::string();
+    }
+
+    // Reads the member list from some node and rebuilds the ring if it changed
+    void refresh() {
+        if (fetching || !options.route) return;
+        fetching = true;
+        next_refresh = Clock::now() + options.refresh;
+        Command list;
+        list.op = Op::Node;
+        list.key = "LIST";
+        send(target(std::string_view()), list, [this](Reply&& reply) {
+            fetching = false;
+            if (reply.status == Status::Ok) install(reply.value);
+        });
+    }
+
+    // Takes up a NODE LIST reply: "version:N members:... rebalancing:R hash:H vnodes:V"
+    void install(std::string_view text) {
+        uint64_t new_version = 0;
+        std::vector<Node> members;
+        RingHash new_hash = RingHash::Murmur3;
+        size_t vnodes = Config().vnodes; // Nodes that do not report it use the default
+        while (!text.empty()) {
+            std::string_view field = nextToken(text);
+            size_t colon = field.find(':');
+            if (colon == std::string_view::npos) continue;
+            std::string_view name = field.substr(0, colon), value = field.substr(colon + 1);
+            if (name == "version") {
+                std::from_chars(value.data(), value.data() + value.size(), new_version);
+            } else if (name == "members") {
+                if (!parseMembers(value, members)) return;
+            } else if (name == "hash") {
+                new_hash = value == ringHashName(RingHash::Crc32c) ? RingHash::Crc32c : RingHash::Murmur3;
+            } else if (name == "vnodes") {
+                std::from_chars(value.data(), value.data() + value.size(), vnodes);
+            }
+        }
+        if (members.empty() || (!nodes.empty() && new_version == version)) return;
+        version = new_version;
+        hash = new_hash;
+        nodes = std::move(members);
+        ring.build(nodes, vnodes, hash);
+    }
+
+    bool flush(Link& l) {
+        while (l.out_offset < l.out.size()) {
+            ssize_t n = write(l.fd, l.out.data() + l.out_offset, l.out.size() - l.out_offset);
+            if (n > 0) {
+                l.out_offset += n;
+            } else if (n == -1 && errno == EINTR) {
+                continue;
+            } else {
+                return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+        }
+        l.out.clear();
+        l.out_offset = 0;
+        return true;
+    }
+
+    // Reads what has arrived on l and completes the requests it answers
+    bool receive(Link& l) {
+        char buffer[65536];
+        while (true) {
+            ssize_t n = read(l.fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                l.in.append(buffer, n);
+                continue;
+            }
+            if (n == -1 && errno == EINTR) continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return false;
+            break;
+        }
+        size_t offset = 0;
+        while (true) {
+            uint32_t id;
+            Reply reply;
+            size_t consumed;
+            ParseStatus status = parseBinaryReply(std::string_view(l.in).substr(offset), id, reply, consumed);
+            if (status == ParseStatus::Incomplete) break;
+            if (status != ParseStatus::Ok) return false;
+            offset += consumed;
+            auto it = l.inflight.find(id);
+            if (it == l.inflight.end()) continue; // Timed out already
+            Call& call = it->second;
+            if (reply.status == Status::Partial || !call.partial.keys.empty()) {
+                // A streamed scan: keep the keys until the final frame
+                for (auto& key : reply.keys) call.partial.keys.push_back(std::move(key));
+                for (auto& value : reply.values) call.partial.values.push_back(std::move(value));
+                if (reply.status == Status::Partial) continue;
+                call.partial.status = reply.status;
+                call.partial.more = reply.more;
+                call.partial.incomplete = reply.incomplete;
+                call.partial.snapshot = std::move(reply.snapshot);
+                reply = std::move(call.partial);
+            }
+            Call done = std::move(call);
+            l.inflight.erase(it);
+            finish(done, std::move(reply));
+        }
+        l.in.erase(0, offset);
+        return true;
+    }
+
+    // Callbacks may send more requests, so they run once the links are no longer being walked
+    void expire(Clock::time_point now) {
+        std::vector<Call> expired;
+        for (auto& [id, l] : links) {
+            for (auto it = l->inflight.begin(); it != l->inflight.end();) {
+                if (now < it->second.deadline) {
+                    ++it;
+                    continue;
+                }
+                expired.push_back(std::move(it->second));
+                it = l->inflight.erase(it);
+            }
+        }
+        for (Call& call : expired) finish(call, errorReply("ERROR: timed out"));
+    }
+
+public:
+    // seeds are "host:port" nodes to read the member list from; the first
+    // also takes every request when routing is off
+    explicit KVClient(std::vector<std::string> seeds, Options options = Options())
+        : options(options), seeds(std::move(seeds)) {}
+
+    ~KVClient() {
+        for (auto& [id, l] : links) {
+            if (l->fd != -1) close(l->fd);
+        }
+    }
+
+    KVClient(const KVClient&) = delete;
+    KVClient& operator=(const KVClient&) = delete;
+
+    // Reads the member list; false if no seed answered. Routing waits for it,
+    // but requests may be sent before: they go to a seed.
+    bool connect() {
+        if (!options.route) return open(link(seeds.front()));
+        refresh();
+        wait();
+        return !nodes.empty();
+    }
+
+    // Sends cmd to the node host:port as it is; done runs from poll()
+    void send(const std::string& node, const Command& cmd, Callback&& done) {
+        ++outstanding_;
+        Link& l = link(node);
+        if (node.empty() || !open(l)) {
+            --outstanding_;
+            done(errorReply("ERROR: no node reachable"));
+            return;
+        }
+        uint32_t id = l.next_id++;
+        if (id == 0) id = l.next_id++;
+        appendBinaryRequest(l.out, id, 0, cmd);
+        l.inflight.emplace(id, Call{std::move(done), Clock::now() + options.timeout, Reply()});
+    }
+
+    // Sends cmd to the node that owns its key; batches are split by owner
+    void execute(const Command& cmd, Callback&& done) {
+        if (cmd.op == Op::MGet || cmd.op == Op::MPut || cmd.op == Op::MDel) {
+            executeBatch(cmd, std::move(done));
+            return;
+        }
+        bool keyed = cmd.op == Op::Get || cmd.op == Op::Put || cmd.op == Op::Remove || cmd.op == Op::Cas;
+        send(target(keyed ? std::string_view(cmd.key) : std::string_view()), cmd, std::move(done));
+    }
+
+    // One sub-batch per owner; the replies are put back in request order
+    void executeBatch(const Command& cmd, Callback&& done) {
+        if (cmd.items.empty()) {
+            done(errorReply("ERROR: no keys"));
+            return;
+        }
+        std::unordered_map<std::string, std::pair<Command, std::vector<size_t>>> groups;
+        for (size_t i = 0; i < cmd.items.size(); ++i) {
+            auto& group = groups[target(cmd.items[i].first)];
+            group.first.items.push_back(cmd.items[i]);
+            group.second.push_back(i);
+        }
+        struct Gather {
+            Reply reply;
+            size_t pending = 0;
+            Callback done;
+        };
+        auto gather = std::make_shared<Gather>();
+        if (cmd.op != Op::MPut) gather->reply.found.resize(cmd.items.size());
+        if (cmd.op == Op::MGet) gather->reply.values.resize(cmd.items.size());
+        gather->pending = groups.size();
+        gather->done = std::move(done);
+        for (auto& [node, group] : groups) {
+            group.first.op = cmd.op;
+            send(node, group.first, [gather, positions = std::move(group.second)](Reply&& reply) {
+                Reply& result = gather->reply;
+                bool complete = reply.found.size() == (result.found.empty() ? 0 : positions.size());
+                if (reply.status != Status::Ok || !complete) {
+                    result.status = Status::Error;
+                    if (result.value.empty()) result.value = reply.value.empty() ? "ERROR" : reply.value;
+                } else {
+                    for (size_t j = 0; j < reply.found.size(); ++j) {
+                        result.found[positions[j]] = reply.found[j];
+                        if (!result.values.empty()) result.values[positions[j]] = std::move(reply.values[j]);
+                    }
+                }
+                if (--gather->pending == 0) gather->done(std::move(result));
+            });
+        }
+    }
+
+    void get(const std::string& key, Callback&& done) {
+        Command cmd;
+        cmd.op = Op::Get;
+        cmd.key = key;
+        execute(cmd, std::move(done));
+    }
+
+    // ttl in seconds; 0 for none
+    void put(const std::string& key, const std::string& value, Callback&& done, uint32_t ttl = 0) {
+        Command cmd;
+        cmd.op = Op::Put;
+        cmd.key = key;
+        cmd.value = value;
+        if (ttl) cmd.expires = expiryAfter(ttl);
+        execute(cmd, std::move(done));
+    }
+
+    // The reply's version is the one a CAS of the key expects
+    void getVersioned(const std::string& key, Callback&& done) {
+        Command cmd;
+        cmd.op = Op::Get;
+        cmd.key = key;
+        cmd.versioned = true;
+        execute(cmd, std::move(done));
+    }
+
+    // Writes the key only if its version is expected (0: only if it does not
+    // exist). Replies Ok with the new version, or Conflict with the current one.
+    void cas(const std::string& key, uint64_t expected, const std::string& value, Callback&& done,
+             uint32_t ttl = 0) {
+        Command cmd;
+        cmd.op = Op::Cas;
+        cmd.key = key;
+        cmd.expected = expected;
+        cmd.value = value;
+        if (ttl) cmd.expires = expiryAfter(ttl);
+        execute(cmd, std::move(done));
+    }
+
+    void remove(const std::string& key, Callback&& done) {
+        Command cmd;
+        cmd.op = Op::Remove;
+        cmd.key = key;
+        execute(cmd, std::move(done));
+    }
+
+    void mget(const std::vector<std::string>& keys, Callback&& done) {
+        Command cmd;
+        cmd.op = Op::MGet;
+        for (const auto& key : keys) cmd.items.emplace_back(key, std::string());
+        executeBatch(cmd, std::move(done));
+    }
+
+    void mput(const std::vector<std::pair<std::string, std::string>>& items, Callback&& done) {
+        Command cmd;
+        cmd.op = Op::MPut;
+        cmd.items = items;
+        executeBatch(cmd, std::move(done));
+    }
+
+    void mdel(const std::vector<std::string>& keys, Callback&& done) {
+        Command cmd;
+        cmd.op = Op::MDel;
+        for (const auto& key : keys) cmd.items.emplace_back(key, std::string());
+        executeBatch(cmd, std::move(done));
+    }
+
+    // Sends what is queued, waits up to timeout for replies and runs the
+    // callbacks of those that arrived
+    void poll(std::chrono::milliseconds timeout = std::chrono::milliseconds(100)) {
+        auto now = Clock::now();
+        if (options.route && now >= next_refresh) refresh();
+        std::vector<Link*> open_links; // Stable while callbacks add links
+        for (auto& [id, l] : links) {
+            if (l->fd != -1) open_links.push_back(l.get());
+        }
+        std::vector<pollfd> fds;
+        std::vector<Link*> polled;
+        for (Link* l : open_links) {
+            if (!flush(*l)) {
+                fail(*l, "ERROR: connection lost");
+                continue;
+            }
+            if (l->fd == -1 || l->inflight.empty()) continue;
+            fds.push_back({l->fd, static_cast<short>(POLLIN | (l->out.empty() ? 0 : POLLOUT)), 0});
+            polled.push_back(l);
+        }
+        if (!fds.empty() && ::poll(fds.data(), fds.size(), static_cast<int>(timeout.count())) > 0) {
+            for (size_t i = 0; i < fds.size(); ++i) {
+                Link& l = *polled[i];
+                if (!fds[i].revents || l.fd != fds[i].fd) continue;
+                if ((fds[i].revents & POLLOUT) && !flush(l)) {
+                    fail(l, "ERROR: connection lost");
+                } else if ((fds[i].revents & (POLLIN | POLLERR | POLLHUP)) && !receive(l)) {
+                    fail(l, "ERROR: connection lost");
+                }
+            }
+        }
+        expire(Clock::now());
+    }
+
+    // Polls until every request has its reply
+    void wait() {
+        while (outstanding_ > 0) poll();
+    }
+
+    // Runs one command and waits for its reply
+    Reply call(const Command& cmd) {
+        Reply result;
+        execute(cmd, [&result](Reply&& reply) { result = std::move(reply); });
+        wait();
+        return result;
+    }
+
+    // Requests sent whose callbacks have not run yet
+    size_t outstanding() const {
+        return outstanding_;
+    }
+
+    // host:port of the node a key is sent to, or empty before the member list is known
+    std::string ownerOf(std::string_view key) const {
+        if (nodes.empty()) return std::string();
+        return nodes[ring.ownerOf(ringHash(hash, key))].id();
+    }
+
+    const std::vector<Node>& members() const {
+        return nodes;
+    }
+};
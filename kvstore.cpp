@@ -1,5 +1,6 @@
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <functional>
 #include <arpa/inet.h>
@@ -8,15 +9,363 @@
 #include <atomic>
 #include <thread>
 #include <queue>
+#include <mutex>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
 #include <algorithm>
 #include <sstream>
 #include <cstring>
+#include <string_view>
 #include <iostream>
 #include <chrono>
 #include <thread>
-#include <sys/ioctl.h>
+#include <netdb.h>
+#include <ifaddrs.h>
 #include <sys/resource.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <poll.h>
+#include <array>
+#include <charconv>
+#include <limits>
+#include <memory_resource>
+#include <cstdio>
+#include <condition_variable>
+#include <ctime>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// Log levels, lowest first
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error };
+
+// Statements below this level are compiled out entirely: build with
+// -DKV_LOG_MIN_LEVEL=1 to drop every LOG_DEBUG, arguments included
+#ifndef KV_LOG_MIN_LEVEL
+#define KV_LOG_MIN_LEVEL 0
+#endif
+
+// Whether statements at this level are compiled in. Compares enum values, not
+// against the literal 0, so the default build does not trip -Wtype-limits
+constexpr bool logCompiled(LogLevel level) {
+    return level >= static_cast<LogLevel>(KV_LOG_MIN_LEVEL);
+}
+
+// Leveled asynchronous logger. A statement formats its message and
+// key=value fields into the calling thread's own ring buffer, without
+// locks or syscalls; a background thread drains every ring every few
+// milliseconds and writes the lines to stderr in one write() per batch.
+// A record that finds its ring full is dropped and counted, so a slow
+// stderr never stalls a worker. Lines look like
+//
+//   2024-05-01T12:00:00.123456Z INFO worker-0 Accepted client peer=10.0.0.7:51234
+class Log {
+public:
+    static constexpr size_t kMaxRecord = 1024;  // Longer lines are truncated
+    static constexpr size_t kRingBytes = 256 << 10; // Per thread
+
+    // One line being formatted on the caller's stack
+    class Line {
+    public:
+        void append(std::string_view text) {
+            size_t n = std::min(text.size(), sizeof(buffer) - size);
+            memcpy(buffer + size, text.data(), n);
+            size += n;
+        }
+
+        void field(std::string_view key, std::string_view value) {
+            append(" ");
+            append(key);
+            append("=");
+            // Values with spaces, quotes or line breaks are quoted so a line stays one record
+            bool quote = value.empty() || value.find_first_of(" \"\n\r\t") != std::string_view::npos;
+            if (!quote) {
+                append(value);
+                return;
+            }
+            append("\"");
+            for (char c : value) {
+                if (c == '"' || c == '\\') append("\\");
+                append(c == '\n' ? "\\n" : c == '\r' ? "\\r" : c == '\t' ? "\\t" : std::string_view(&c, 1));
+            }
+            append("\"");
+        }
+
+        void field(std::string_view key, const char* value) { field(key, std::string_view(value ? value : "")); }
+        void field(std::string_view key, const std::string& value) { field(key, std::string_view(value)); }
+        void field(std::string_view key, bool value) { field(key, value ? "true" : "false"); }
+        void field(std::string_view key, double value) {
+            char text[32];
+            field(key, std::string_view(text, snprintf(text, sizeof(text), "%.3f", value)));
+        }
+
+        template<typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+        void field(std::string_view key, T value) {
+            char text[24];
+            auto [end, ec] = std::to_chars(text, text + sizeof(text), value);
+            field(key, std::string_view(text, end - text));
+        }
+
+        std::string_view text() const { return std::string_view(buffer, size); }
+
+    private:
+        char buffer[kMaxRecord];
+        size_t size = 0;
+    };
+
+    static bool enabled(LogLevel level) {
+        return static_cast<uint8_t>(level) >= min_level.load(std::memory_order_relaxed);
+    }
+
+    static void setLevel(LogLevel level) {
+        min_level.store(static_cast<uint8_t>(level), std::memory_order_relaxed);
+    }
+
+    // Names the calling thread in its lines, e.g. "worker-3"
+    static void setThreadName(const std::string& name) {
+        Ring& ring = ringForThread();
+        std::lock_guard<std::mutex> lock(flusher().mutex);
+        drain(); // Lines logged under the old name keep it
+        ring.name = name;
+    }
+
+    // message, then alternating field names and values
+    template<typename... Fields>
+    static void write(LogLevel level, std::string_view message, const Fields&... fields) {
+        static_assert(sizeof...(fields) % 2 == 0, "log fields come in name, value pairs");
+        Line line;
+        line.append(message);
+        appendFields(line, fields...);
+        publish(level, line.text());
+    }
+
+    // In a child forked from a threaded process there is no flusher: log synchronously
+    static void afterFork() {
+        synchronous = true;
+    }
+
+private:
+    struct Ring {
+        std::array<char, kRingBytes> data;
+        alignas(64) std::atomic<size_t> head{0}; // Consumer position
+        alignas(64) std::atomic<size_t> tail{0}; // Producer position
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> closed{false};         // Its thread has exited
+        std::string name;
+    };
+
+    // Record in a ring: length(2) level(1) unix_micros(8) text
+    static constexpr size_t kRecordHeader = 11;
+
+    struct Flusher {
+        std::mutex mutex; // Held while draining, and while the ring list changes
+        std::condition_variable wake;
+        std::vector<std::shared_ptr<Ring>> rings;
+        std::thread thread;
+        bool stopping = false;
+        std::string batch;
+
+        ~Flusher() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            if (thread.joinable()) thread.join();
+        }
+    };
+
+    // Marks its thread's ring closed when the thread exits
+    struct RingOwner {
+        std::shared_ptr<Ring> ring;
+        ~RingOwner() {
+            if (ring) ring->closed = true;
+        }
+    };
+
+    static inline std::atomic<uint8_t> min_level{static_cast<uint8_t>(LogLevel::Info)};
+    static inline bool synchronous = false;
+
+    static Flusher& flusher() {
+        static Flusher instance;
+        return instance;
+    }
+
+    static Ring& ringForThread() {
+        thread_local RingOwner owner;
+        if (!owner.ring) {
+            owner.ring = std::make_shared<Ring>();
+            Flusher& f = flusher();
+            std::lock_guard<std::mutex> lock(f.mutex);
+            owner.ring->name = f.rings.empty() ? "main" : "thread-" + std::to_string(f.rings.size());
+            f.rings.push_back(owner.ring);
+            if (!f.thread.joinable()) f.thread = std::thread(run);
+        }
+        return *owner.ring;
+    }
+
+    static void appendFields(Line&) {}
+
+    template<typename Value, typename... Rest>
+    static void appendFields(Line& line, std::string_view key, const Value& value, const Rest&... rest) {
+        line.field(key, value);
+        appendFields(line, rest...);
+    }
+
+    static uint64_t unixMicros() {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    static void publish(LogLevel level, std::string_view text) {
+        if (synchronous) {
+            std::string out;
+            formatLine(out, level, unixMicros(), "child", text);
+            writeAll(out);
+            return;
+        }
+        Ring& ring = ringForThread();
+        size_t need = kRecordHeader + text.size();
+        size_t tail = ring.tail.load(std::memory_order_relaxed);
+        if (tail + need - ring.head.load(std::memory_order_acquire) > kRingBytes) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        char header[kRecordHeader];
+        header[0] = static_cast<char>(text.size() >> 8);
+        header[1] = static_cast<char>(text.size());
+        header[2] = static_cast<char>(level);
+        uint64_t micros = unixMicros();
+        memcpy(header + 3, &micros, sizeof(micros));
+        copyIn(ring, tail, std::string_view(header, sizeof(header)));
+        copyIn(ring, tail + kRecordHeader, text);
+        ring.tail.store(tail + need, std::memory_order_release);
+        // Errors go out promptly in case the process is about to die
+        if (level == LogLevel::Error) flusher().wake.notify_one();
+    }
+
+    static void copyIn(Ring& ring, size_t pos, std::string_view bytes) {
+        size_t offset = pos % kRingBytes;
+        size_t first = std::min(bytes.size(), kRingBytes - offset);
+        memcpy(ring.data.data() + offset, bytes.data(), first);
+        memcpy(ring.data.data(), bytes.data() + first, bytes.size() - first);
+    }
+
+    static void copyOut(const Ring& ring, size_t pos, char* out, size_t len) {
+        size_t offset = pos % kRingBytes;
+        size_t first = std::min(len, kRingBytes - offset);
+        memcpy(out, ring.data.data() + offset, first);
+        memcpy(out + first, ring.data.data(), len - first);
+    }
+
+    static void formatLine(std::string& out, LogLevel level, uint64_t micros, std::string_view thread,
+                           std::string_view text) {
+        static const char* const names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+        time_t seconds = micros / 1000000;
+        tm utc;
+        gmtime_r(&seconds, &utc);
+        char stamp[40];
+        size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+        n += snprintf(stamp + n, sizeof(stamp) - n, ".%06uZ ", static_cast<unsigned>(micros % 1000000));
+        out.append(stamp, n);
+        out += names[static_cast<uint8_t>(level) & 3];
+        out += ' ';
+        out += thread;
+        out += ' ';
+        out += text;
+        out += '\n';
+    }
+
+    static void writeAll(std::string_view out) {
+        while (!out.empty()) {
+            ssize_t written = ::write(STDERR_FILENO, out.data(), out.size());
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return;
+            out.remove_prefix(written);
+        }
+    }
+
+    // Moves every complete record to stderr. Called with the flusher's mutex held.
+    static void drain() {
+        Flusher& f = flusher();
+        f.batch.clear();
+        char text[kMaxRecord];
+        for (auto it = f.rings.begin(); it != f.rings.end();) {
+            Ring& ring = **it;
+            bool closed = ring.closed.load(std::memory_order_acquire);
+            size_t head = ring.head.load(std::memory_order_relaxed);
+            size_t tail = ring.tail.load(std::memory_order_acquire);
+            while (head < tail) {
+                char header[kRecordHeader];
+                copyOut(ring, head, header, sizeof(header));
+                size_t len = static_cast<uint8_t>(header[0]) << 8 | static_cast<uint8_t>(header[1]);
+                uint64_t micros;
+                memcpy(&micros, header + 3, sizeof(micros));
+                copyOut(ring, head + kRecordHeader, text, len);
+                formatLine(f.batch, static_cast<LogLevel>(header[2]), micros, ring.name, std::string_view(text, len));
+                head += kRecordHeader + len;
+            }
+            ring.head.store(head, std::memory_order_release);
+            if (uint64_t dropped = ring.dropped.exchange(0, std::memory_order_relaxed)) {
+                Line line;
+                line.append("Log ring full, records dropped");
+                line.field("count", dropped);
+                formatLine(f.batch, LogLevel::Warn, unixMicros(), ring.name, line.text());
+            }
+            it = closed ? f.rings.erase(it) : it + 1;
+        }
+        writeAll(f.batch);
+        if (f.batch.capacity() > (1 << 20)) f.batch = std::string();
+    }
+
+    static void run() {
+        Flusher& f = flusher();
+        std::unique_lock<std::mutex> lock(f.mutex);
+        while (!f.stopping) {
+            f.wake.wait_for(lock, std::chrono::milliseconds(10));
+            drain();
+        }
+        drain();
+    }
+};
+
+#define KV_LOG(level, ...)                                                       \
+    do {                                                                         \
+        if constexpr (logCompiled(level)) {                                      \
+            if (Log::enabled(level)) Log::write(level, __VA_ARGS__);             \
+        }                                                                        \
+    } while (0)
+#define LOG_DEBUG(...) KV_LOG(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) KV_LOG(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...) KV_LOG(LogLevel::Warn, __VA_ARGS__)
+#define LOG_ERROR(...) KV_LOG(LogLevel::Error, __VA_ARGS__)
+
+// MurmurHash3's finalizer: every input bit affects every output bit
+inline uint32_t fmix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
 
 // Simplified MurmurHash3 for consistent hashing
 uint32_t MurmurHash3_x86_32(const void* key, int len, uint32_t seed) {
@@ -26,9 +375,9 @@ uint32_t MurmurHash3_x86_32(const void* key, int len, uint32_t seed) {
     const uint32_t c1 = 0xcc9e2d51;
     const uint32_t c2 = 0x1b873593;
 
-    const uint32_t* blocks = (const uint32_t*)(data + nblocks * 4);
-    for (int i = -nblocks; i; i++) {
-        uint32_t k1 = blocks[i];
+    for (int i = 0; i < nblocks; i++) {
+        uint32_t k1;
+        memcpy(&k1, data + i * 4, 4); // Keys need not be 4-byte aligned
         k1 *= c1;
         k1 = (k1 << 15) | (k1 >> 17);
         k1 *= c2;
@@ -49,278 +398,5835 @@ uint32_t MurmurHash3_x86_32(const void* key, int len, uint32_t seed) {
                 h1 ^= k1;
     }
 
-    h1 ^= len;
-    h1 ^= h1 >> 16;
-    h1 *= 0x85ebca6b;
-    h1 ^= h1 >> 13;
-    h1 *= 0xc2b2ae35;
-    h1 ^= h1 >> 16;
-    return h1;
-}
+    h1 ^= len;
+    return fmix32(h1);
+}
+
+// CRC-32C (Castagnoli), table driven: the fallback when the CPU has no CRC instruction
+uint32_t crc32cTable(const void* data, size_t len, uint32_t crc) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+            t[i] = c;
+        }
+        return t;
+    }();
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// CRC-32C with the SSE4.2 or ARMv8 CRC instructions, 8 bytes at a time
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+#endif
+uint32_t crc32cHardware(const void* data, size_t len, uint32_t crc) {
+#if defined(__x86_64__) || defined(__ARM_FEATURE_CRC32)
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint64_t c = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+#if defined(__x86_64__)
+        c = _mm_crc32_u64(c, word);
+#else
+        c = __crc32cd(static_cast<uint32_t>(c), word);
+#endif
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    for (; len > 0; ++p, --len) {
+#if defined(__x86_64__)
+        c32 = _mm_crc32_u8(c32, *p);
+#else
+        c32 = __crc32cb(c32, *p);
+#endif
+    }
+    return ~c32;
+#else
+    return crc32cTable(data, len, crc);
+#endif
+}
+
+// crc32cHardware of four buffers at once. The CRC instruction takes three
+// cycles but can start every cycle, so four independent chains run side by
+// side where one buffer at a time would wait on each step.
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+#endif
+void crc32cHardware4(const std::string_view* buffers, uint32_t* out) {
+#if defined(__x86_64__) || defined(__ARM_FEATURE_CRC32)
+    const char* p0 = buffers[0].data();
+    const char* p1 = buffers[1].data();
+    const char* p2 = buffers[2].data();
+    const char* p3 = buffers[3].data();
+    size_t common = std::min(std::min(buffers[0].size(), buffers[1].size()),
+                             std::min(buffers[2].size(), buffers[3].size()));
+    uint64_t c0 = 0xFFFFFFFF, c1 = 0xFFFFFFFF, c2 = 0xFFFFFFFF, c3 = 0xFFFFFFFF;
+    uint64_t w0, w1, w2, w3;
+    size_t offset = 0;
+    for (; offset + 8 <= common; offset += 8) {
+        memcpy(&w0, p0 + offset, 8);
+        memcpy(&w1, p1 + offset, 8);
+        memcpy(&w2, p2 + offset, 8);
+        memcpy(&w3, p3 + offset, 8);
+#if defined(__x86_64__)
+        c0 = _mm_crc32_u64(c0, w0);
+        c1 = _mm_crc32_u64(c1, w1);
+        c2 = _mm_crc32_u64(c2, w2);
+        c3 = _mm_crc32_u64(c3, w3);
+#else
+        c0 = __crc32cd(static_cast<uint32_t>(c0), w0);
+        c1 = __crc32cd(static_cast<uint32_t>(c1), w1);
+        c2 = __crc32cd(static_cast<uint32_t>(c2), w2);
+        c3 = __crc32cd(static_cast<uint32_t>(c3), w3);
+#endif
+    }
+    // Each buffer's remaining bytes continue from its own state
+    uint64_t states[4] = {c0, c1, c2, c3};
+    for (int k = 0; k < 4; ++k) {
+        out[k] = crc32cHardware(buffers[k].data() + offset, buffers[k].size() - offset,
+                                ~static_cast<uint32_t>(states[k]));
+    }
+#else
+    for (int k = 0; k < 4; ++k) out[k] = crc32cTable(buffers[k].data(), buffers[k].size(), 0);
+#endif
+}
+
+// Whether crc32cHardware runs on this CPU; checked once at startup
+bool hasCrc32cInstructions() {
+#if defined(__x86_64__)
+    static const bool has = __builtin_cpu_supports("sse4.2");
+    return has;
+#elif defined(__ARM_FEATURE_CRC32)
+    return true;
+#else
+    return false;
+#endif
+}
+
+// CRC-32C (Castagnoli); checksums on-disk records
+uint32_t crc32c(const void* data, size_t len, uint32_t crc = 0) {
+    static const bool hardware = hasCrc32cInstructions();
+    return hardware ? crc32cHardware(data, len, crc) : crc32cTable(data, len, crc);
+}
+
+// The hash that places keys and ring tokens. Every member of a cluster must
+// use the same one, so the choice is versioned rather than picked per CPU:
+// a node without the CRC instruction computes Crc32c with the table.
+enum class RingHash : uint8_t {
+    Murmur3 = 1, // MurmurHash3_x86_32, seed 0; what clusters have always used
+    Crc32c = 2   // CRC-32C through fmix32; much faster on long keys
+};
+
+inline const char* ringHashName(RingHash version) {
+    return version == RingHash::Crc32c ? "crc32c" : "murmur3";
+}
+
+inline uint32_t ringHash(RingHash version, std::string_view key) {
+    if (version == RingHash::Crc32c) return fmix32(crc32c(key.data(), key.size()));
+    return MurmurHash3_x86_32(key.data(), static_cast<int>(key.size()), 0);
+}
+
+// Hashes every key of a batch before any of them is routed. With Crc32c on
+// hardware that has the instruction, runs of four keys of 32 bytes or more
+// are hashed together; shorter ones finish before interleaving pays off.
+template<typename KeyOf>
+void ringHashes(RingHash version, size_t n, KeyOf&& keyOf, std::vector<uint32_t>& out) {
+    out.resize(n);
+    if (version == RingHash::Crc32c) {
+        static const bool hardware = hasCrc32cInstructions();
+        size_t i = 0;
+        for (; hardware && i + 4 <= n; i += 4) {
+            std::string_view keys[4] = {keyOf(i), keyOf(i + 1), keyOf(i + 2), keyOf(i + 3)};
+            if (std::min(std::min(keys[0].size(), keys[1].size()), std::min(keys[2].size(), keys[3].size())) >= 32) {
+                crc32cHardware4(keys, &out[i]);
+            } else {
+                for (int k = 0; k < 4; ++k) out[i + k] = crc32cHardware(keys[k].data(), keys[k].size(), 0);
+            }
+            for (int k = 0; k < 4; ++k) out[i + k] = fmix32(out[i + k]);
+        }
+        for (; i < n; ++i) {
+            std::string_view key = keyOf(i);
+            out[i] = fmix32(crc32c(key.data(), key.size()));
+        }
+    } else {
+        for (size_t i = 0; i < n; ++i) {
+            std::string_view key = keyOf(i);
+            out[i] = MurmurHash3_x86_32(key.data(), static_cast<int>(key.size()), 0);
+        }
+    }
+}
+
+// Hash for a node's own tables, which never leave the process: hardware
+// CRC-32C where there is one, MurmurHash3 otherwise
+inline uint32_t localHash(std::string_view key) {
+    static const bool hardware = hasCrc32cInstructions();
+    if (hardware) return fmix32(crc32cHardware(key.data(), key.size(), 0));
+    return MurmurHash3_x86_32(key.data(), static_cast<int>(key.size()), 0);
+}
+
+// Length of the common prefix of a and b, which both have at least n bytes;
+// compares 16 bytes at a time
+inline size_t commonPrefixLength(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        uint32_t equal = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)));
+        if (equal != 0xFFFF) return i + __builtin_ctz(~equal);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t differ = vmvnq_u8(vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(a + i)),
+                                              vld1q_u8(reinterpret_cast<const uint8_t*>(b + i))));
+        uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(differ), 4)), 0);
+        if (nibbles) return i + (__builtin_ctzll(nibbles) >> 2);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb) return i + (__builtin_ctzll(wa ^ wb) >> 3); // Little-endian: the lowest byte comes first
+    }
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+inline size_t commonPrefixLength(std::string_view a, std::string_view b) {
+    return commonPrefixLength(a.data(), b.data(), std::min(a.size(), b.size()));
+}
+
+// Three-way comparison in byte order, like std::string::compare. Short keys
+// find their first difference inline with commonPrefixLength; past 64 bytes
+// the library's memcmp, with its wider vectors, is faster.
+inline int compareKeys(std::string_view a, std::string_view b) {
+    size_t n = std::min(a.size(), b.size());
+    if (n > 64) {
+        int order = memcmp(a.data(), b.data(), n);
+        if (order != 0) return order < 0 ? -1 : 1;
+        return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+    }
+    size_t i = commonPrefixLength(a.data(), b.data(), n);
+    if (i < n) return static_cast<uint8_t>(a[i]) < static_cast<uint8_t>(b[i]) ? -1 : 1;
+    return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+}
+
+// Bounded lock-free multi-producer/single-consumer ring: each worker's inbox.
+// Producers claim a slot by advancing tail with a CAS and publish it through
+// the slot's sequence number, so the consumer never sees a half-written item.
+// head and tail sit on separate cache lines to keep producers and the consumer
+// from invalidating each other.
+template<typename T>
+class MpscQueue {
+private:
+    struct Slot {
+        std::atomic<size_t> seq; // == position when free, position + 1 once filled
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{0}; // Next position to claim; shared by producers
+    alignas(64) size_t head = 0;             // Next position to read; consumer only
+
+public:
+    // capacity is rounded up to a power of two
+    explicit MpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Moves from item only when there is room for it
+    bool enqueue(T&& item) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[pos & mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Full: the consumer has not freed this slot yet
+            } else {
+                pos = tail.load(std::memory_order_relaxed); // Another producer took it
+            }
+        }
+        slot->value = std::move(item);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool enqueue(const T& item) {
+        T copy(item);
+        return enqueue(std::move(copy));
+    }
+
+    bool dequeue(T& item) {
+        Slot& slot = slots[head & mask];
+        if (slot.seq.load(std::memory_order_acquire) != head + 1) return false; // Empty, or still being written
+        item = std::move(slot.value);
+        slot.seq.store(head + mask + 1, std::memory_order_release);
+        ++head;
+        return true;
+    }
+
+    // Moves up to max published items to out in one pass; returns how many
+    size_t dequeueBatch(std::vector<T>& out, size_t max) {
+        size_t count = 0;
+        while (count < max) {
+            Slot& slot = slots[(head + count) & mask];
+            if (slot.seq.load(std::memory_order_acquire) != head + count + 1) break;
+            out.push_back(std::move(slot.value));
+            slot.seq.store(head + count + mask + 1, std::memory_order_release);
+            ++count;
+        }
+        head += count;
+        return count;
+    }
+};
+
+// Ordered key index for range queries and prefix scans.
+// B+tree over the keys of the local store: inserts and removes touch one
+// root-to-leaf path, scans seek to the first leaf and follow the leaf chain,
+// so every operation is O(log N + k) and nothing is ever rebuilt. A prefix
+// scan seeks to the prefix and stops at the first key without it.
+//
+// Leaves are front-coded: a key is stored as the number of bytes it shares
+// with the key before it plus the bytes that follow, so the prefixes common
+// to neighbouring keys (session:, user:1234:) are held once per leaf rather
+// than once per key. Inner nodes keep only the shortest prefix of a leaf's
+// first key that sets it apart from the leaf before it.
+class RIndex {
+private:
+    static constexpr size_t kLeafCapacity = 64;
+    static constexpr size_t kInnerCapacity = 64;
+
+    struct BNode {
+        bool leaf;
+        explicit BNode(bool leaf) : leaf(leaf) {}
+    };
+
+    // entries holds count entries of varint(shared) varint(rest length) rest;
+    // the first one shares nothing
+    struct Leaf : BNode {
+        std::string entries;
+        uint32_t count = 0;
+        Leaf* next = nullptr;
+        Leaf* prev = nullptr;
+        Leaf() : BNode(true) {}
+    };
+
+    // children[i] holds keys in [separators[i - 1], separators[i])
+    struct Inner : BNode {
+        std::vector<std::string> separators;
+        std::vector<BNode*> children;
+        Inner() : BNode(false) {}
+    };
+
+    struct PathEntry {
+        Inner* node;
+        size_t child;
+    };
+
+    // Decodes a leaf's keys in order: key is the entry at offset, prev the
+    // one before it (empty at the first), and end the offset of the next
+    struct Cursor {
+        const Leaf* leaf = nullptr;
+        size_t offset = 0;
+        size_t end = 0;
+        std::string key;
+        std::string prev;
+
+        explicit Cursor(const Leaf* leaf) { reset(leaf); }
+
+        bool valid() const { return offset < leaf->entries.size(); }
+
+        void reset(const Leaf* to) {
+            leaf = to;
+            offset = 0;
+            prev.clear();
+            load();
+        }
+
+        void next() {
+            offset = end;
+            std::swap(key, prev);
+            load();
+        }
+
+    private:
+        void load() {
+            end = offset;
+            if (!valid()) return;
+            const char* p = leaf->entries.data() + offset;
+            size_t shared = readVarint(p);
+            size_t length = readVarint(p);
+            key.assign(prev, 0, shared);
+            key.append(p, length);
+            end = p + length - leaf->entries.data();
+        }
+    };
+
+    BNode* root;
+    size_t count;
+
+    static void appendVarint(std::string& out, size_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static size_t readVarint(const char*& p) {
+        size_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(*p++);
+            value |= size_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+    }
+
+    // Encodes key as an entry following prev
+    static void appendEntry(std::string& out, const std::string& prev, const std::string& key) {
+        size_t shared = commonPrefixLength(prev, key);
+        appendVarint(out, shared);
+        appendVarint(out, key.size() - shared);
+        out.append(key, shared, std::string::npos);
+    }
+
+    // Shortest s with left < s <= right
+    static std::string separator(const std::string& left, const std::string& right) {
+        return right.substr(0, commonPrefixLength(left, right) + 1);
+    }
+
+    static size_t childIndex(const Inner* inner, const std::string& key) {
+        return std::upper_bound(inner->separators.begin(), inner->separators.end(), key,
+                                [](const std::string& a, const std::string& b) { return compareKeys(a, b) < 0; }) -
+               inner->separators.begin();
+    }
+
+    Leaf* findLeaf(const std::string& key, std::vector<PathEntry>* path) const {
+        BNode* node = root;
+        while (!node->leaf) {
+            Inner* inner = static_cast<Inner*>(node);
+            size_t idx = childIndex(inner, key);
+            if (path) path->push_back({inner, idx});
+            node = inner->children[idx];
+        }
+        return static_cast<Leaf*>(node);
+    }
+
+    // Cursor at the first key >= key in the leaf, or past its end
+    static Cursor seek(const Leaf* leaf, const std::string& key) {
+        Cursor at(leaf);
+        while (at.valid() && compareKeys(at.key, key) < 0) at.next();
+        return at;
+    }
+
+    // Push a split-off right sibling up the recorded path, splitting parents as needed
+    void insertIntoParent(std::vector<PathEntry>& path, std::string separator, BNode* right) {
+        while (!path.empty()) {
+            auto [parent, idx] = path.back();
+            path.pop_back();
+            parent->separators.insert(parent->separators.begin() + idx, std::move(separator));
+            parent->children.insert(parent->children.begin() + idx + 1, right);
+            if (parent->children.size() <= kInnerCapacity) return;
+
+            size_t mid = parent->separators.size() / 2;
+            Inner* sibling = new Inner();
+            separator = std::move(parent->separators[mid]);
+            sibling->separators.assign(std::make_move_iterator(parent->separators.begin() + mid + 1),
+                                       std::make_move_iterator(parent->separators.end()));
+            sibling->children.assign(parent->children.begin() + mid + 1, parent->children.end());
+            parent->separators.resize(mid);
+            parent->children.resize(mid + 1);
+            right = sibling;
+        }
+        Inner* new_root = new Inner();
+        new_root->separators.push_back(std::move(separator));
+        new_root->children.push_back(root);
+        new_root->children.push_back(right);
+        root = new_root;
+    }
+
+    // Unlink an emptied node from its parent. Underfull nodes are tolerated
+    // rather than merged; only empty ones are reclaimed.
+    void removeFromParent(std::vector<PathEntry>& path) {
+        while (!path.empty()) {
+            auto [parent, idx] = path.back();
+            path.pop_back();
+            parent->children.erase(parent->children.begin() + idx);
+            if (!parent->separators.empty()) {
+                parent->separators.erase(parent->separators.begin() + (idx > 0 ? idx - 1 : 0));
+            }
+            if (!parent->children.empty()) break;
+            if (parent == root) {
+                delete parent;
+                root = new Leaf();
+                return;
+            }
+            delete parent;
+        }
+        while (!root->leaf && static_cast<Inner*>(root)->children.size() == 1) {
+            Inner* old_root = static_cast<Inner*>(root);
+            root = old_root->children[0];
+            delete old_root;
+        }
+    }
+
+    static void destroy(BNode* node) {
+        if (!node->leaf) {
+            for (BNode* child : static_cast<Inner*>(node)->children) destroy(child);
+            delete static_cast<Inner*>(node);
+        } else {
+            delete static_cast<Leaf*>(node);
+        }
+    }
+
+public:
+    RIndex() : root(new Leaf()), count(0) {}
+    ~RIndex() { destroy(root); }
+    RIndex(const RIndex&) = delete;
+    RIndex& operator=(const RIndex&) = delete;
+
+    size_t size() const { return count; }
+
+    // Calls fn(key) for each key >= start, in order, until fn returns false.
+    // key is only valid for the duration of the call.
+    template<typename Fn>
+    void scanFrom(const std::string& start, Fn&& fn) const {
+        const Leaf* leaf = findLeaf(start, nullptr);
+        Cursor at = seek(leaf, start);
+        while (true) {
+            for (; at.valid(); at.next()) {
+                if (!fn(at.key)) return;
+            }
+            leaf = leaf->next;
+            if (!leaf) return;
+            at.reset(leaf);
+        }
+    }
+
+    // Returns false if the key was already indexed
+    bool insert(const std::string& key) {
+        std::vector<PathEntry> path;
+        Leaf* leaf = findLeaf(key, &path);
+        Cursor at = seek(leaf, key);
+        if (at.valid() && at.key == key) return false;
+        // The key goes in before the entry at the cursor, which is re-coded against it
+        std::string patch;
+        appendEntry(patch, at.prev, key);
+        if (at.valid()) appendEntry(patch, key, at.key);
+        leaf->entries.replace(at.offset, at.end - at.offset, patch);
+        ++count;
+        if (++leaf->count <= kLeafCapacity) return true;
+
+        Cursor mid(leaf);
+        for (uint32_t i = 0; i < leaf->count / 2; ++i) mid.next();
+        Leaf* sibling = new Leaf();
+        appendEntry(sibling->entries, std::string(), mid.key);
+        sibling->entries.append(leaf->entries, mid.end, std::string::npos);
+        sibling->count = leaf->count - leaf->count / 2;
+        leaf->entries.resize(mid.offset);
+        leaf->entries.shrink_to_fit();
+        leaf->count /= 2;
+        sibling->next = leaf->next;
+        sibling->prev = leaf;
+        if (leaf->next) leaf->next->prev = sibling;
+        leaf->next = sibling;
+        insertIntoParent(path, separator(mid.prev, mid.key), sibling);
+        return true;
+    }
+
+    // Returns false if the key was not indexed
+    bool remove(const std::string& key) {
+        std::vector<PathEntry> path;
+        Leaf* leaf = findLeaf(key, &path);
+        Cursor at = seek(leaf, key);
+        if (!at.valid() || at.key != key) return false;
+        // The entry after it is re-coded against the one before
+        Cursor after = at;
+        after.next();
+        std::string patch;
+        if (after.valid()) appendEntry(patch, at.prev, after.key);
+        leaf->entries.replace(at.offset, after.end - at.offset, patch);
+        --count;
+        if (--leaf->count > 0 || leaf == root) return true;
+
+        if (leaf->prev) leaf->prev->next = leaf->next;
+        if (leaf->next) leaf->next->prev = leaf->prev;
+        delete leaf;
+        removeFromParent(path);
+        return true;
+    }
+
+    std::vector<std::string> rangeQuery(const std::string& start, const std::string& end) const {
+        std::vector<std::string> result;
+        scanFrom(start, [&](const std::string& key) {
+            if (key > end) return false;
+            result.push_back(key);
+            return true;
+        });
+        return result;
+    }
+
+    std::vector<std::string> prefixScan(const std::string& prefix) const {
+        std::vector<std::string> result;
+        scanFrom(prefix, [&](const std::string& key) {
+            if (key.compare(0, prefix.size(), prefix) != 0) return false;
+            result.push_back(key);
+            return true;
+        });
+        return result;
+    }
+};
+
+// Size-class allocator for a shard's out-of-line keys and values. Requests up
+// to kMaxChunk bytes are rounded up to one of a series of chunk sizes ~25%
+// apart and carved from 1 MB slabs that hold chunks of a single size; each
+// slab keeps its own free list, and a slab whose chunks are all free again is
+// unmapped (one is kept as a spare), so memory freed by churn goes back to the
+// kernel instead of fragmenting the heap. Larger requests go to malloc.
+//
+// Owned by one worker; the counters may be read from other threads.
+class SlabAllocator {
+public:
+    static constexpr size_t kSlabSize = 1 << 20;
+    static constexpr size_t kMaxChunk = 64 << 10;
+
+private:
+    // Header at the start of each kSlabSize-aligned slab
+    struct Slab {
+        Slab* prev = nullptr; // In its class's list of slabs with free chunks
+        Slab* next = nullptr;
+        void* free_list = nullptr;
+        uint32_t size_class = 0;
+        uint32_t used = 0;    // Chunks handed out
+        uint32_t carved = 0;  // Chunks ever handed out; the rest have not been touched
+        uint32_t capacity = 0;
+    };
+    static constexpr size_t kSlabHeader = (sizeof(Slab) + 15) & ~size_t(15);
+
+    struct SizeClass {
+        uint32_t chunk_size;
+        Slab* partial = nullptr; // Slabs with a free chunk
+    };
+
+    std::vector<uint32_t> chunk_sizes;
+    std::unique_ptr<SizeClass[]> classes;
+    Slab* spare = nullptr; // An empty slab kept to save a munmap/mmap pair
+    std::atomic<size_t> used_bytes{0};      // Sum of the sizes asked for
+    std::atomic<size_t> allocated_bytes{0}; // Chunk bytes handed out, plus large allocations
+    std::atomic<size_t> reserved_bytes{0};  // Slabs mapped, plus large allocations
+
+    // Single writer: a plain load and store instead of a locked add
+    static void add(std::atomic<size_t>& counter, ptrdiff_t delta) {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    static char* chunksOf(Slab* slab) {
+        return reinterpret_cast<char*>(slab) + kSlabHeader;
+    }
+
+    static Slab* slabOf(const void* chunk) {
+        return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(chunk) & ~(kSlabSize - 1));
+    }
+
+    void link(SizeClass& cls, Slab* slab) {
+        slab->prev = nullptr;
+        slab->next = cls.partial;
+        if (cls.partial) cls.partial->prev = slab;
+        cls.partial = slab;
+    }
+
+    void unlink(SizeClass& cls, Slab* slab) {
+        if (slab->prev) slab->prev->next = slab->next;
+        if (slab->next) slab->next->prev = slab->prev;
+        if (cls.partial == slab) cls.partial = slab->next;
+        slab->prev = slab->next = nullptr;
+    }
+
+    // Reuses the spare or maps a kSlabSize-aligned slab by over-mapping and trimming the ends
+    Slab* newSlab(uint32_t size_class) {
+        if (spare) {
+            Slab* slab = new (spare) Slab();
+            spare = nullptr;
+            slab->size_class = size_class;
+            slab->capacity = static_cast<uint32_t>((kSlabSize - kSlabHeader) / classes[size_class].chunk_size);
+            return slab;
+        }
+        void* raw = mmap(nullptr, 2 * kSlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return nullptr;
+        uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = (start + kSlabSize - 1) & ~(kSlabSize - 1);
+        if (aligned > start) munmap(raw, aligned - start);
+        if (aligned + kSlabSize < start + 2 * kSlabSize) {
+            munmap(reinterpret_cast<void*>(aligned + kSlabSize), start + kSlabSize - aligned);
+        }
+        Slab* slab = new (reinterpret_cast<void*>(aligned)) Slab();
+        slab->size_class = size_class;
+        slab->capacity = static_cast<uint32_t>((kSlabSize - kSlabHeader) / classes[size_class].chunk_size);
+        add(reserved_bytes, kSlabSize);
+        return slab;
+    }
+
+    void freeSlab(Slab* slab) {
+        if (!spare) {
+            spare = slab;
+            return;
+        }
+        add(reserved_bytes, -static_cast<ptrdiff_t>(kSlabSize));
+        munmap(slab, kSlabSize);
+    }
+
+public:
+    SlabAllocator() {
+        for (size_t size = 24; size <= kMaxChunk; size = std::max(size + 8, (size * 5 / 4 + 7) & ~size_t(7))) {
+            chunk_sizes.push_back(static_cast<uint32_t>(size));
+        }
+        if (chunk_sizes.back() != kMaxChunk) chunk_sizes.push_back(kMaxChunk);
+        classes.reset(new SizeClass[chunk_sizes.size()]);
+        for (size_t i = 0; i < chunk_sizes.size(); ++i) classes[i].chunk_size = chunk_sizes[i];
+    }
+
+    ~SlabAllocator() {
+        for (size_t i = 0; i < chunk_sizes.size(); ++i) {
+            // Full slabs are not on any list; every chunk has been returned by now
+            while (Slab* slab = classes[i].partial) {
+                unlink(classes[i], slab);
+                munmap(slab, kSlabSize);
+            }
+        }
+        if (spare) munmap(spare, kSlabSize);
+    }
+
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    void* allocate(size_t size) {
+        add(used_bytes, size);
+        if (size > kMaxChunk) {
+            add(allocated_bytes, size);
+            add(reserved_bytes, size);
+            return malloc(size);
+        }
+        uint32_t index = static_cast<uint32_t>(std::lower_bound(chunk_sizes.begin(), chunk_sizes.end(), size) -
+                                               chunk_sizes.begin());
+        SizeClass& cls = classes[index];
+        Slab* slab = cls.partial;
+        if (!slab) {
+            slab = newSlab(index);
+            if (!slab) throw std::bad_alloc();
+            link(cls, slab);
+        }
+        void* chunk;
+        if (slab->free_list) {
+            chunk = slab->free_list;
+            slab->free_list = *static_cast<void**>(chunk);
+        } else {
+            chunk = chunksOf(slab) + static_cast<size_t>(slab->carved++) * cls.chunk_size;
+        }
+        if (++slab->used == slab->capacity) unlink(cls, slab);
+        add(allocated_bytes, cls.chunk_size);
+        return chunk;
+    }
+
+    // size must be the size passed to allocate
+    void deallocate(void* chunk, size_t size) {
+        add(used_bytes, -static_cast<ptrdiff_t>(size));
+        if (size > kMaxChunk) {
+            add(allocated_bytes, -static_cast<ptrdiff_t>(size));
+            add(reserved_bytes, -static_cast<ptrdiff_t>(size));
+            free(chunk);
+            return;
+        }
+        Slab* slab = slabOf(chunk);
+        SizeClass& cls = classes[slab->size_class];
+        add(allocated_bytes, -static_cast<ptrdiff_t>(cls.chunk_size));
+        if (slab->used-- == slab->capacity) link(cls, slab);
+        if (slab->used == 0) {
+            unlink(cls, slab);
+            freeSlab(slab);
+            return;
+        }
+        *static_cast<void**>(chunk) = slab->free_list;
+        slab->free_list = chunk;
+    }
+
+    // Whether reallocating the chunk would help empty its slab: the slab is at
+    // most half full and its class has another slab that new chunks come from
+    bool sparse(const void* chunk, size_t size) const {
+        if (size > kMaxChunk) return false;
+        const Slab* slab = slabOf(chunk);
+        return slab->used * 2 <= slab->capacity && classes[slab->size_class].partial != slab;
+    }
+
+    // Whether free chunks in partly used slabs hold enough memory to be worth compacting
+    bool fragmented() const {
+        size_t idle = reservedBytes() - allocatedBytes();
+        return idle > std::max(allocatedBytes() / 4, 8 * kSlabSize);
+    }
+
+    size_t usedBytes() const { return used_bytes.load(std::memory_order_relaxed); }
+    size_t allocatedBytes() const { return allocated_bytes.load(std::memory_order_relaxed); }
+    size_t reservedBytes() const { return reserved_bytes.load(std::memory_order_relaxed); }
+};
+
+// Bump allocator for scratch memory that dies with the request being parsed:
+// allocations are never freed one by one, and reset() drops them all at once
+// while keeping the first block for the next request.
+class Arena : public std::pmr::memory_resource {
+private:
+    static constexpr size_t kBlockSize = 16 << 10;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<size_t> block_sizes;
+    size_t offset = 0; // Into blocks.back()
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        size_t start = blocks.empty() ? 0 : (offset + alignment - 1) & ~(alignment - 1);
+        if (blocks.empty() || start + bytes > block_sizes.back()) {
+            size_t size = std::max(kBlockSize, bytes + alignment);
+            blocks.emplace_back(new char[size]);
+            block_sizes.push_back(size);
+            uintptr_t base = reinterpret_cast<uintptr_t>(blocks.back().get());
+            start = ((base + alignment - 1) & ~(alignment - 1)) - base;
+        }
+        offset = start + bytes;
+        return blocks.back().get() + start;
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    void reset() {
+        if (blocks.size() > 1) {
+            blocks.erase(blocks.begin() + 1, blocks.end());
+            block_sizes.erase(block_sizes.begin() + 1, block_sizes.end());
+        }
+        offset = 0;
+    }
+};
+
+// Resident set size of this process, from /proc; 0 if unavailable
+inline size_t residentBytes() {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+    unsigned long pages = 0;
+    if (fscanf(statm, "%*u %lu", &pages) != 1) pages = 0;
+    fclose(statm);
+    return pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Open file descriptors of this process, counted in /proc; 0 if unavailable
+inline size_t openFileDescriptors() {
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir) return 0;
+    size_t count = 0;
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') ++count;
+    }
+    closedir(dir);
+    return count > 0 ? count - 1 : 0; // Less the one opendir holds
+}
+
+// Latency histogram in the style of HdrHistogram: nanosecond values fall in
+// 16 linear sub-buckets per power of two, so every value is kept to within
+// about 6% up to 2^40 ns (18 minutes) in a fixed 4.7 KB. One thread records;
+// any thread may read, and a reader sees each bucket whole but possibly a
+// few recordings behind the others.
+class LatencyHistogram {
+public:
+    static constexpr int kSubBits = 4;
+    static constexpr int kMaxBits = 40;
+    static constexpr size_t kBuckets = (kMaxBits - kSubBits + 1) << kSubBits;
+
+    // Merged buckets of one or more histograms
+    struct Counts {
+        std::array<uint64_t, kBuckets> buckets{};
+        uint64_t count = 0;
+        uint64_t sum = 0; // Nanoseconds
+        uint64_t max = 0;
+
+        // Smallest value at or above the fraction q of recordings, e.g. 0.99 for p99
+        uint64_t percentile(double q) const {
+            if (count == 0) return 0;
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; ++i) {
+                seen += buckets[i];
+                if (seen >= rank) return std::min(upperBound(i), max);
+            }
+            return max;
+        }
+
+        // Recordings whose bucket lies wholly at or below value
+        uint64_t countAtOrBelow(uint64_t value) const {
+            uint64_t total = 0;
+            for (size_t i = 0; i < kBuckets && upperBound(i) <= value; ++i) total += buckets[i];
+            return total;
+        }
+    };
+
+    void record(uint64_t nanos) {
+        size_t i = bucketOf(nanos);
+        // Single writer: a plain load and store instead of a locked add
+        buckets[i].store(buckets[i].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + nanos, std::memory_order_relaxed);
+        if (nanos > max.load(std::memory_order_relaxed)) max.store(nanos, std::memory_order_relaxed);
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    uint64_t total() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    void addTo(Counts& out) const {
+        for (size_t i = 0; i < kBuckets; ++i) out.buckets[i] += buckets[i].load(std::memory_order_relaxed);
+        out.count += count.load(std::memory_order_relaxed);
+        out.sum += sum.load(std::memory_order_relaxed);
+        out.max = std::max(out.max, max.load(std::memory_order_relaxed));
+    }
+
+    static size_t bucketOf(uint64_t value) {
+        value = std::min<uint64_t>(value, (uint64_t(1) << kMaxBits) - 1);
+        if (value < (1u << kSubBits)) return value;
+        int shift = 63 - __builtin_clzll(value) - kSubBits;
+        return (static_cast<size_t>(shift + 1) << kSubBits) + ((value >> shift) & ((1u << kSubBits) - 1));
+    }
+
+    // Largest value that falls in bucket i
+    static uint64_t upperBound(size_t i) {
+        if (i < (1u << kSubBits)) return i;
+        int shift = static_cast<int>(i >> kSubBits) - 1;
+        uint64_t sub = i & ((1u << kSubBits) - 1);
+        return (((1u << kSubBits) + sub + 1) << shift) - 1;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+// Wall-clock time in whole seconds, the unit of key expiry
+inline uint32_t unixSeconds() {
+    return static_cast<uint32_t>(time(nullptr));
+}
+
+// Expiry time for a TTL. Rounded up past the current second, as a key is
+// expired from the start of its expiry second and must outlive its TTL
+inline uint32_t expiryAfter(uint32_t ttl) {
+    return unixSeconds() + ttl + 1;
+}
+
+// Open-addressing hash map from key to value bytes for a shard's data, laid
+// out Swiss-table style: one control byte per slot holds 7 bits of the key's
+// hash (or marks the slot empty or deleted), and a lookup compares 16 control
+// bytes at a time, touching a slot only when those bits match. Slots are
+// stored flat; a key and value of up to kInline bytes together live in the
+// slot itself, longer ones in a single chunk from the map's SlabAllocator.
+// Each entry also carries a Meta the map stores but does not interpret.
+class FlatMap {
+public:
+    struct Meta {
+        uint32_t expires = 0; // Unix seconds; 0 for never
+        uint32_t access = 0;  // Recency or frequency, for eviction
+        uint64_t version = 0; // Sequence number of the write that stored it
+    };
+
+private:
+    static constexpr size_t kGroupWidth = 16;
+    static constexpr size_t kInline = 16;
+    static constexpr int8_t kEmpty = -128;  // 0b10000000
+    static constexpr int8_t kDeleted = -2;  // 0b11111110; full slots are 0..127
+
+    struct Slot {
+        uint32_t key_len;
+        uint32_t value_len;
+        Meta meta;
+        union {
+            char bytes[kInline];
+            char* heap;
+        };
+        bool isInline() const { return key_len + value_len <= kInline; }
+        const char* data() const { return isInline() ? bytes : heap; }
+        std::string_view key() const { return std::string_view(data(), key_len); }
+        std::string_view value() const { return std::string_view(data() + key_len, value_len); }
+    };
+
+    // The 16 control bytes starting at a slot; bit i of a mask is slot i
+    // (every 4th bit on NEON, which has no movemask)
+    struct Group {
+#if defined(__SSE2__)
+        static constexpr int kShift = 0;
+        __m128i ctrl;
+        explicit Group(const int8_t* p) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))) {}
+        uint64_t match(int8_t h2) const {
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)));
+        }
+        uint64_t matchFree() const { // Empty or deleted: the sign bit is set
+            return static_cast<uint32_t>(_mm_movemask_epi8(ctrl));
+        }
+#elif defined(__ARM_NEON)
+        static constexpr int kShift = 2;
+        int8x16_t ctrl;
+        explicit Group(const int8_t* p) : ctrl(vld1q_s8(p)) {}
+        static uint64_t toMask(uint8x16_t bytes) {
+            uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(bytes), 4);
+            return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888ull;
+        }
+        uint64_t match(int8_t h2) const { return toMask(vceqq_s8(vdupq_n_s8(h2), ctrl)); }
+        uint64_t matchFree() const { return toMask(vcltq_s8(ctrl, vdupq_n_s8(0))); }
+#else
+        static constexpr int kShift = 0;
+        const int8_t* ctrl;
+        explicit Group(const int8_t* p) : ctrl(p) {}
+        uint64_t match(int8_t h2) const {
+            uint64_t mask = 0;
+            for (size_t i = 0; i < kGroupWidth; ++i) mask |= static_cast<uint64_t>(ctrl[i] == h2) << i;
+            return mask;
+        }
+        uint64_t matchFree() const {
+            uint64_t mask = 0;
+            for (size_t i = 0; i < kGroupWidth; ++i) mask |= static_cast<uint64_t>(ctrl[i] < 0) << i;
+            return mask;
+        }
+#endif
+        uint64_t matchEmpty() const { return match(kEmpty); }
+        static size_t lowest(uint64_t mask) { return __builtin_ctzll(mask) >> kShift; }
+        // Slots before the first / after the last set bit
+        static size_t leadingClear(uint64_t mask) {
+            return mask ? __builtin_ctzll(mask) >> kShift : kGroupWidth;
+        }
+        static size_t trailingClear(uint64_t mask) {
+            return mask ? (__builtin_clzll(mask) - (64 - (kGroupWidth << kShift))) >> kShift : kGroupWidth;
+        }
+    };
+
+    // capacity + kGroupWidth - 1 bytes: the first kGroupWidth - 1 are repeated
+    // at the end so a group can be loaded at any slot without wrapping
+    std::unique_ptr<int8_t[]> ctrl;
+    std::unique_ptr<Slot[]> slots;
+    size_t mask = 0; // capacity - 1; capacity is 0 or a power of two >= kGroupWidth
+    size_t count = 0;
+    size_t deleted = 0;
+    size_t defrag_cursor = 0; // Next slot defragment() looks at
+    size_t sweep_cursor = 0;  // Next slot sweep() looks at
+    size_t expiring = 0;      // Entries with meta.expires set
+    std::atomic<size_t> table_bytes{0}; // Control bytes and slots; readable from other threads
+    SlabAllocator heap;
+
+    size_t capacity() const { return slots ? mask + 1 : 0; }
+
+    static uint32_t hash(std::string_view key) {
+        return localHash(key);
+    }
+
+    // Start of the probe sequence; the multiply decorrelates it from the bits
+    // that chose the node and worker for this key
+    size_t h1(uint32_t h) const {
+        return static_cast<size_t>((static_cast<uint64_t>(h) * 0x9E3779B97F4A7C15ull) >> 20) & mask;
+    }
+    static int8_t h2(uint32_t h) { return static_cast<int8_t>(h & 0x7F); }
+
+    void setCtrl(size_t i, int8_t value) {
+        ctrl[i] = value;
+        if (i < kGroupWidth - 1) ctrl[mask + 1 + i] = value;
+    }
+
+    // Calls fn(pos, group) along h's probe sequence until it returns true.
+    // Quadratic over groups, so it visits every group once when the capacity
+    // is a power of two.
+    template<typename Fn>
+    void probe(uint32_t h, Fn&& fn) const {
+        size_t pos = h1(h);
+        for (size_t step = kGroupWidth; !fn(pos, Group(&ctrl[pos])); step += kGroupWidth) {
+            pos = (pos + step) & mask;
+        }
+    }
+
+    // Index of key's slot, or SIZE_MAX
+    size_t findIndex(std::string_view key, uint32_t h) const {
+        if (count == 0) return SIZE_MAX;
+        int8_t tag = h2(h);
+        size_t result = SIZE_MAX;
+        probe(h, [&](size_t pos, const Group& group) {
+            for (uint64_t m = group.match(tag); m; m &= m - 1) {
+                size_t i = (pos + Group::lowest(m)) & mask;
+                const Slot& slot = slots[i];
+                if (slot.key_len == key.size() && memcmp(slot.data(), key.data(), key.size()) == 0) {
+                    result = i;
+                    return true;
+                }
+            }
+            return group.matchEmpty() != 0; // An empty slot ends the chain
+        });
+        return result;
+    }
+
+    // First empty or deleted slot on h's probe sequence
+    size_t freeIndex(uint32_t h) const {
+        size_t result = 0;
+        probe(h, [&](size_t pos, const Group& group) {
+            uint64_t m = group.matchFree();
+            if (m) result = (pos + Group::lowest(m)) & mask;
+            return m != 0;
+        });
+        return result;
+    }
+
+    // Stores key and value in a slot that is new (zero lengths) or holds key
+    void assign(Slot& slot, std::string_view key, std::string_view value) {
+        size_t size = key.size() + value.size();
+        if (!slot.isInline() && slot.key_len + slot.value_len != size) release(slot);
+        if (size > kInline && (slot.isInline() || slot.key_len + slot.value_len != size)) {
+            slot.heap = static_cast<char*>(heap.allocate(size));
+        }
+        // Same-size heap entries are overwritten in place
+        slot.key_len = static_cast<uint32_t>(key.size());
+        slot.value_len = static_cast<uint32_t>(value.size());
+        char* dest = size > kInline ? slot.heap : slot.bytes;
+        memcpy(dest, key.data(), key.size());
+        memcpy(dest + key.size(), value.data(), value.size());
+    }
+
+    void release(Slot& slot) {
+        if (slot.isInline()) return;
+        heap.deallocate(slot.heap, slot.key_len + slot.value_len);
+    }
+
+    void setMeta(Slot& slot, Meta meta) {
+        expiring += (meta.expires != 0) - (slot.meta.expires != 0);
+        slot.meta = meta;
+    }
+
+    void eraseAt(size_t i) {
+        release(slots[i]);
+        setMeta(slots[i], Meta());
+        // If every 16-slot window holding i also holds an empty slot, no probe
+        // ever went past i, so it can become empty rather than deleted
+        size_t run = Group::trailingClear(Group(&ctrl[(i - kGroupWidth) & mask]).matchEmpty()) +
+                     Group::leadingClear(Group(&ctrl[i]).matchEmpty());
+        bool chain_ends = run < kGroupWidth;
+        setCtrl(i, chain_ends ? kEmpty : kDeleted);
+        if (!chain_ends) ++deleted;
+        --count;
+    }
+
+    // Rebuilds the table with room for n entries, dropping deleted markers
+    void rehash(size_t n) {
+        size_t new_capacity = kGroupWidth;
+        while (new_capacity * 7 / 8 < n) new_capacity <<= 1;
+        std::unique_ptr<int8_t[]> old_ctrl = std::move(ctrl);
+        std::unique_ptr<Slot[]> old_slots = std::move(slots);
+        size_t old_capacity = old_slots ? mask + 1 : 0;
+
+        ctrl.reset(new int8_t[new_capacity + kGroupWidth - 1]);
+        std::fill_n(ctrl.get(), new_capacity + kGroupWidth - 1, kEmpty);
+        slots.reset(new Slot[new_capacity]);
+        mask = new_capacity - 1;
+        table_bytes.store(new_capacity * (sizeof(Slot) + 1) + kGroupWidth - 1, std::memory_order_relaxed);
+        deleted = 0;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_ctrl[i] < 0) continue;
+            uint32_t h = hash(old_slots[i].key());
+            size_t to = freeIndex(h);
+            setCtrl(to, h2(h));
+            memcpy(&slots[to], &old_slots[i], sizeof(Slot)); // Moves the heap pointer, if any
+        }
+    }
+
+public:
+    FlatMap() = default;
+    FlatMap(const FlatMap&) = delete;
+    FlatMap& operator=(const FlatMap&) = delete;
+    ~FlatMap() {
+        for (size_t i = 0; i < capacity(); ++i) {
+            if (ctrl[i] >= 0) release(slots[i]);
+        }
+    }
+
+    size_t size() const { return count; }
+
+    // Bytes held by the table and the slabs behind its out-of-line entries.
+    // Safe to call from any thread.
+    size_t memoryUsage() const {
+        return tableBytes() + heap.reservedBytes();
+    }
+
+    size_t tableBytes() const { return table_bytes.load(std::memory_order_relaxed); }
+
+    // Bytes the entries themselves take: a slot each plus their chunks. Unlike
+    // memoryUsage it drops with every erase.
+    size_t dataBytes() const {
+        return count * sizeof(Slot) + heap.allocatedBytes();
+    }
+
+    const SlabAllocator& allocator() const { return heap; }
+
+    void reserve(size_t n) {
+        if (n > capacity() * 7 / 8) rehash(n);
+    }
+
+    // value, if given, stays valid until the map is next modified
+    bool find(std::string_view key, std::string_view* value = nullptr) const {
+        size_t i = findIndex(key, hash(key));
+        if (i == SIZE_MAX) return false;
+        if (value) *value = slots[i].value();
+        return true;
+    }
+
+    // Like find, also giving the entry's metadata. Only access may be changed
+    // in place; a new expiry goes through insertOrAssign.
+    bool lookup(std::string_view key, std::string_view* value, Meta** meta) {
+        size_t i = findIndex(key, hash(key));
+        if (i == SIZE_MAX) return false;
+        if (value) *value = slots[i].value();
+        *meta = &slots[i].meta;
+        return true;
+    }
+
+    bool lookup(std::string_view key, std::string_view* value, const Meta** meta) const {
+        size_t i = findIndex(key, hash(key));
+        if (i == SIZE_MAX) return false;
+        if (value) *value = slots[i].value();
+        *meta = &slots[i].meta;
+        return true;
+    }
+
+    // Also gives the key as the map holds it, which stays valid as long as value
+    bool lookup(std::string_view key, std::string_view* stored_key, std::string_view* value, const Meta** meta) const {
+        size_t i = findIndex(key, hash(key));
+        if (i == SIZE_MAX) return false;
+        *stored_key = slots[i].key();
+        if (value) *value = slots[i].value();
+        *meta = &slots[i].meta;
+        return true;
+    }
+
+    // Entries with an expiry time set
+    size_t expiringCount() const { return expiring; }
+
+    // Returns true if key was not present
+    bool insertOrAssign(std::string_view key, std::string_view value) {
+        return insertOrAssign(key, value, Meta());
+    }
+
+    bool insertOrAssign(std::string_view key, std::string_view value, Meta meta) {
+        uint32_t h = hash(key);
+        size_t i = findIndex(key, h);
+        if (i != SIZE_MAX) {
+            assign(slots[i], key, value);
+            setMeta(slots[i], meta);
+            return false;
+        }
+        if (count + deleted + 1 > capacity() * 7 / 8) {
+            rehash(std::max(count + 1, count * 2)); // Grows, or just clears deleted markers
+        }
+        i = freeIndex(h);
+        if (ctrl[i] == kDeleted) --deleted;
+        setCtrl(i, h2(h));
+        slots[i].key_len = 0;
+        slots[i].value_len = 0;
+        slots[i].meta = Meta();
+        assign(slots[i], key, value);
+        setMeta(slots[i], meta);
+        ++count;
+        return true;
+    }
+
+    bool erase(std::string_view key) {
+        size_t i = findIndex(key, hash(key));
+        if (i == SIZE_MAX) return false;
+        eraseAt(i);
+        return true;
+    }
+
+    // Visits up to n entries from slot start onwards, wrapping, calling
+    // fn(key, meta) on each: a cheap random sample when start is random
+    template<typename Fn>
+    void sample(size_t start, size_t n, Fn&& fn) const {
+        for (size_t i = 0, seen = 0; i < capacity() && seen < n; ++i) {
+            size_t pos = (start + i) & mask;
+            if (ctrl[pos] < 0) continue;
+            fn(slots[pos].key(), slots[pos].meta);
+            ++seen;
+        }
+    }
+
+    // Calls erase_if(key, meta) on the entries in up to max_slots slots from
+    // where the last call stopped, erasing those it returns true for.
+    // Returns true once it has gone past the end of the table.
+    template<typename Fn>
+    bool sweep(size_t max_slots, Fn&& erase_if) {
+        size_t end = std::min(capacity(), sweep_cursor + max_slots);
+        for (; sweep_cursor < end; ++sweep_cursor) {
+            if (ctrl[sweep_cursor] >= 0 && erase_if(slots[sweep_cursor].key(), slots[sweep_cursor].meta)) {
+                eraseAt(sweep_cursor);
+            }
+        }
+        if (sweep_cursor < capacity()) return false;
+        sweep_cursor = 0;
+        return true;
+    }
+
+    // Moves out-of-line entries out of sparse slabs so those can be unmapped,
+    // looking at up to max_slots slots from where the last call stopped.
+    // Returns true once it has gone past the end of the table.
+    bool defragment(size_t max_slots) {
+        size_t end = std::min(capacity(), defrag_cursor + max_slots);
+        for (; defrag_cursor < end; ++defrag_cursor) {
+            Slot& slot = slots[defrag_cursor];
+            if (ctrl[defrag_cursor] < 0 || slot.isInline()) continue;
+            size_t size = slot.key_len + slot.value_len;
+            if (!heap.sparse(slot.heap, size)) continue;
+            char* moved = static_cast<char*>(heap.allocate(size));
+            memcpy(moved, slot.heap, size);
+            heap.deallocate(slot.heap, size);
+            slot.heap = moved;
+        }
+        if (defrag_cursor < capacity()) return false;
+        defrag_cursor = 0;
+        return true;
+    }
+
+    // Calls fn(key, value) for every entry, in no particular order
+    template<typename Fn>
+    void forEach(Fn&& fn) const {
+        for (size_t i = 0; i < capacity(); ++i) {
+            if (ctrl[i] >= 0) fn(slots[i].key(), slots[i].value());
+        }
+    }
+};
+
+class Node {
+public:
+    std::string ip;
+    int port;
+    uint32_t weight;   // Relative share of the ring
+    bool self = false; // This process
+
+    Node(const std::string& ip, int port, uint32_t weight = 1) : ip(ip), port(port), weight(weight) {}
+
+    std::string id() const {
+        return ip + ":" + std::to_string(port);
+    }
+};
+
+// Parses "host:port[:weight]"
+inline bool parseNodeSpec(std::string_view spec, std::string& host, int& port, uint32_t& weight) {
+    size_t colon = spec.find(':');
+    if (colon == std::string_view::npos || colon == 0) return false;
+    size_t weight_colon = spec.find(':', colon + 1);
+    std::string_view port_text = spec.substr(colon + 1, weight_colon == std::string_view::npos ? std::string_view::npos
+                                                                                                : weight_colon - colon - 1);
+    auto [end, ec] = std::from_chars(port_text.data(), port_text.data() + port_text.size(), port);
+    if (ec != std::errc() || end != port_text.data() + port_text.size() || port <= 0 || port > 65535) return false;
+    weight = 1;
+    if (weight_colon != std::string_view::npos) {
+        std::string_view weight_text = spec.substr(weight_colon + 1);
+        auto [wend, wec] = std::from_chars(weight_text.data(), weight_text.data() + weight_text.size(), weight);
+        if (wec != std::errc() || wend != weight_text.data() + weight_text.size() || weight == 0) return false;
+    }
+    host = spec.substr(0, colon);
+    return true;
+}
+
+// "ip:port:weight,..." as NODE SET and LIST send member lists
+inline std::string formatMembers(const std::vector<Node>& members) {
+    std::string list;
+    for (const auto& node : members) {
+        if (!list.empty()) list += ',';
+        list += node.id() + ":" + std::to_string(node.weight);
+    }
+    return list;
+}
+
+inline bool parseMembers(std::string_view list, std::vector<Node>& members) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string host;
+        int node_port;
+        uint32_t weight;
+        if (!parseNodeSpec(list.substr(0, comma), host, node_port, weight)) return false;
+        members.emplace_back(host, node_port, weight);
+        list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+    }
+    return !members.empty();
+}
+
+// Consistent hash ring with virtual nodes. Every node contributes
+// vnodes * weight tokens, placed by hashing "ip:port#i". A key belongs to the
+// node owning the first token at or after its hash, wrapping around past the
+// largest token. Tokens live in one sorted uint32_t array so lookup is a
+// binary search over contiguous memory.
+class HashRing {
+private:
+    std::vector<uint32_t> tokens; // Sorted token positions
+    std::vector<uint32_t> owners; // owners[i] is the index of the node owning tokens[i]
+    size_t node_count = 0;
+
+    size_t tokenFor(uint32_t keyHash) const {
+        // Branchless lower_bound: the loop runs log2(n) times regardless of the
+        // key, so random lookups don't pay for mispredicted branches
+        const uint32_t* base = tokens.data();
+        size_t n = tokens.size();
+        while (n > 1) {
+            size_t half = n / 2;
+            base = base[half - 1] < keyHash ? base + half : base;
+            n -= half;
+        }
+        size_t idx = (base - tokens.data()) + (*base < keyHash);
+        return idx == tokens.size() ? 0 : idx;
+    }
+
+public:
+    void build(const std::vector<Node>& nodes, size_t vnodes, RingHash hash = RingHash::Murmur3) {
+        node_count = nodes.size();
+        std::vector<std::pair<uint32_t, uint32_t>> points;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            std::string base = nodes[i].id() + "#";
+            size_t count = std::max<size_t>(vnodes, 1) * std::max<uint32_t>(nodes[i].weight, 1);
+            for (size_t v = 0; v < count; ++v) {
+                std::string token_id = base + std::to_string(v);
+                points.emplace_back(ringHash(hash, token_id), i);
+            }
+        }
+        // Ties go to the node that sorts first so every member builds the same ring
+        std::sort(points.begin(), points.end());
+        tokens.clear();
+        owners.clear();
+        tokens.reserve(points.size());
+        owners.reserve(points.size());
+        for (const auto& [token, owner] : points) {
+            tokens.push_back(token);
+            owners.push_back(owner);
+        }
+    }
+
+    bool empty() const { return tokens.empty(); }
+    size_t size() const { return tokens.size(); }
+
+    size_t ownerOf(uint32_t keyHash) const {
+        return owners[tokenFor(keyHash)];
+    }
+
+    // The owner followed by the next n - 1 distinct nodes clockwise: the
+    // nodes holding copies of the key when it is replicated n times
+    void ownersOf(uint32_t keyHash, size_t n, std::vector<uint32_t>& out) const {
+        out.clear();
+        n = std::min(n, node_count);
+        for (size_t i = tokenFor(keyHash), seen = 0; out.size() < n && seen < tokens.size(); ++seen) {
+            if (std::find(out.begin(), out.end(), owners[i]) == out.end()) out.push_back(owners[i]);
+            if (++i == tokens.size()) i = 0;
+        }
+    }
+};
+
+// When the write-ahead log is flushed to disk
+enum class FsyncPolicy : uint8_t {
+    Always,   // Before replying to a write; one fdatasync per batch
+    Interval, // Every Config::fsync_interval, off the request path
+    Never     // Left to the kernel
+};
+
+// What a shard at its memory limit does with a write that adds data
+enum class EvictionPolicy : uint8_t {
+    None, // Refuse the write
+    Lru,  // Evict the least recently used of a few sampled keys
+    Lfu   // Evict the least frequently used of a few sampled keys
+};
+
+// How many copies of a replicated write must be applied before it is acknowledged
+enum class WriteAck : uint8_t {
+    One,    // The primary's
+    Quorum, // A majority of the replicas, the primary included
+    All
+};
+
+// Where a GET or MGET is served from when keys are replicated
+enum class ReadFrom : uint8_t {
+    Primary, // The key's owner, falling back to its replicas if it is down
+    Replica  // This node if it holds a copy, else the replica with the fewest requests in flight
+};
+
+// Node settings; main.cpp fills these from the environment
+struct Config {
+    size_t workers = 1;  // Worker threads, each owning one shard
+    size_t vnodes = 1024; // Ring tokens per node (times its weight)
+    std::string data_dir; // Write-ahead log directory; empty keeps data in memory only
+    FsyncPolicy fsync = FsyncPolicy::Interval;
+    std::chrono::milliseconds fsync_interval{1000};
+    uint64_t snapshot_log_bytes = 64 << 20; // Snapshot after logging this much; 0 disables snapshots
+    std::chrono::milliseconds scan_timeout{1000}; // Time a peer has to answer each scan page
+    size_t max_memory = 0; // Bytes of key/value data across all shards; 0 for no limit
+    EvictionPolicy eviction = EvictionPolicy::None;
+    size_t eviction_samples = 5; // Keys compared to pick each eviction victim
+    size_t replicas = 1; // Copies of each key: its owner and the next replicas - 1 nodes on the ring
+    WriteAck write_ack = WriteAck::One;
+    ReadFrom read_from = ReadFrom::Primary;
+    size_t migrate_rate = 32 << 20; // Bytes per second a node moves to new owners after NODE ADD/REMOVE
+    int metrics_port = 0; // Serves Prometheus text metrics over HTTP; 0 for none
+    RingHash ring_hash = RingHash::Murmur3; // Must match on every member
+    size_t near_cache_keys = 0; // Values read from other nodes kept across all workers; 0 for none
+    std::chrono::milliseconds near_cache_lease{100}; // Longest a near-cached value is served
+};
+
+enum class Op : uint8_t { Put = 1, Get, Remove, Range, Prefix, MGet, MPut, MDel, Memory, Node, Stats, Cas }; // Values are binary opcodes
+
+struct Command {
+    Op op = Op::Get;
+    std::string key;   // PUT/GET/REMOVE/CAS key, RANGE start key, PREFIX prefix, NODE subcommand
+    std::string value; // PUT/CAS value, NODE argument
+    uint32_t expires = 0; // PUT/CAS: expiry time in Unix seconds; 0 for never
+    uint64_t expected = 0; // CAS: the version the key must have; 0 for a key that must not exist
+    bool versioned = false; // GET: reply with the key's version too
+    std::string end;   // RANGE end key
+    uint32_t limit = 0;  // RANGE/PREFIX: at most this many keys; 0 for all of them
+    std::string after;   // RANGE/PREFIX: continue after this key
+    bool values = false; // RANGE/PREFIX: return each key's value too
+    uint64_t pin = 0;    // RANGE/PREFIX: read as of this pinned version; 0 to pin the latest
+    bool resumable = false; // RANGE/PREFIX: keep the pins for the next page and reply with them
+    std::string snapshot; // RANGE/PREFIX: every node's pin from an earlier page, to read the next one at
+    bool hold_pin = false; // RANGE/PREFIX page of a paged scan: keep the pin until NODE UNPIN or its lease ends
+    bool replica = false; // PUT/REMOVE/MPUT/MDEL: a copy sent by the key's primary; not replicated again
+    bool rerouted = false; // Passed on by a peer whose ring disagreed with the sender's; always served
+    bool migrate = false;  // MPUT: keys moving to a new holder, each value prefixed with expires(4);
+                           // MDEL: keys that moved away
+    bool lease = false;    // GET: value is "<lease ms> <host:port>"; the owner tells that node when the key changes
+    std::vector<std::pair<std::string, std::string>> items; // MGET/MPUT/MDEL keys, with MPUT values
+};
+
+enum class Status : uint8_t {
+    Ok,
+    NotFound,
+    Error,
+    Partial, // Binary protocol: one chunk of a streamed scan; more frames with its id follow
+    Conflict // CAS: the key's version was not the expected one
+};
+
+struct Reply {
+    Status status = Status::Ok;
+    std::string value;               // GET value or error message
+    std::vector<std::string> keys;   // RANGE/PREFIX matches in key order
+    std::vector<std::string> values; // Their values, if the scan asked for them
+    bool more = false;               // The scan stopped at its limit with matches left
+    bool incomplete = false;         // The scan is missing a node's keys
+    std::vector<bool> found;         // MGET/MDEL: per key in request order; MGET values are in values
+    bool leased = false;             // GET: the owner granted the lease the request asked for
+    uint64_t version = 0;            // Versioned GET, CAS and other writes: the key's version
+    uint64_t pin = 0;                // RANGE/PREFIX: the version the node's keys were read at
+    std::string snapshot;            // RANGE/PREFIX with more: the pins the next page reads at
+};
+
+// Binary protocol. A connection whose first byte is kBinaryMagic speaks it for
+// its lifetime; anything else is the newline-delimited text protocol. All
+// integers are big-endian.
+//
+//   request:  magic(1) opcode(1) flags(2) id(4) key_len(4) value_len(4) key value
+//   response: magic(1) status(1) opcode(1) reserved(1) id(4) body_len(4) body
+//
+// RANGE sends its end key as the value. A GET body is the value, an error body
+// is the message, and a RANGE/PREFIX body is a sequence of keys, each with a
+// 4-byte length and, with kFlagValues, followed by its length-prefixed value.
+// Responses echo the request id and may arrive out of order.
+//
+// With kFlagPaged a RANGE/PREFIX value is limit(4) after_len(4) after end: at
+// most limit keys that sort after `after`. A scan reply may be streamed as any
+// number of Partial frames followed by a final Ok frame whose flags byte (the
+// reserved byte) has kReplyMore set if matches remain; the last key received
+// is then the `after` of the next page. kReplyIncomplete means some node did
+// not answer in time and its keys are missing from the result.
+//
+// MGET, MPUT and MDEL send their keys as the key field and MPUT its values as
+// the value field, each with a 4-byte length. An MGET body holds found(1) per
+// key, followed by the length-prefixed value if found; an MDEL body holds
+// found(1) per key.
+//
+// With kFlagTtl a PUT value starts with the key's time to live in seconds
+// (ttl(4), at least 1) and the key expires after it.
+//
+// With kFlagLease a GET value is "<ms> <host:port>": the node at host:port
+// caches the value for ms milliseconds and asks to be sent NODE INVALIDATE
+// <key> if the key changes before then. A reply with kReplyLease in its flags
+// byte agrees to that.
+//
+// Every write is numbered from the node's write sequence and the number is
+// the version of the key it wrote. A reply with kReplyVersion set has a body
+// that starts with a version(8): single-key writes reply with the version
+// they gave the key, and with kFlagVersioned a GET replies with the key's.
+// A CAS value is expected(8) followed by a PUT value (with kFlagTtl, its
+// ttl(4) and the value). It writes the key only if its version is expected,
+// or if expected is 0 and the key does not exist; otherwise the reply is a
+// Conflict whose version is the key's current one, 0 if it has none.
+//
+// A RANGE/PREFIX reads each node as of a version pinned on it for the scan.
+// Between nodes, a scan page with kFlagPinned has a value that starts with
+// the pin(8) to read at, and a page reply with kReplyPinned starts with the
+// pin it was read at; a page without the flag pins the node's latest version.
+// With kFlagSnapshot a paged value continues after `after` with snap_len(4)
+// snapshot, and the scan keeps its pins for the next page: a final frame with
+// kReplyMore then has kReplySnapshot set and a body that starts with
+// snap_len(4) snapshot, which the next page sends to read at the same pins.
+// The first page sends an empty one. A snapshot is "node=version" per node,
+// comma separated, and each pin lapses if no page renews it for a lease.
+//
+// MEMORY has no key; its body is the same line the text protocol returns.
+// NODE sends its subcommand (ADD, REMOVE, LIST, and SET and STATUS between
+// members) as the key and its argument as the value; the body is the reply line.
+constexpr uint8_t kBinaryMagic = 0xB5;
+constexpr uint16_t kFlagLocal = 1;  // Serve from the receiving node without routing (peer requests)
+constexpr uint16_t kFlagValues = 2; // RANGE/PREFIX: include values
+constexpr uint16_t kFlagPaged = 4;  // RANGE/PREFIX: value carries limit and continuation
+constexpr uint16_t kFlagTtl = 8;    // PUT: value is ttl(4) followed by the value
+constexpr uint16_t kFlagReplica = 16; // Write: a copy from the key's primary, applied without replicating
+constexpr uint16_t kFlagRerouted = 32; // Served by the receiving node even if its ring places the key elsewhere
+constexpr uint16_t kFlagMigrate = 64;  // MPUT: keys moving to a new holder; each value is expires(4) value
+constexpr uint16_t kFlagLease = 128;   // GET: value asks for a lease on the key
+constexpr uint16_t kFlagVersioned = 256; // GET: reply with the key's version
+constexpr uint16_t kFlagPinned = 512;  // RANGE/PREFIX: value starts with the pinned version to read at
+constexpr uint16_t kFlagSnapshot = 1024; // RANGE/PREFIX: paged value ends in the pins to resume at, if any
+constexpr uint16_t kFlagHoldPin = 2048;  // RANGE/PREFIX page: keep the pin until NODE UNPIN
+constexpr uint32_t kMaxTtl = 1u << 30; // Seconds; keeps expiry times within 32 bits
+constexpr uint8_t kReplyMore = 1;   // Scan reply flag: stopped at the limit
+constexpr uint8_t kReplyValues = 2; // Scan reply flag: body includes values
+constexpr uint8_t kReplyIncomplete = 4; // Scan reply flag: a node timed out or failed
+constexpr uint8_t kReplyLease = 8;  // GET reply flag: the lease was granted
+constexpr uint8_t kReplyVersion = 16; // Body starts with the key's version
+constexpr uint8_t kReplyPinned = 32;  // Scan reply flag: body starts with the version read at
+constexpr uint8_t kReplySnapshot = 64; // Scan reply flag: body starts with the pins to resume at
+constexpr size_t kRequestHeaderSize = 16;
+constexpr size_t kResponseHeaderSize = 12;
+constexpr uint32_t kMaxFrame = 256 << 20;
+
+// A request parsed in place; the views point into the receive buffer
+struct RequestView {
+    Op op = Op::Get;
+    uint16_t flags = 0;
+    uint32_t id = 0;
+    std::string_view key;
+    std::string_view value; // PUT value, RANGE end key or NODE argument
+    uint32_t ttl = 0;       // PUT/CAS: seconds to live; 0 for no expiry
+    uint64_t expected = 0;  // CAS: the version the key must have
+    uint32_t limit = 0;     // RANGE/PREFIX page size
+    std::string_view after; // RANGE/PREFIX continuation
+    uint64_t pin = 0;       // RANGE/PREFIX: version pinned by an earlier page
+    std::string_view snapshot; // RANGE/PREFIX: every node's pin from an earlier page
+    std::pmr::vector<std::pair<std::string_view, std::string_view>> items; // MGET/MPUT/MDEL
+
+    // Scratch allocations such as items come from scratch
+    explicit RequestView(std::pmr::memory_resource* scratch = std::pmr::get_default_resource()) : items(scratch) {}
+};
+
+enum class ParseStatus {
+    Ok,
+    Incomplete, // Need more bytes
+    Rejected,   // Well-framed but invalid; the frame is consumed and error explains why
+    Invalid     // Not a frame; the stream cannot be resynchronised
+};
+
+inline uint32_t loadBE32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+inline uint16_t loadBE16(const char* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+inline void appendBE32(std::string& out, uint32_t v) {
+    v = htonl(v);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+inline void appendBE16(std::string& out, uint16_t v) {
+    v = htons(v);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+inline uint64_t loadBE64(const char* p) {
+    return (static_cast<uint64_t>(loadBE32(p)) << 32) | loadBE32(p + 4);
+}
+
+inline void appendBE64(std::string& out, uint64_t v) {
+    appendBE32(out, static_cast<uint32_t>(v >> 32));
+    appendBE32(out, static_cast<uint32_t>(v));
+}
+
+// Splits the next whitespace-separated token off the front of rest
+inline std::string_view nextToken(std::string_view& rest) {
+    size_t start = 0;
+    while (start < rest.size() && (rest[start] == ' ' || rest[start] == '\t')) ++start;
+    size_t end = start;
+    while (end < rest.size() && rest[end] != ' ' && rest[end] != '\t') ++end;
+    std::string_view token = rest.substr(start, end - start);
+    rest.remove_prefix(end);
+    return token;
+}
+
+// Calls fn(node, version) for each pin of a scan snapshot ("node=version,...");
+// false if it is malformed
+template <typename Fn>
+bool forEachPin(std::string_view snapshot, Fn&& fn) {
+    while (!snapshot.empty()) {
+        size_t comma = snapshot.find(',');
+        std::string_view entry = snapshot.substr(0, comma);
+        snapshot.remove_prefix(comma == std::string_view::npos ? snapshot.size() : comma + 1);
+        size_t eq = entry.rfind('=');
+        uint64_t version = 0;
+        if (eq == std::string_view::npos || eq == 0) return false;
+        auto [end, ec] = std::from_chars(entry.data() + eq + 1, entry.data() + entry.size(), version);
+        if (ec != std::errc() || end != entry.data() + entry.size() || version == 0) return false;
+        fn(entry.substr(0, eq), version);
+    }
+    return true;
+}
+
+inline bool validSnapshot(std::string_view snapshot) {
+    return !snapshot.empty() && forEachPin(snapshot, [](std::string_view, uint64_t) {});
+}
+
+inline void appendPin(std::string& snapshot, const std::string& node, uint64_t version) {
+    if (!snapshot.empty()) snapshot += ',';
+    snapshot += node;
+    snapshot += '=';
+    snapshot += std::to_string(version);
+}
+
+// Trailing RANGE/PREFIX options: LIMIT n, VALUES, AFTER token
+bool parseScanOptions(std::string_view rest, RequestView& req, std::string& error) {
+    for (std::string_view option = nextToken(rest); !option.empty(); option = nextToken(rest)) {
+        if (option == "LIMIT") {
+            std::string_view count = nextToken(rest);
+            auto [end, ec] = std::from_chars(count.data(), count.data() + count.size(), req.limit);
+            if (ec != std::errc() || end != count.data() + count.size() || req.limit == 0) {
+                error = "ERROR: LIMIT requires a positive count";
+                return false;
+            }
+            req.flags |= kFlagPaged | kFlagSnapshot;
+        } else if (option == "VALUES") {
+            req.flags |= kFlagValues;
+        } else if (option == "AFTER") {
+            req.after = nextToken(rest);
+            // A token as returned: >key, then @snapshot to read at the first
+            // page's pins. Keys may hold '@', so only a suffix that parses as
+            // a snapshot is taken for one.
+            if (!req.after.empty() && req.after[0] == '>') {
+                req.after.remove_prefix(1);
+                size_t at = req.after.rfind('@');
+                if (at != std::string_view::npos && validSnapshot(req.after.substr(at + 1))) {
+                    req.snapshot = req.after.substr(at + 1);
+                    req.after = req.after.substr(0, at);
+                    req.flags |= kFlagSnapshot;
+                }
+            }
+            if (req.after.empty()) {
+                error = "ERROR: AFTER requires a key";
+                return false;
+            }
+        } else {
+            error = "ERROR: unknown scan option";
+            LOG_DEBUG("Invalid scan option", "option", option);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Trailing PUT/CAS option: EX seconds
+bool parseTtl(std::string_view rest, RequestView& req, std::string& error) {
+    if (nextToken(rest) != "EX") return true;
+    std::string_view seconds = nextToken(rest);
+    auto [end, ec] = std::from_chars(seconds.data(), seconds.data() + seconds.size(), req.ttl);
+    if (ec != std::errc() || end != seconds.data() + seconds.size() || req.ttl == 0 || req.ttl > kMaxTtl) {
+        error = "ERROR: EX requires a positive number of seconds";
+        return false;
+    }
+    return true;
+}
+
+// Parses one text request line; on failure error holds the response to send
+bool parseTextRequest(std::string_view line, RequestView& req, std::string& error) {
+    std::string_view command = nextToken(line);
+    if (command == "PUT") {
+        req.op = Op::Put;
+        req.key = nextToken(line);
+        req.value = nextToken(line);
+        if (req.key.empty() || req.value.empty()) {
+            error = "ERROR: PUT requires key and value";
+            LOG_DEBUG("Invalid PUT request: key or value missing");
+            return false;
+        }
+        return parseTtl(line, req, error);
+    } else if (command == "CAS") {
+        req.op = Op::Cas;
+        req.key = nextToken(line);
+        std::string_view expected = nextToken(line);
+        req.value = nextToken(line);
+        auto [end, ec] = std::from_chars(expected.data(), expected.data() + expected.size(), req.expected);
+        if (req.key.empty() || req.value.empty() || ec != std::errc() || end != expected.data() + expected.size()) {
+            error = "ERROR: CAS requires key, expected version and value";
+            LOG_DEBUG("Invalid CAS request: key, version or value missing");
+            return false;
+        }
+        return parseTtl(line, req, error);
+    } else if (command == "GET" || command == "GETV") {
+        req.op = Op::Get;
+        req.key = nextToken(line);
+        if (req.key.empty()) {
+            error = "ERROR: " + std::string(command) + " requires key";
+            LOG_DEBUG("Invalid GET request: key missing");
+            return false;
+        }
+        if (command == "GETV") req.flags |= kFlagVersioned;
+    } else if (command == "REMOVE") {
+        req.op = Op::Remove;
+        req.key = nextToken(line);
+        if (req.key.empty()) {
+            error = "ERROR: REMOVE requires key";
+            LOG_DEBUG("Invalid REMOVE request: key missing");
+            return false;
+        }
+    } else if (command == "RANGE") {
+        req.op = Op::Range;
+        req.key = nextToken(line);
+        req.value = nextToken(line);
+        if (req.key.empty() || req.value.empty()) {
+            error = "ERROR: RANGE requires start and end keys";
+            LOG_DEBUG("Invalid RANGE request: start or end missing");
+            return false;
+        }
+        return parseScanOptions(line, req, error);
+    } else if (command == "PREFIX") {
+        req.op = Op::Prefix;
+        req.key = nextToken(line);
+        if (req.key.empty()) {
+            error = "ERROR: PREFIX requires prefix";
+            LOG_DEBUG("Invalid PREFIX request: prefix missing");
+            return false;
+        }
+        return parseScanOptions(line, req, error);
+    } else if (command == "MGET" || command == "MPUT" || command == "MDEL") {
+        req.op = command == "MGET" ? Op::MGet : command == "MPUT" ? Op::MPut : Op::MDel;
+        for (std::string_view key = nextToken(line); !key.empty(); key = nextToken(line)) {
+            std::string_view value = req.op == Op::MPut ? nextToken(line) : std::string_view();
+            if (req.op == Op::MPut && value.empty()) {
+                error = "ERROR: MPUT requires key value pairs";
+                LOG_DEBUG("Invalid MPUT request: value missing", "key", key);
+                return false;
+            }
+            req.items.emplace_back(key, value);
+        }
+        if (req.items.empty()) {
+            error = "ERROR: " + std::string(command) + " requires at least one key";
+            LOG_DEBUG("Invalid request: no keys", "command", command);
+            return false;
+        }
+    } else if (command == "MEMORY") {
+        req.op = Op::Memory;
+    } else if (command == "STATS") {
+        req.op = Op::Stats;
+    } else if (command == "NODE") {
+        req.op = Op::Node;
+        req.key = nextToken(line);
+        req.value = nextToken(line);
+        if (req.key != "LIST" && ((req.key != "ADD" && req.key != "REMOVE") || req.value.empty())) {
+            error = "ERROR: NODE ADD host:port[:weight], NODE REMOVE host:port or NODE LIST";
+            return false;
+        }
+    } else {
+        error = "INVALID_COMMAND";
+        LOG_DEBUG("Invalid command", "command", command);
+        return false;
+    }
+    return true;
+}
+
+inline bool isBatch(Op op) {
+    return op == Op::MGet || op == Op::MPut || op == Op::MDel;
+}
+
+// Parses the binary request at the start of buffer without copying it
+ParseStatus parseBinaryRequest(std::string_view buffer, RequestView& req, size_t& consumed, std::string& error) {
+    if (buffer.size() < kRequestHeaderSize) return ParseStatus::Incomplete;
+    const char* p = buffer.data();
+    if (static_cast<uint8_t>(p[0]) != kBinaryMagic) return ParseStatus::Invalid;
+    uint8_t opcode = static_cast<uint8_t>(p[1]);
+    uint32_t key_len = loadBE32(p + 8);
+    uint32_t value_len = loadBE32(p + 12);
+    if (key_len > kMaxFrame || value_len > kMaxFrame - key_len) return ParseStatus::Invalid;
+    if (buffer.size() - kRequestHeaderSize < key_len + value_len) return ParseStatus::Incomplete;
+
+    req.op = static_cast<Op>(opcode);
+    req.flags = loadBE16(p + 2);
+    req.id = loadBE32(p + 4);
+    req.key = buffer.substr(kRequestHeaderSize, key_len);
+    req.value = buffer.substr(kRequestHeaderSize + key_len, value_len);
+    consumed = kRequestHeaderSize + key_len + value_len;
+
+    if (opcode < static_cast<uint8_t>(Op::Put) || opcode > static_cast<uint8_t>(Op::Cas)) {
+        error = "INVALID_COMMAND";
+        return ParseStatus::Rejected;
+    }
+    if (isBatch(req.op)) {
+        std::string_view keys = req.key;
+        std::string_view values = req.value;
+        auto field = [](std::string_view& list, std::string_view& to) {
+            if (list.size() < 4 || list.size() - 4 < loadBE32(list.data())) return false;
+            to = list.substr(4, loadBE32(list.data()));
+            list.remove_prefix(4 + to.size());
+            return true;
+        };
+        while (!keys.empty()) {
+            std::pair<std::string_view, std::string_view> item;
+            if (!field(keys, item.first) || item.first.empty() ||
+                (req.op == Op::MPut && !field(values, item.second))) {
+                error = "ERROR: malformed key list";
+                return ParseStatus::Rejected;
+            }
+            req.items.push_back(item);
+        }
+        if (req.items.empty() || !values.empty() || (req.op != Op::MPut && !req.value.empty())) {
+            error = "ERROR: malformed key list";
+            return ParseStatus::Rejected;
+        }
+        if (req.op == Op::MPut && (req.flags & kFlagMigrate) &&
+            std::any_of(req.items.begin(), req.items.end(), [](const auto& item) { return item.second.size() < 4; })) {
+            error = "ERROR: malformed key list";
+            return ParseStatus::Rejected;
+        }
+        return ParseStatus::Ok;
+    }
+    if (req.op == Op::Cas) {
+        if (req.value.size() < 8) {
+            error = "ERROR: malformed expected version";
+            return ParseStatus::Rejected;
+        }
+        req.expected = loadBE64(req.value.data());
+        req.value.remove_prefix(8);
+    }
+    if ((req.op == Op::Put || req.op == Op::Cas) && (req.flags & kFlagTtl)) {
+        if (req.value.size() < 4 || loadBE32(req.value.data()) == 0 || loadBE32(req.value.data()) > kMaxTtl) {
+            error = "ERROR: malformed ttl";
+            return ParseStatus::Rejected;
+        }
+        req.ttl = loadBE32(req.value.data());
+        req.value.remove_prefix(4);
+    }
+    if ((req.op == Op::Range || req.op == Op::Prefix) && (req.flags & kFlagPinned)) {
+        if (req.value.size() < 8 || loadBE64(req.value.data()) == 0) {
+            error = "ERROR: malformed scan arguments";
+            return ParseStatus::Rejected;
+        }
+        req.pin = loadBE64(req.value.data());
+        req.value.remove_prefix(8);
+    }
+    if ((req.op == Op::Range || req.op == Op::Prefix) && (req.flags & kFlagPaged)) {
+        std::string_view args = req.value;
+        if (args.size() < 8 || args.size() - 8 < loadBE32(args.data() + 4)) {
+            error = "ERROR: malformed scan arguments";
+            return ParseStatus::Rejected;
+        }
+        req.limit = loadBE32(args.data());
+        req.after = args.substr(8, loadBE32(args.data() + 4));
+        args.remove_prefix(8 + req.after.size());
+        if (req.flags & kFlagSnapshot) {
+            if (args.size() < 4 || args.size() - 4 < loadBE32(args.data())) {
+                error = "ERROR: malformed scan arguments";
+                return ParseStatus::Rejected;
+            }
+            req.snapshot = args.substr(4, loadBE32(args.data()));
+            args.remove_prefix(4 + req.snapshot.size());
+            if (!req.snapshot.empty() && !validSnapshot(req.snapshot)) {
+                error = "ERROR: malformed scan snapshot";
+                return ParseStatus::Rejected;
+            }
+        }
+        req.value = args;
+    }
+    if ((req.key.empty() && req.op != Op::Memory && req.op != Op::Stats) || (req.op == Op::Range && req.value.empty())) {
+        error = "ERROR: missing key";
+        return ParseStatus::Rejected;
+    }
+    return ParseStatus::Ok;
+}
+
+Command toCommand(const RequestView& req) {
+    Command cmd;
+    cmd.op = req.op;
+    cmd.key = req.key;
+    if (req.op == Op::Range) {
+        cmd.end = req.value;
+    } else if (req.op == Op::Put || req.op == Op::Cas || req.op == Op::Node ||
+               (req.op == Op::Get && (req.flags & kFlagLease))) {
+        cmd.value = req.value;
+        if (req.ttl) cmd.expires = expiryAfter(req.ttl);
+    }
+    cmd.expected = req.expected;
+    cmd.versioned = req.op == Op::Get && (req.flags & kFlagVersioned);
+    cmd.limit = req.limit;
+    cmd.after = req.after;
+    cmd.pin = req.pin;
+    cmd.resumable = req.flags & kFlagSnapshot;
+    cmd.snapshot = req.snapshot;
+    cmd.hold_pin = req.flags & kFlagHoldPin;
+    cmd.values = req.flags & kFlagValues;
+    cmd.replica = req.flags & kFlagReplica;
+    cmd.rerouted = req.flags & kFlagRerouted;
+    cmd.migrate = req.flags & kFlagMigrate;
+    cmd.lease = req.op == Op::Get && (req.flags & kFlagLease);
+    cmd.items.reserve(req.items.size());
+    for (const auto& [key, value] : req.items) cmd.items.emplace_back(key, value);
+    return cmd;
+}
+
+void appendBinaryRequest(std::string& out, uint32_t id, uint16_t flags, const Command& cmd) {
+    std::string scan_args;
+    const std::string* value_ptr = &cmd.value;
+    if (cmd.op == Op::Range || cmd.op == Op::Prefix) {
+        if (cmd.values) flags |= kFlagValues;
+        value_ptr = &cmd.end;
+        if (cmd.pin) {
+            flags |= kFlagPinned;
+            appendBE64(scan_args, cmd.pin);
+        }
+        if (cmd.hold_pin) flags |= kFlagHoldPin;
+        if (cmd.limit > 0 || !cmd.after.empty() || cmd.resumable) {
+            flags |= kFlagPaged;
+            appendBE32(scan_args, cmd.limit);
+            appendBE32(scan_args, static_cast<uint32_t>(cmd.after.size()));
+            scan_args += cmd.after;
+            if (cmd.resumable) {
+                flags |= kFlagSnapshot;
+                appendBE32(scan_args, static_cast<uint32_t>(cmd.snapshot.size()));
+                scan_args += cmd.snapshot;
+            }
+        }
+        if (!scan_args.empty()) {
+            scan_args += cmd.end;
+            value_ptr = &scan_args;
+        }
+    }
+    if (cmd.replica) flags |= kFlagReplica;
+    if (cmd.rerouted) flags |= kFlagRerouted;
+    if (cmd.migrate) flags |= kFlagMigrate;
+    if (cmd.lease) flags |= kFlagLease;
+    if (cmd.versioned) flags |= kFlagVersioned;
+    std::string put_args;
+    if (cmd.op == Op::Cas) appendBE64(put_args, cmd.expected);
+    if ((cmd.op == Op::Put || cmd.op == Op::Cas) && cmd.expires) {
+        // Sent as the time left, so the receiver's clock decides when it
+        // expires; less the second expiryAfter() rounds up by, as it adds it again
+        uint32_t now = unixSeconds();
+        flags |= kFlagTtl;
+        appendBE32(put_args, cmd.expires > now + 1 ? cmd.expires - now - 1 : 1);
+    }
+    if (!put_args.empty()) {
+        put_args += cmd.value;
+        value_ptr = &put_args;
+    }
+    std::string batch_keys;
+    std::string batch_values;
+    if (isBatch(cmd.op)) {
+        for (const auto& [key, value] : cmd.items) {
+            appendBE32(batch_keys, static_cast<uint32_t>(key.size()));
+            batch_keys += key;
+            if (cmd.op == Op::MPut) {
+                appendBE32(batch_values, static_cast<uint32_t>(value.size()));
+                batch_values += value;
+            }
+        }
+        value_ptr = &batch_values;
+    }
+    const std::string& key = isBatch(cmd.op) ? batch_keys : cmd.key;
+    const std::string& value = *value_ptr;
+    out += static_cast<char>(kBinaryMagic);
+    out += static_cast<char>(cmd.op);
+    appendBE16(out, flags);
+    appendBE32(out, id);
+    appendBE32(out, static_cast<uint32_t>(key.size()));
+    appendBE32(out, static_cast<uint32_t>(value.size()));
+    out += key;
+    out += value;
+}
+
+void appendBinaryHeader(std::string& out, uint32_t id, Op op, Status status, uint8_t flags, size_t body_len) {
+    out += static_cast<char>(kBinaryMagic);
+    out += static_cast<char>(status);
+    out += static_cast<char>(op);
+    out += static_cast<char>(flags);
+    appendBE32(out, id);
+    appendBE32(out, static_cast<uint32_t>(body_len));
+}
+
+// One scan result in a RANGE/PREFIX body
+inline void appendScanEntry(std::string& out, std::string_view key, const std::string* value) {
+    appendBE32(out, static_cast<uint32_t>(key.size()));
+    out += key;
+    if (value) {
+        appendBE32(out, static_cast<uint32_t>(value->size()));
+        out += *value;
+    }
+}
+
+void appendBinaryReply(std::string& out, uint32_t id, Op op, const Reply& reply) {
+    if (reply.status == Status::Ok && (op == Op::MGet || op == Op::MDel)) {
+        size_t body_len = reply.found.size();
+        for (size_t i = 0; i < reply.found.size(); ++i) {
+            if (op == Op::MGet && reply.found[i]) body_len += 4 + reply.values[i].size();
+        }
+        appendBinaryHeader(out, id, op, reply.status, 0, body_len);
+        for (size_t i = 0; i < reply.found.size(); ++i) {
+            out += static_cast<char>(reply.found[i]);
+            if (op == Op::MGet && reply.found[i]) {
+                appendBE32(out, static_cast<uint32_t>(reply.values[i].size()));
+                out += reply.values[i];
+            }
+        }
+        return;
+    }
+    bool list = reply.status == Status::Ok && (op == Op::Range || op == Op::Prefix);
+    if (!list) {
+        uint8_t flags = (reply.leased ? kReplyLease : 0) | (reply.version ? kReplyVersion : 0);
+        appendBinaryHeader(out, id, op, reply.status, flags, (reply.version ? 8 : 0) + reply.value.size());
+        if (reply.version) appendBE64(out, reply.version);
+        out += reply.value;
+        return;
+    }
+    bool values = !reply.values.empty();
+    size_t body_len = (reply.pin ? 8 : 0) + (reply.snapshot.empty() ? 0 : 4 + reply.snapshot.size());
+    for (size_t i = 0; i < reply.keys.size(); ++i) {
+        body_len += 4 + reply.keys[i].size() + (values ? 4 + reply.values[i].size() : 0);
+    }
+    uint8_t flags = (reply.more ? kReplyMore : 0) | (values ? kReplyValues : 0) |
+                    (reply.incomplete ? kReplyIncomplete : 0) | (reply.pin ? kReplyPinned : 0) |
+                    (reply.snapshot.empty() ? 0 : kReplySnapshot);
+    appendBinaryHeader(out, id, op, reply.status, flags, body_len);
+    if (reply.pin) appendBE64(out, reply.pin);
+    if (!reply.snapshot.empty()) {
+        appendBE32(out, static_cast<uint32_t>(reply.snapshot.size()));
+        out += reply.snapshot;
+    }
+    for (size_t i = 0; i < reply.keys.size(); ++i) {
+        appendScanEntry(out, reply.keys[i], values ? &reply.values[i] : nullptr);
+    }
+}
+
+// The text protocol's reply line for a command
+std::string formatReply(Op op, const Reply& reply) {
+    if (reply.status == Status::NotFound) return "NOT_FOUND";
+    if (reply.status == Status::Error) return reply.value.empty() ? "ERROR" : reply.value;
+    if (reply.status == Status::Conflict) return "CONFLICT " + std::to_string(reply.version);
+    switch (op) {
+        case Op::Put:
+        case Op::Remove:
+            return "OK";
+        case Op::Cas:
+            return "OK " + std::to_string(reply.version);
+        case Op::Get:
+            // GETV replies "<version> <value>"
+            return reply.version ? std::to_string(reply.version) + " " + reply.value : reply.value;
+        case Op::Memory:
+        case Op::Node:
+        case Op::Stats:
+            return reply.value;
+        case Op::Range:
+        case Op::Prefix: {
+            std::string response;
+            for (const auto& k : reply.keys) {
+                response += k + " ";
+            }
+            // The token to pass to AFTER for the next page
+            if (reply.more && !reply.keys.empty()) {
+                response += ">" + reply.keys.back() + (reply.snapshot.empty() ? "" : "@" + reply.snapshot);
+            }
+            return response.empty() ? "NONE" : response;
+        }
+        case Op::MPut:
+            return "OK";
+        case Op::MGet:
+        case Op::MDel: {
+            // One result per key, in request order
+            std::string response;
+            for (size_t i = 0; i < reply.found.size(); ++i) {
+                if (i) response += ' ';
+                if (!reply.found[i]) {
+                    response += "NOT_FOUND";
+                } else {
+                    response += op == Op::MGet ? reply.values[i] : "OK";
+                }
+            }
+            return response;
+        }
+    }
+    return "ERROR";
+}
+
+ParseStatus parseBinaryReply(std::string_view buffer, uint32_t& id, Reply& reply, size_t& consumed) {
+    if (buffer.size() < kResponseHeaderSize) return ParseStatus::Incomplete;
+    const char* p = buffer.data();
+    if (static_cast<uint8_t>(p[0]) != kBinaryMagic) return ParseStatus::Invalid;
+    uint32_t body_len = loadBE32(p + 8);
+    if (body_len > kMaxFrame) return ParseStatus::Invalid;
+    if (buffer.size() - kResponseHeaderSize < body_len) return ParseStatus::Incomplete;
+
+    reply.status = static_cast<Status>(p[1]);
+    Op op = static_cast<Op>(p[2]);
+    uint8_t flags = static_cast<uint8_t>(p[3]);
+    id = loadBE32(p + 4);
+    std::string_view body = buffer.substr(kResponseHeaderSize, body_len);
+    consumed = kResponseHeaderSize + body_len;
+    if ((reply.status == Status::Ok || reply.status == Status::Partial) && (op == Op::Range || op == Op::Prefix)) {
+        reply.more = flags & kReplyMore;
+        reply.incomplete = flags & kReplyIncomplete;
+        if (flags & kReplyPinned) {
+            if (body.size() < 8) return ParseStatus::Invalid;
+            reply.pin = loadBE64(body.data());
+            body.remove_prefix(8);
+        }
+        if (flags & kReplySnapshot) {
+            if (body.size() < 4 || body.size() - 4 < loadBE32(body.data())) return ParseStatus::Invalid;
+            reply.snapshot = body.substr(4, loadBE32(body.data()));
+            body.remove_prefix(4 + reply.snapshot.size());
+        }
+        auto field = [&body](std::vector<std::string>& to) {
+            if (body.size() < 4 || body.size() - 4 < loadBE32(body.data())) return false;
+            uint32_t len = loadBE32(body.data());
+            to.emplace_back(body.substr(4, len));
+            body.remove_prefix(4 + len);
+            return true;
+        };
+        while (!body.empty()) {
+            if (!field(reply.keys) || ((flags & kReplyValues) && !field(reply.values))) return ParseStatus::Invalid;
+        }
+    } else if (reply.status == Status::Ok && (op == Op::MGet || op == Op::MDel)) {
+        while (!body.empty()) {
+            bool found = body[0];
+            body.remove_prefix(1);
+            reply.found.push_back(found);
+            if (op != Op::MGet) continue;
+            reply.values.emplace_back();
+            if (!found) continue;
+            if (body.size() < 4 || body.size() - 4 < loadBE32(body.data())) return ParseStatus::Invalid;
+            reply.values.back() = body.substr(4, loadBE32(body.data()));
+            body.remove_prefix(4 + reply.values.back().size());
+        }
+    } else {
+        if (flags & kReplyVersion) {
+            if (body.size() < 8) return ParseStatus::Invalid;
+            reply.version = loadBE64(body.data());
+            body.remove_prefix(8);
+        }
+        reply.value = body;
+        reply.leased = op == Op::Get && (flags & kReplyLease);
+    }
+    return ParseStatus::Ok;
+}
+
+// Point-in-time image of a node's keys, sorted and packed into ~4 KB blocks
+// so a lookup reads one block. Integers are big-endian:
+//
+//   header: magic "KVSNAP02"(8) seq(8)
+//   block:  { key_len(4) value_len(4) expires(4) key value }...
+//   index:  { offset(8) size(4) crc32c(4) entries(4) first_key_len(4) first_key }...
+//   footer: index_offset(8) index_size(8) block_count(8) key_count(8) index_crc32c(4) magic(8)
+//
+// seq is the last write-ahead log record the snapshot includes, and expires
+// is in Unix seconds, 0 for keys that never expire. Version 01 files, whose
+// entries have no expires field, are still read.
+constexpr char kSnapshotMagic[8] = {'K', 'V', 'S', 'N', 'A', 'P', '0', '2'};
+constexpr char kSnapshotMagicV1[8] = {'K', 'V', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr size_t kSnapshotHeaderSize = 16;
+constexpr size_t kSnapshotFooterSize = 44;
+constexpr size_t kSnapshotBlockSize = 4096;
+
+// Streams sorted key/value pairs into a snapshot file
+class SnapshotWriter {
+private:
+    int fd = -1;
+    std::string out;     // Bytes not yet written
+    uint64_t offset = 0; // File offset of the current block
+    std::string block;
+    std::string first_key;
+    uint32_t block_entries = 0;
+    std::string index;
+    uint64_t block_count = 0;
+    uint64_t key_count = 0;
+    bool failed = false;
+
+    void flushOut(bool force) {
+        if (out.size() < (1 << 20) && !force) return;
+        size_t done = 0;
+        while (done < out.size() && !failed) {
+            ssize_t n = write(fd, out.data() + done, out.size() - done);
+            if (n == -1 && errno != EINTR) {
+                LOG_ERROR("Snapshot write failed", "error", strerror(errno));
+                failed = true;
+            }
+            if (n > 0) done += n;
+        }
+        out.clear();
+    }
+
+    void finishBlock() {
+        if (block_entries == 0) return;
+        appendBE64(index, offset);
+        appendBE32(index, static_cast<uint32_t>(block.size()));
+        appendBE32(index, crc32c(block.data(), block.size()));
+        appendBE32(index, block_entries);
+        appendBE32(index, static_cast<uint32_t>(first_key.size()));
+        index += first_key;
+        out += block;
+        offset += block.size();
+        ++block_count;
+        block.clear();
+        block_entries = 0;
+        flushOut(false);
+    }
+
+public:
+    SnapshotWriter() = default;
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    ~SnapshotWriter() {
+        if (fd != -1) close(fd);
+    }
+
+    bool open(const std::string& path, uint64_t seq) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            LOG_ERROR("Failed to create snapshot", "path", path, "error", strerror(errno));
+            return false;
+        }
+        out.append(kSnapshotMagic, sizeof(kSnapshotMagic));
+        appendBE64(out, seq);
+        offset = kSnapshotHeaderSize;
+        return true;
+    }
+
+    // Keys must arrive in strictly increasing order
+    void add(std::string_view key, std::string_view value, uint32_t expires = 0) {
+        if (block_entries == 0) first_key = key;
+        appendBE32(block, static_cast<uint32_t>(key.size()));
+        appendBE32(block, static_cast<uint32_t>(value.size()));
+        appendBE32(block, expires);
+        block += key;
+        block += value;
+        ++block_entries;
+        ++key_count;
+        if (block.size() >= kSnapshotBlockSize) finishBlock();
+    }
+
+    // Writes the index and footer and waits for the file to reach disk
+    bool finish() {
+        finishBlock();
+        uint64_t index_offset = offset;
+        out += index;
+        appendBE64(out, index_offset);
+        appendBE64(out, index.size());
+        appendBE64(out, block_count);
+        appendBE64(out, key_count);
+        appendBE32(out, crc32c(index.data(), index.size()));
+        out.append(kSnapshotMagic, sizeof(kSnapshotMagic));
+        flushOut(true);
+        if (!failed && fdatasync(fd) == -1) {
+            LOG_ERROR("Snapshot fdatasync failed", "error", strerror(errno));
+            failed = true;
+        }
+        return !failed;
+    }
+};
+
+// A snapshot file mapped read-only. Blocks are checksummed when read, so a
+// damaged block surfaces as missing keys and an error log, not bad data.
+// Safe to share between workers.
+class Snapshot {
+private:
+    struct Block {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t crc;
+        std::string_view first_key; // Points into the mapping
+    };
+
+    const char* data = nullptr;
+    size_t length = 0;
+    uint64_t last_seq = 0;
+    uint64_t key_count = 0;
+    size_t entry_header = 12; // 8 in version 01 files
+    std::vector<Block> blocks;
+
+    Snapshot() = default;
+
+    // Index of the block that would hold key, or blocks.size() if key sorts first
+    size_t blockFor(std::string_view key) const {
+        auto it = std::upper_bound(blocks.begin(), blocks.end(), key,
+                                   [](std::string_view k, const Block& b) { return k < b.first_key; });
+        return it == blocks.begin() ? blocks.size() : (it - blocks.begin()) - 1;
+    }
+
+public:
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    ~Snapshot() {
+        if (data) munmap(const_cast<char*>(data), length);
+    }
+
+    // Maps and validates path; returns null if it is missing or damaged
+    static std::unique_ptr<Snapshot> open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < kSnapshotHeaderSize + kSnapshotFooterSize) {
+            close(fd);
+            return nullptr;
+        }
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return nullptr;
+
+        std::unique_ptr<Snapshot> snapshot(new Snapshot());
+        snapshot->data = static_cast<const char*>(map);
+        snapshot->length = st.st_size;
+        const char* footer = snapshot->data + snapshot->length - kSnapshotFooterSize;
+        uint64_t index_offset = loadBE64(footer);
+        uint64_t index_size = loadBE64(footer + 8);
+        uint64_t block_count = loadBE64(footer + 16);
+        const char* magic = memcmp(snapshot->data, kSnapshotMagicV1, sizeof(kSnapshotMagicV1)) == 0
+                                ? kSnapshotMagicV1 : kSnapshotMagic;
+        if (magic == kSnapshotMagicV1) snapshot->entry_header = 8;
+        if (memcmp(snapshot->data, magic, sizeof(kSnapshotMagic)) != 0 ||
+            memcmp(footer + 36, magic, sizeof(kSnapshotMagic)) != 0 ||
+            index_offset < kSnapshotHeaderSize || index_offset + index_size != snapshot->length - kSnapshotFooterSize ||
+            crc32c(snapshot->data + index_offset, index_size) != loadBE32(footer + 32)) {
+            LOG_ERROR("Snapshot is damaged", "path", path);
+            return nullptr;
+        }
+        snapshot->last_seq = loadBE64(snapshot->data + 8);
+        snapshot->key_count = loadBE64(footer + 24);
+
+        const char* p = snapshot->data + index_offset;
+        const char* end = p + index_size;
+        snapshot->blocks.reserve(block_count);
+        while (end - p >= 24) {
+            Block block;
+            block.offset = loadBE64(p);
+            block.size = loadBE32(p + 8);
+            block.crc = loadBE32(p + 12);
+            uint32_t key_len = loadBE32(p + 20);
+            if (static_cast<size_t>(end - p - 24) < key_len || block.offset < kSnapshotHeaderSize ||
+                block.offset + block.size > index_offset) {
+                break;
+            }
+            block.first_key = std::string_view(p + 24, key_len);
+            snapshot->blocks.push_back(block);
+            p += 24 + key_len;
+        }
+        if (p != end || snapshot->blocks.size() != block_count) {
+            LOG_ERROR("Snapshot has a damaged index", "path", path);
+            return nullptr;
+        }
+        return snapshot;
+    }
+
+    uint64_t seq() const { return last_seq; }
+    size_t size() const { return key_count; }
+    size_t blockCount() const { return blocks.size(); }
+
+    // Calls fn(key, value, expires) for each entry of block i, expired or not,
+    // until fn returns false. Returns false if the block fails its checksum.
+    template<typename Fn>
+    bool forEachInBlock(size_t i, Fn&& fn) const {
+        const Block& block = blocks[i];
+        const char* p = data + block.offset;
+        const char* end = p + block.size;
+        if (crc32c(p, block.size) != block.crc) {
+            LOG_ERROR("Snapshot block failed its checksum", "block", i);
+            return false;
+        }
+        while (static_cast<size_t>(end - p) >= entry_header) {
+            uint64_t key_len = loadBE32(p);
+            uint64_t value_len = loadBE32(p + 4);
+            uint32_t expires = entry_header > 8 ? loadBE32(p + 8) : 0;
+            const char* key = p + entry_header;
+            if (static_cast<uint64_t>(end - key) < key_len + value_len) return false;
+            if (!fn(std::string_view(key, key_len), std::string_view(key + key_len, value_len), expires)) break;
+            p = key + key_len + value_len;
+        }
+        return true;
+    }
+
+    // Drops the pages of blocks [first, end) from this process's memory. They
+    // are read back from the page cache if touched again.
+    void release(size_t first, size_t end) const {
+        if (first >= end) return;
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t from = (blocks[first].offset + page - 1) / page * page;
+        size_t to = (blocks[end - 1].offset + blocks[end - 1].size) / page * page;
+        if (to > from) madvise(const_cast<char*>(data) + from, to - from, MADV_DONTNEED);
+    }
+
+    // value may be null to only test for the key. Expired keys are not found.
+    bool get(std::string_view key, std::string* value) const {
+        size_t i = blockFor(key);
+        if (i == blocks.size()) return false;
+        bool found = false;
+        uint32_t now = unixSeconds();
+        forEachInBlock(i, [&](std::string_view k, std::string_view v, uint32_t expires) {
+            if (k < key) return true;
+            if (k == key && (expires == 0 || expires > now)) {
+                found = true;
+                if (value) value->assign(v);
+            }
+            return false;
+        });
+        return found;
+    }
+
+    // Calls fn(key, value) for each unexpired key >= start, in order, until fn
+    // returns false
+    template<typename Fn>
+    void scanFrom(std::string_view start, Fn&& fn) const {
+        size_t i = blockFor(start);
+        if (i == blocks.size()) i = 0;
+        bool more = true;
+        uint32_t now = unixSeconds();
+        for (; i < blocks.size() && more; ++i) {
+            forEachInBlock(i, [&](std::string_view k, std::string_view v, uint32_t expires) {
+                if (k < start || (expires && expires <= now)) return true;
+                more = fn(k, v);
+                return more;
+            });
+        }
+    }
+};
+
+// Versions that snapshot scans read at, shared by a node's workers. A scan
+// pins the node's next write sequence number when it starts and sees only the
+// writes before it; each page it reads renews the pin's lease. While a pin is
+// held, shards keep the values later writes replace or remove, and a pin that
+// goes unrenewed for a lease (its scan was abandoned) lapses, so old values
+// are never kept for long after the last scan that can read them.
+class VersionPins {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr uint64_t kNone = std::numeric_limits<uint64_t>::max();
+
+private:
+    struct Pin {
+        size_t holders = 0;
+        Clock::time_point expires;
+    };
+
+    mutable std::mutex mutex;
+    std::map<uint64_t, Pin> pins;
+    std::atomic<uint64_t> oldest_pin{kNone}; // Read by writers without the lock
+    std::chrono::milliseconds lease;
+
+    void publish() {
+        oldest_pin.store(pins.empty() ? kNone : pins.begin()->first);
+    }
+
+public:
+    explicit VersionPins(std::chrono::milliseconds lease = std::chrono::seconds(10)) : lease(lease) {}
+
+    // Pins sequence's next version: reads at it see every write numbered below
+    uint64_t pin(const std::atomic<uint64_t>& sequence, Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // A writer whose version is taken after the load below then sees a
+        // pin at or below it, and keeps what it replaces
+        oldest_pin.store(0);
+        uint64_t version = sequence.load();
+        Pin& p = pins[version];
+        ++p.holders;
+        p.expires = std::max(p.expires, now + lease);
+        publish();
+        return version;
+    }
+
+    // Extends a pin's lease; false if it has lapsed
+    bool renew(uint64_t version, Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pins.find(version);
+        if (it == pins.end() || it->second.expires <= now) return false;
+        it->second.expires = std::max(it->second.expires, now + lease);
+        return true;
+    }
+
+    void unpin(uint64_t version) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pins.find(version);
+        if (it == pins.end() || --it->second.holders > 0) return;
+        pins.erase(it);
+        publish();
+    }
+
+    // Drops the pins whose lease ran out; returns the oldest one left
+    uint64_t expire(Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = pins.begin(); it != pins.end();) {
+            it = it->second.expires <= now ? pins.erase(it) : std::next(it);
+        }
+        publish();
+        return oldest_pin.load();
+    }
+
+    // The oldest pinned version, or kNone
+    uint64_t oldest() const {
+        return oldest_pin.load();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pins.size();
+    }
+};
+
+// One partition of the node's keyspace. Each worker thread owns exactly one
+// shard and is the only thread that reads or writes its store and index.
+//
+// After a restart from a snapshot the shard starts out cold: keys not yet
+// loaded into store are served from the mapped snapshot, with tombstones for
+// the ones removed since, while warmUp() copies the snapshot in a few blocks
+// at a time.
+class Shard {
+private:
+    FlatMap store;
+    RIndex rindex;
+    std::shared_ptr<const Snapshot> cold;        // Until warm-up finishes
+    std::function<bool(std::string_view)> owns;  // Whether a snapshot key belongs to this shard
+    std::unordered_set<std::string> tombstones;  // Keys removed while they may still be in cold
+    size_t warm_block = 0;
+    size_t max_memory = 0; // Bytes; 0 for no limit
+    EvictionPolicy eviction = EvictionPolicy::None;
+    size_t eviction_samples = 5;
+    uint64_t random_state = 0x9E3779B97F4A7C15ull;
+    std::vector<std::pair<std::string, uint64_t>> evicted; // Key and removal version, since the last clearEvicted()
+    std::atomic<uint64_t> evicted_count{0};    // Readable from any thread
+    std::atomic<uint64_t> expired_count{0};
+    std::atomic<uint64_t>* sequence = nullptr; // Numbers writes; versions stay 0 without one
+    const VersionPins* pins = nullptr;
+
+    // A value a key held from version `from` until the write numbered `until`
+    // replaced or removed it, kept while a pinned scan may still read it
+    struct OldValue {
+        uint64_t from;
+        uint64_t until;
+        uint32_t expires;
+        std::string value;
+    };
+    std::map<std::string, std::vector<OldValue>, std::less<>> history; // Oldest first per key
+    std::atomic<size_t> history_size{0};
+    uint64_t pruned_at = VersionPins::kNone; // Oldest pin at the last pruneHistory()
+    bool importing = false; // Keys may still be arriving from their previous holders
+    std::unordered_set<std::string> removed_while_importing; // Not to be brought back by an import
+
+    // An LFU access value is the minute it was last updated (16 bits) and a
+    // logarithmic hit counter (8 bits) that drops by one per idle minute, as
+    // in Redis
+    static constexpr uint32_t kLfuInitial = 5;
+    static constexpr size_t kMaxEvictionsPerWrite = 64;
+
+    static void bump(std::atomic<uint64_t>& counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    uint64_t nextRandom() {
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        return random_state;
+    }
+
+    static bool expired(const FlatMap::Meta& meta, uint32_t now) {
+        return meta.expires && meta.expires <= now;
+    }
+
+    // The first of n consecutive write versions
+    uint64_t reserve(size_t n) {
+        return sequence ? sequence->fetch_add(n) : 0;
+    }
+
+    // Before the write numbered version replaces or removes key, keeps its
+    // current value if a pinned scan may read it
+    void retain(const std::string& key, uint64_t version) {
+        if (!version || !pins || version < pins->oldest()) return;
+        OldValue old{0, version, 0, std::string()};
+        std::string_view value;
+        const FlatMap::Meta* meta = nullptr;
+        if (store.lookup(key, &value, &meta)) {
+            old.from = meta->version;
+            old.expires = meta->expires;
+            old.value = value;
+        } else if (getCold(key, &old.value)) {
+            old.from = cold->seq();
+        } else {
+            return;
+        }
+        auto it = history.find(key);
+        if (it == history.end()) it = history.emplace(key, std::vector<OldValue>()).first;
+        it->second.push_back(std::move(old));
+        history_size.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // key's value as pinned scans at version `pin` see it: written before the
+    // pin and not yet replaced by then. Expiry is by the clock, as for reads
+    // of the latest value. value may be null.
+    bool readAt(const std::string& key, uint64_t pin, uint32_t now, std::string* value) const {
+        const FlatMap::Meta* meta = nullptr;
+        std::string_view current;
+        if (store.lookup(key, &current, &meta)) {
+            if (meta->version < pin) {
+                if (expired(*meta, now)) return false;
+                if (value) value->assign(current);
+                return true;
+            }
+        } else if (getCold(key, value)) {
+            return true;
+        }
+        auto it = history.find(key);
+        if (it == history.end()) return false;
+        for (auto old = it->second.rbegin(); old != it->second.rend(); ++old) {
+            if (old->from >= pin || old->until < pin) continue;
+            if (old->expires && old->expires <= now) return false;
+            if (value) *value = old->value;
+            return true;
+        }
+        return false;
+    }
+
+    // The version a CAS compares against: 0 if the key is absent
+    uint64_t versionOf(const std::string& key) {
+        FlatMap::Meta* meta = nullptr;
+        if (store.lookup(key, nullptr, &meta)) return expired(*meta, unixSeconds()) ? 0 : meta->version;
+        return getCold(key, nullptr) ? cold->seq() : 0;
+    }
+
+    // The LFU counter after decaying it for the minutes since it was last touched
+    static uint32_t lfuCounter(uint32_t access, uint32_t now) {
+        uint32_t idle_minutes = ((now / 60) - (access >> 8)) & 0xFFFF;
+        uint32_t counter = access & 0xFF;
+        return counter > idle_minutes ? counter - idle_minutes : 0;
+    }
+
+    // LRU access values are milliseconds on a clock that wraps every 49 days,
+    // fine enough to order keys touched within the same second
+    static uint32_t lruClock() {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void touch(FlatMap::Meta& meta, uint32_t now) {
+        if (eviction == EvictionPolicy::Lru) {
+            meta.access = lruClock();
+        } else if (eviction == EvictionPolicy::Lfu) {
+            // Each hit is less likely to count the higher the counter already is
+            uint32_t counter = lfuCounter(meta.access, now);
+            uint32_t base = counter > kLfuInitial ? counter - kLfuInitial : 0;
+            if (counter < 255 && nextRandom() % (base * 10 + 1) == 0) ++counter;
+            meta.access = ((now / 60) & 0xFFFF) << 8 | counter;
+        }
+    }
+
+    // Higher for a better eviction victim; expired keys go first
+    uint32_t evictionRank(const FlatMap::Meta& meta, uint32_t now, uint32_t clock) const {
+        if (expired(meta, now)) return std::numeric_limits<uint32_t>::max();
+        if (eviction == EvictionPolicy::Lfu) return 255 - lfuCounter(meta.access, now);
+        return std::min(clock - meta.access, std::numeric_limits<uint32_t>::max() - 1);
+    }
+
+    // Evicts sampled keys until the store is under its limit, if the policy
+    // allows. Returns false if it is still full.
+    bool makeRoom() {
+        if (!full()) return true;
+        if (eviction == EvictionPolicy::None) return false;
+        uint32_t now = unixSeconds();
+        uint32_t clock = lruClock();
+        for (size_t round = 0; round < kMaxEvictionsPerWrite && full() && store.size() > 0; ++round) {
+            std::string victim;
+            uint32_t best = 0;
+            bool sampled = false, is_expired = false;
+            store.sample(nextRandom(), eviction_samples, [&](std::string_view key, const FlatMap::Meta& meta) {
+                uint32_t rank = evictionRank(meta, now, clock);
+                if (!sampled || rank > best) {
+                    sampled = true;
+                    victim = key;
+                    best = rank;
+                    is_expired = expired(meta, now);
+                }
+            });
+            if (!sampled) break;
+            // Neither kept for pinned scans: expired and evicted keys are gone
+            // from every view, as memory is what ran out
+            remove(victim);
+            if (is_expired) {
+                bump(expired_count); // Replay drops it by its expiry time
+            } else {
+                bump(evicted_count);
+                evicted.emplace_back(std::move(victim), reserve(1));
+            }
+        }
+        return !full();
+    }
+
+    // The store's entry for key, or false if it has none or it has expired.
+    // An expired entry is removed on the way.
+    bool findLive(const std::string& key, std::string_view* value, uint64_t* version = nullptr) {
+        FlatMap::Meta* meta;
+        if (!store.lookup(key, value, &meta)) return false;
+        uint32_t now = unixSeconds();
+        if (expired(*meta, now)) {
+            remove(key);
+            bump(expired_count);
+            return false;
+        }
+        touch(*meta, now);
+        if (version) *version = meta->version;
+        return true;
+    }
+
+    // Looks up a key not in store; value may be null
+    bool getCold(const std::string& key, std::string* value) const {
+        if (!cold || tombstones.count(key)) return false;
+        return cold->get(key, value);
+    }
+
+    // Merges up to max of this shard's not-yet-loaded snapshot keys from start
+    // (exclusive if skip_start) until stop(key) into the sorted keys
+    template<typename Stop>
+    void mergeCold(const std::string& start, bool skip_start, Stop&& stop, size_t max,
+                   std::vector<std::string>& keys) const {
+        std::vector<std::string> loaded;
+        loaded.swap(keys);
+        std::vector<std::string> unloaded;
+        cold->scanFrom(start, [&](std::string_view k, std::string_view) {
+            if (skip_start && k == start) return true;
+            if (stop(k)) return false;
+            std::string key(k);
+            if (owns(k) && !store.find(key) && !tombstones.count(key)) unloaded.push_back(std::move(key));
+            return unloaded.size() < max;
+        });
+        keys.reserve(loaded.size() + unloaded.size());
+        std::merge(std::make_move_iterator(loaded.begin()), std::make_move_iterator(loaded.end()),
+                   std::make_move_iterator(unloaded.begin()), std::make_move_iterator(unloaded.end()),
+                   std::back_inserter(keys));
+    }
+
+    // Merges up to max keys that a pinned scan still sees but that have since
+    // been removed, neither in store nor in cold, into the sorted keys
+    template<typename Stop>
+    void mergeHistory(const std::string& start, bool skip_start, Stop&& stop, uint64_t pin, uint32_t now,
+                      size_t max, std::vector<std::string>& keys) const {
+        std::vector<std::string> removed;
+        for (auto it = history.lower_bound(start); it != history.end() && removed.size() < max; ++it) {
+            const std::string& key = it->first;
+            if (skip_start && key == start) continue;
+            if (stop(key)) break;
+            if (store.find(key) || getCold(key, nullptr) || !readAt(key, pin, now, nullptr)) continue;
+            removed.push_back(key);
+        }
+        if (removed.empty()) return;
+        std::vector<std::string> present;
+        present.swap(keys);
+        keys.reserve(present.size() + removed.size());
+        std::merge(std::make_move_iterator(present.begin()), std::make_move_iterator(present.end()),
+                   std::make_move_iterator(removed.begin()), std::make_move_iterator(removed.end()),
+                   std::back_inserter(keys));
+    }
+
+public:
+    // Writes are numbered from sequence, shared by the node's shards, and
+    // keep what they replace while pins holds a scan that may read it
+    void setVersions(std::atomic<uint64_t>* seq, const VersionPins* versions) {
+        sequence = seq;
+        pins = versions;
+    }
+
+    // A put whose expiry time has already passed removes the key. version
+    // numbers the write; 0 leaves it unnumbered and keeps nothing for scans.
+    void put(const std::string& key, std::string_view value, uint32_t expires = 0, uint64_t version = 0) {
+        uint32_t now = unixSeconds();
+        if (expires && expires <= now) {
+            remove(key, version);
+            return;
+        }
+        retain(key, version);
+        FlatMap::Meta meta;
+        meta.expires = expires;
+        meta.version = version;
+        FlatMap::Meta* old = nullptr;
+        if (eviction == EvictionPolicy::Lfu && store.lookup(key, nullptr, &old)) {
+            meta.access = old->access; // An overwrite keeps the key's frequency
+        } else if (eviction == EvictionPolicy::Lfu) {
+            meta.access = ((now / 60) & 0xFFFF) << 8 | kLfuInitial;
+        }
+        touch(meta, now);
+        if (store.insertOrAssign(key, value, meta)) {
+            rindex.insert(key);
+        }
+    }
+
+    // version numbers the write; 0 for expiry and eviction, which pinned
+    // scans do not keep the value through
+    bool remove(const std::string& key, uint64_t version = 0) {
+        retain(key, version);
+        bool removed = store.erase(key);
+        if (removed) rindex.remove(key);
+        if (getCold(key, nullptr)) {
+            tombstones.insert(key);
+            removed = true;
+        }
+        return removed;
+    }
+
+    // Calls fn(key, value, expires) for every unexpired key in key order. key
+    // and value point into the store and stay valid until it next changes.
+    // Only valid once warm.
+    template<typename Fn>
+    void forEach(Fn&& fn) const {
+        uint32_t now = unixSeconds();
+        rindex.scanFrom(std::string(), [&](const std::string& key) {
+            std::string_view stored, value;
+            const FlatMap::Meta* meta = nullptr;
+            if (store.lookup(key, &stored, &value, &meta) && !expired(*meta, now)) fn(stored, value, meta->expires);
+            return true;
+        });
+    }
+
+    // Calls fn(key, value, expires) for unexpired keys after the given one in
+    // key order until it returns false. Returns true if fn stopped it early.
+    template<typename Fn>
+    bool forEachAfter(const std::string& after, Fn&& fn) const {
+        uint32_t now = unixSeconds();
+        bool stopped = false;
+        rindex.scanFrom(after, [&](const std::string& key) {
+            if (key == after) return true;
+            std::string_view value;
+            const FlatMap::Meta* meta = nullptr;
+            if (!store.lookup(key, &value, &meta) || expired(*meta, now)) return true;
+            stopped = !fn(key, value, meta->expires);
+            return !stopped;
+        });
+        return stopped;
+    }
+
+    // While importing, removals are remembered so that a copy of the key
+    // still on its way from the previous holder does not bring it back
+    void setImporting(bool on) {
+        if (importing == on) return;
+        importing = on;
+        if (!on) removed_while_importing = std::unordered_set<std::string>();
+    }
+
+    // Whether a key this shard lacks may yet arrive from its previous holder
+    bool mayBeImporting(const std::string& key) const {
+        return importing && !removed_while_importing.count(key);
+    }
+
+    // Serves the keys in snapshot for which owns() is true until warmUp() has loaded them
+    void attachSnapshot(std::shared_ptr<const Snapshot> snapshot, std::function<bool(std::string_view)> filter) {
+        cold = std::move(snapshot);
+        owns = std::move(filter);
+        warm_block = 0;
+        store.reserve(store.size() + cold->size());
+    }
+
+    bool warming() const {
+        return cold != nullptr;
+    }
+
+    // Loads up to max_blocks more snapshot blocks. Returns true once the whole
+    // snapshot is in memory and has been released.
+    bool warmUp(size_t max_blocks) {
+        if (!cold) return true;
+        size_t first = warm_block;
+        size_t end = std::min(cold->blockCount(), warm_block + max_blocks);
+        for (; warm_block < end; ++warm_block) {
+            cold->forEachInBlock(warm_block, [&](std::string_view k, std::string_view v, uint32_t expires) {
+                if (!owns(k)) return true;
+                std::string key(k);
+                if (!store.find(key) && !tombstones.count(key)) put(key, v, expires, cold->seq());
+                return true;
+            });
+        }
+        cold->release(first, end);
+        if (warm_block < cold->blockCount()) return false;
+        cold.reset();
+        owns = nullptr;
+        tombstones = std::unordered_set<std::string>();
+        return true;
+    }
+
+    // Once the store's entries take this many bytes, writes that add data
+    // evict keys under the given policy, or are refused under None
+    void setMaxMemory(size_t bytes, EvictionPolicy policy, size_t samples) {
+        max_memory = bytes;
+        eviction = policy;
+        eviction_samples = std::max<size_t>(samples, 1);
+    }
+
+    bool full() const {
+        return max_memory && store.dataBytes() >= max_memory;
+    }
+
+    // Keys evicted to make room since the last clearEvicted(), with the
+    // versions their removals are logged under
+    const std::vector<std::pair<std::string, uint64_t>>& evictedKeys() const {
+        return evicted;
+    }
+
+    void clearEvicted() {
+        evicted.clear();
+    }
+
+    uint64_t evictedCount() const {
+        return evicted_count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t expiredCount() const {
+        return expired_count.load(std::memory_order_relaxed);
+    }
+
+    // Active expiry: removes the expired keys in up to max_slots slots of the
+    // store. Returns true once a pass over the store is complete.
+    bool expireSome(size_t max_slots) {
+        if (store.expiringCount() == 0) return true;
+        uint32_t now = unixSeconds();
+        return store.sweep(max_slots, [&](std::string_view k, const FlatMap::Meta& meta) {
+            if (!expired(meta, now)) return false;
+            std::string key(k);
+            rindex.remove(key);
+            if (getCold(key, nullptr)) tombstones.insert(key);
+            bump(expired_count);
+            return true;
+        });
+    }
+
+    bool fragmented() const {
+        return store.allocator().fragmented();
+    }
+
+    // Compacts up to max_slots entries; true once a pass over the store is done
+    bool defragment(size_t max_slots) {
+        return store.defragment(max_slots);
+    }
+
+    // The store's memory accounting; safe to call from any thread
+    const FlatMap& data() const {
+        return store;
+    }
+
+    // Old values kept for pinned scans, across all keys; readable from any thread
+    size_t historySize() const {
+        return history_size.load(std::memory_order_relaxed);
+    }
+
+    // Epoch-based reclamation of the values kept for pinned scans: once the
+    // oldest pin has moved past the write that replaced a value, no scan can
+    // read it any more. Values are only kept for writes at or above the
+    // oldest pin, so there is nothing new to drop until that changes, or
+    // until no pin is left: one taken and dropped between two calls may
+    // have had values kept for it.
+    void pruneHistory(uint64_t oldest) {
+        bool changed = oldest != pruned_at || oldest == VersionPins::kNone;
+        pruned_at = oldest;
+        if (history.empty() || !changed) return;
+        if (oldest == VersionPins::kNone) {
+            history.clear();
+        } else {
+            for (auto it = history.begin(); it != history.end();) {
+                auto& values = it->second;
+                values.erase(std::remove_if(values.begin(), values.end(),
+                                            [&](const OldValue& old) { return old.until < oldest; }),
+                             values.end());
+                it = values.empty() ? history.erase(it) : std::next(it);
+            }
+        }
+        size_t kept = 0;
+        for (const auto& [key, values] : history) kept += values.size();
+        history_size.store(kept, std::memory_order_relaxed);
+    }
+
+    // Writes reply with the version they were given, the first of a batch's
+    // consecutive ones
+    Reply execute(const Command& cmd) {
+        Reply reply;
+        if ((cmd.op == Op::Put || cmd.op == Op::MPut || cmd.op == Op::Cas) && !makeRoom()) {
+            reply.status = Status::Error;
+            reply.value = "ERROR: maxmemory reached";
+            return reply;
+        }
+        switch (cmd.op) {
+            case Op::Put:
+                reply.version = reserve(1);
+                put(cmd.key, cmd.value, cmd.expires, reply.version);
+                break;
+            case Op::Cas: {
+                uint64_t current = versionOf(cmd.key);
+                if (current != cmd.expected) {
+                    reply.status = Status::Conflict;
+                    reply.version = current;
+                    break;
+                }
+                reply.version = reserve(1);
+                put(cmd.key, cmd.value, cmd.expires, reply.version);
+                break;
+            }
+            case Op::Get: {
+                std::string_view value;
+                uint64_t version = 0;
+                if (findLive(cmd.key, &value, &version)) {
+                    reply.value = value;
+                } else if (getCold(cmd.key, &reply.value)) {
+                    version = cold->seq();
+                } else {
+                    reply.status = Status::NotFound;
+                }
+                if (cmd.versioned) reply.version = version;
+                break;
+            }
+            case Op::Remove:
+                if (importing) removed_while_importing.insert(cmd.key);
+                reply.version = reserve(1);
+                if (!remove(cmd.key, reply.version)) {
+                    reply.status = Status::NotFound;
+                    reply.version = 0;
+                }
+                break;
+            case Op::Range:
+            case Op::Prefix:
+                reply = scan(cmd);
+                break;
+            case Op::MGet:
+                reply.found.resize(cmd.items.size());
+                reply.values.resize(cmd.items.size());
+                for (size_t i = 0; i < cmd.items.size(); ++i) {
+                    std::string_view value;
+                    if (findLive(cmd.items[i].first, &value)) {
+                        reply.found[i] = true;
+                        reply.values[i] = value;
+                    } else {
+                        reply.found[i] = getCold(cmd.items[i].first, &reply.values[i]);
+                    }
+                }
+                break;
+            case Op::MPut:
+                reply.version = reserve(cmd.items.size());
+                if (cmd.migrate) {
+                    // Copies from a previous holder never replace newer writes
+                    reply.found.resize(cmd.items.size());
+                    for (size_t i = 0; i < cmd.items.size(); ++i) {
+                        const auto& [key, value] = cmd.items[i];
+                        if (store.find(key) || getCold(key, nullptr) || removed_while_importing.count(key)) continue;
+                        put(key, std::string_view(value).substr(4), loadBE32(value.data()), reply.version + i);
+                        reply.found[i] = true;
+                    }
+                    break;
+                }
+                for (size_t i = 0; i < cmd.items.size(); ++i) {
+                    put(cmd.items[i].first, cmd.items[i].second, 0, reply.version + i);
+                }
+                break;
+            case Op::MDel:
+                reply.version = reserve(cmd.items.size());
+                reply.found.resize(cmd.items.size());
+                for (size_t i = 0; i < cmd.items.size(); ++i) {
+                    if (importing && !cmd.migrate) removed_while_importing.insert(cmd.items[i].first);
+                    reply.found[i] = remove(cmd.items[i].first, reply.version + i);
+                }
+                break;
+            case Op::Memory:
+            case Op::Node:
+            case Op::Stats:
+                break; // Answered by the node, not a shard
+        }
+        return reply;
+    }
+
+    // One page of a RANGE/PREFIX: the matching keys after cmd.after, in order,
+    // at most cmd.limit of them. With cmd.pin set, as of that version.
+    Reply scan(const Command& cmd) const {
+        bool resume = !cmd.after.empty() && cmd.after >= cmd.key;
+        const std::string& from = resume ? cmd.after : cmd.key;
+        auto past = [&](std::string_view key) {
+            return cmd.op == Op::Range ? key > cmd.end : key.substr(0, cmd.key.size()) != cmd.key;
+        };
+        // One key beyond the limit tells whether more remain
+        size_t want = cmd.limit ? cmd.limit + 1 : std::numeric_limits<size_t>::max();
+
+        // Expired keys still in the store are skipped, not removed
+        bool check_expiry = store.expiringCount() > 0;
+        uint32_t now = unixSeconds();
+
+        Reply reply;
+        bool pinned = cmd.pin != 0;
+        rindex.scanFrom(from, [&](const std::string& key) {
+            if (resume && key == from) return true;
+            if (past(key)) return false;
+            if (pinned) {
+                if (!readAt(key, cmd.pin, now, nullptr)) return true;
+            } else {
+                const FlatMap::Meta* meta = nullptr;
+                if (check_expiry && store.lookup(key, nullptr, &meta) && expired(*meta, now)) return true;
+            }
+            reply.keys.push_back(key);
+            return reply.keys.size() < want;
+        });
+        if (cold) mergeCold(from, resume, past, want, reply.keys);
+        if (pinned && !history.empty()) mergeHistory(from, resume, past, cmd.pin, now, want, reply.keys);
+        if (cmd.limit && reply.keys.size() > cmd.limit) {
+            reply.keys.resize(cmd.limit);
+            reply.more = true;
+        }
+        if (cmd.values) {
+            reply.values.resize(reply.keys.size());
+            for (size_t i = 0; i < reply.keys.size(); ++i) {
+                std::string_view value;
+                if (pinned) {
+                    readAt(reply.keys[i], cmd.pin, now, &reply.values[i]);
+                } else if (store.find(reply.keys[i], &value)) {
+                    reply.values[i] = value;
+                } else {
+                    getCold(reply.keys[i], &reply.values[i]);
+                }
+            }
+        }
+        return reply;
+    }
+};
+
+// Write-ahead log for one worker's shard. Records appended during an event
+// loop iteration are buffered and written by a single commit(), so one
+// write() and at most one fdatasync() cover the whole batch (group commit).
+// Integers are big-endian:
+//
+//   record: crc32c(4) body_len(4) body
+//   body:   seq(8) opcode(1) key_len(4) value_len(4) key value [expires(4)]
+//
+// The CRC covers the body. seq is node-wide, so logs written by different
+// workers can be merged back into one order at startup. A PUT of a key with
+// a TTL ends with its expiry time in Unix seconds.
+class WriteAheadLog {
+private:
+    int fd = -1;
+    off_t size = 0;      // Bytes durably framed in the file
+    std::string pending; // Records not yet written
+
+public:
+    static constexpr size_t kRecordHeaderSize = 8;
+    static constexpr size_t kBodyHeaderSize = 17;
+
+    WriteAheadLog() = default;
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        if (fd != -1) close(fd);
+    }
+
+    bool open(const std::string& path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            LOG_ERROR("Failed to open write-ahead log", "path", path, "error", strerror(errno));
+            return false;
+        }
+        size = st.st_size;
+        return true;
+    }
+
+    size_t pendingBytes() const {
+        return pending.size();
+    }
+
+    void append(uint64_t seq, Op op, const std::string& key, const std::string& value, uint32_t expires = 0) {
+        size_t start = pending.size();
+        pending.append(kRecordHeaderSize, '\0');
+        appendBE64(pending, seq);
+        pending.push_back(static_cast<char>(op));
+        appendBE32(pending, static_cast<uint32_t>(key.size()));
+        appendBE32(pending, static_cast<uint32_t>(value.size()));
+        pending += key;
+        pending += value;
+        if (expires) appendBE32(pending, expires);
+
+        size_t body_len = pending.size() - start - kRecordHeaderSize;
+        uint32_t header[2] = {htonl(crc32c(pending.data() + start + kRecordHeaderSize, body_len)),
+                              htonl(static_cast<uint32_t>(body_len))};
+        memcpy(&pending[start], header, sizeof(header));
+    }
+
+    // Writes the buffered batch and, if sync is set, waits for it to reach disk.
+    // A failed write is cut back off the file so later records stay replayable.
+    bool commit(bool sync) {
+        size_t offset = 0;
+        while (offset < pending.size()) {
+            ssize_t n = write(fd, pending.data() + offset, pending.size() - offset);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("Write-ahead log write failed", "error", strerror(errno));
+                if (ftruncate(fd, size) == -1) {
+                    LOG_ERROR("Failed to truncate write-ahead log", "error", strerror(errno));
+                }
+                pending.clear();
+                return false;
+            }
+            offset += n;
+        }
+        size += pending.size();
+        pending.clear();
+        return !sync || this->sync();
+    }
+
+    // Safe to call from another thread while the owner appends
+    bool sync() {
+        if (fdatasync(fd) == -1) {
+            LOG_ERROR("Write-ahead log fdatasync failed", "error", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+};
+
+// Sequential reader over one log file, used for replay at startup
+class WalReader {
+private:
+    static constexpr size_t kChunkSize = 1 << 20;
+
+    int fd = -1;
+    std::string buffer;
+    size_t pos = 0;        // Start of the next record in buffer
+    off_t valid_end = 0;   // File offset just past the last good record
+    bool damaged = false;
+
+    // Makes at least need bytes available from pos; false at end of file
+    bool fill(size_t need) {
+        while (buffer.size() - pos < need) {
+            buffer.erase(0, pos);
+            pos = 0;
+            size_t old_size = buffer.size();
+            buffer.resize(old_size + std::max(kChunkSize, need));
+            ssize_t n = read(fd, &buffer[old_size], buffer.size() - old_size);
+            buffer.resize(old_size + std::max<ssize_t>(n, 0));
+            if (n <= 0) return false;
+        }
+        return true;
+    }
+
+public:
+    struct Record {
+        uint64_t seq = 0;
+        Op op = Op::Put;
+        std::string_view key;   // Valid until the next call to next()
+        std::string_view value;
+        uint32_t expires = 0;
+    };
+
+    WalReader() = default;
+    WalReader(const WalReader&) = delete;
+    WalReader& operator=(const WalReader&) = delete;
+
+    ~WalReader() {
+        if (fd != -1) close(fd);
+    }
+
+    bool open(const std::string& path) {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            LOG_ERROR("Failed to open write-ahead log", "path", path, "error", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // Returns false at the end of the log. A short or corrupt record (a write
+    // torn by a crash) also ends it, and sets isDamaged().
+    bool next(Record& rec) {
+        if (!fill(WriteAheadLog::kRecordHeaderSize)) {
+            damaged = buffer.size() > pos;
+            return false;
+        }
+        uint32_t crc = loadBE32(buffer.data() + pos);
+        uint32_t body_len = loadBE32(buffer.data() + pos + 4);
+        if (body_len < WriteAheadLog::kBodyHeaderSize || body_len > kMaxFrame ||
+            !fill(WriteAheadLog::kRecordHeaderSize + body_len)) {
+            damaged = true;
+            return false;
+        }
+        const char* body = buffer.data() + pos + WriteAheadLog::kRecordHeaderSize;
+        uint8_t opcode = static_cast<uint8_t>(body[8]);
+        uint64_t key_len = loadBE32(body + 9);
+        uint64_t value_len = loadBE32(body + 13);
+        uint64_t entry_len = WriteAheadLog::kBodyHeaderSize + key_len + value_len;
+        bool has_expiry = opcode == static_cast<uint8_t>(Op::Put) && entry_len + 4 == body_len;
+        if (crc32c(body, body_len) != crc || entry_len + (has_expiry ? 4 : 0) != body_len ||
+            (opcode != static_cast<uint8_t>(Op::Put) && opcode != static_cast<uint8_t>(Op::Remove))) {
+            damaged = true;
+            return false;
+        }
+        rec.seq = loadBE64(body);
+        rec.op = static_cast<Op>(opcode);
+        rec.key = std::string_view(body + WriteAheadLog::kBodyHeaderSize, key_len);
+        rec.value = std::string_view(body + WriteAheadLog::kBodyHeaderSize + key_len, value_len);
+        rec.expires = has_expiry ? loadBE32(body + entry_len) : 0;
+        pos += WriteAheadLog::kRecordHeaderSize + body_len;
+        valid_end += WriteAheadLog::kRecordHeaderSize + body_len;
+        return true;
+    }
+
+    bool isDamaged() const {
+        return damaged;
+    }
+
+    off_t validLength() const {
+        return valid_end;
+    }
+};
+
+// A worker's cache of values it read from other nodes. A key is only cached
+// from its second miss while the doorkeeper, a bitmap of recently missed key
+// hashes cleared as it fills, still remembers it, so keys read once do not
+// push out hot ones. An entry lasts until the lease its owner granted runs
+// out, or less if the owner reports the key changed or a write for it passes
+// through this worker. The least recently used entry goes when it is full.
+class NearCache {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct Entry {
+        std::string key;
+        std::string value;
+        Clock::time_point expires;
+    };
+
+    std::list<Entry> lru; // Most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index; // Views of the entries' keys
+    std::vector<uint64_t> doorkeeper;
+    size_t doorkeeper_marks = 0;
+    size_t capacity = 0;
+    uint64_t generation_ = 0;
+
+    void erase(std::unordered_map<std::string_view, std::list<Entry>::iterator>::iterator it) {
+        auto entry = it->second;
+        index.erase(it);
+        lru.erase(entry);
+    }
+
+public:
+    // 0 turns the cache off
+    void setCapacity(size_t keys) {
+        capacity = keys;
+        doorkeeper.assign(keys ? std::max<size_t>(keys / 8, 64) : 0, 0); // About 8 bits per entry
+        doorkeeper_marks = 0;
+        clear();
+    }
+
+    bool enabled() const { return capacity > 0; }
+
+    // Sets value if key is cached and its lease has not run out
+    bool get(const std::string& key, Clock::time_point now, std::string* value) {
+        auto it = index.find(key);
+        if (it == index.end()) return false;
+        if (now >= it->second->expires) {
+            erase(it);
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        *value = it->second->value;
+        return true;
+    }
+
+    // Records a miss on key; true if the doorkeeper had already seen it
+    bool admit(std::string_view key) {
+        size_t bit = localHash(key) % (doorkeeper.size() * 64);
+        uint64_t mask = 1ull << (bit % 64);
+        if (doorkeeper[bit / 64] & mask) return true;
+        doorkeeper[bit / 64] |= mask;
+        if (++doorkeeper_marks >= doorkeeper.size() * 32) {
+            std::fill(doorkeeper.begin(), doorkeeper.end(), 0);
+            doorkeeper_marks = 0;
+        }
+        return false;
+    }
+
+    void put(const std::string& key, std::string value, Clock::time_point expires) {
+        auto it = index.find(key);
+        if (it != index.end()) erase(it);
+        lru.push_front({key, std::move(value), expires});
+        index.emplace(lru.front().key, lru.begin());
+        if (index.size() > capacity) erase(index.find(lru.back().key));
+    }
+
+    void invalidate(std::string_view key) {
+        ++generation_;
+        auto it = index.find(key);
+        if (it != index.end()) erase(it);
+    }
+
+    void clear() {
+        ++generation_;
+        index.clear();
+        lru.clear();
+    }
+
+    // Raised by every invalidation. A read sent before the latest one may
+    // bring back the value it invalidated, so its reply is not cached.
+    uint64_t generation() const { return generation_; }
+};
+
+class DistributedKVStore {
+private:
+    // A response slot, filled in when the request completes. Slots are
+    // written to the socket strictly in request order.
+    struct PendingReply {
+        bool ready = false;
+        std::string text;
+    };
+
+    enum class Protocol : uint8_t { Unknown, Text, Binary };
+
+    // Per-client state for the event loop
+    struct Connection {
+        int fd = -1;
+        std::string in;         // Received bytes not yet parsed into requests
+        std::string out;        // Responses not yet written
+        size_t out_offset = 0;  // Bytes of out already written
+        std::deque<PendingReply> replies;
+        uint64_t first_seq = 0; // Sequence number of replies.front()
+        bool readable = false;  // Socket may have unread data
+        bool peer_closed = false;
+        bool failed = false;
+        bool in_service = false;
+        Protocol protocol = Protocol::Unknown;
+        size_t binary_inflight = 0; // Binary requests not yet answered
+        std::vector<std::function<void()>> drain_waiters; // Scans paused until out is flushed
+    };
+
+    using Callback = std::function<void(Reply&&)>;
+
+    // Reply to a request sent to another node; ok is false if the peer could not be reached
+    using RpcCallback = std::function<void(bool ok, Reply&& reply)>;
+
+    struct RpcCall {
+        RpcCallback done;
+        std::chrono::steady_clock::time_point deadline;
+        std::chrono::steady_clock::time_point sent;
+        Op op;
+    };
+
+    // The copies of one replicated write applied so far
+    struct WriteAcks {
+        Callback done;
+        Reply reply;                 // The primary's
+        std::vector<uint8_t> copies; // Per key (one for PUT/REMOVE): copies applied
+        size_t needed = 1;           // Copies every key needs before the reply
+        size_t pending = 0;          // Copies not yet answered, the primary's included
+        bool local = false;          // The primary's copy is applied and logged
+        bool replied = false;
+    };
+
+    // Persistent, pipelined connection from one worker to one peer node
+    struct PeerLink {
+        uint64_t id = 0; // epoll id
+        std::string host;
+        int port = 0;
+        int fd = -1;
+        bool connecting = false;
+        std::string in;
+        std::string out;
+        size_t out_offset = 0;
+        std::unordered_map<uint32_t, RpcCall> inflight; // Keyed by request id
+        uint32_t next_id = 1;
+        std::chrono::steady_clock::time_point retry_after;
+    };
+
+    // One version of the cluster's membership and the ring built from it.
+    // Immutable once published; workers and requests in flight share it.
+    struct Topology {
+        uint64_t version = 0; // Raised by every NODE ADD/REMOVE
+        std::vector<Node> nodes; // Sorted by id() so every member indexes them the same way
+        HashRing ring;
+    };
+
+    // The nodes a replicated read tries, in order
+    struct ReadOrder {
+        std::shared_ptr<const Topology> topology; // Owns the nodes
+        std::vector<const Node*> nodes;
+    };
+
+    // Request or reply travelling between two workers
+    struct ShardMessage {
+        bool is_reply = false;
+        uint32_t from = 0;
+        uint64_t tag = 0; // Identifies the sender's callback
+        Command cmd;
+        Reply reply;
+    };
+
+    // A GET sent to another node, with the GETs for the same key that
+    // arrived while it was in flight and take its reply
+    struct Flight {
+        std::vector<Callback> waiters;
+    };
+
+    // A node that may be caching one of this shard's keys
+    struct Lease {
+        std::string holder; // host:port
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    static constexpr size_t kOpSlots = static_cast<size_t>(Op::Cas) + 1; // Indexed by opcode
+
+    // A worker's request metrics. Only the worker records them; STATS and the
+    // metrics endpoint add up every worker's when they are read.
+    struct WorkerStats {
+        std::array<LatencyHistogram, kOpSlots> commands; // Client requests, from arrival to reply
+        std::array<LatencyHistogram, kOpSlots> served;   // Peers' calls to this node, from arrival to reply
+        std::array<LatencyHistogram, kOpSlots> hops;     // Calls to peer nodes, from send to reply
+        std::array<std::atomic<uint64_t>, kOpSlots> command_errors{};
+        std::array<std::atomic<uint64_t>, kOpSlots> served_errors{};
+        std::array<std::atomic<uint64_t>, kOpSlots> hop_errors{}; // Unreachable, timed out or failed
+        std::atomic<size_t> connections{0}; // Open client connections
+        std::atomic<uint64_t> near_cache_hits{0}; // GETs answered from the near cache
+        std::atomic<uint64_t> coalesced_gets{0};  // GETs that joined another's call to the owner
+        std::atomic<uint64_t> leases_granted{0};  // Leases given to other nodes' near caches
+        std::atomic<uint64_t> invalidations_sent{0}; // NODE INVALIDATEs sent to lease holders
+    };
+
+    struct Worker {
+        size_t id = 0;
+        Shard shard;
+        WorkerStats stats;
+        int listen_fd = -1;
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::atomic<bool> wake_pending{false};
+        std::unique_ptr<MpscQueue<ShardMessage>> inbox; // Messages from every other worker
+        std::vector<ShardMessage> batch;               // Drained from inbox, reused across iterations
+        Arena scratch; // Parsing scratch for the requests of one processInput call
+        std::vector<std::deque<ShardMessage>> backlog; // backlog[to], waiting for room in a full inbox
+        std::unordered_map<uint64_t, Connection> connections;
+        std::unordered_map<uint64_t, Callback> callbacks;
+        std::vector<uint64_t> dirty; // Connections with replies completed outside serviceClient
+        std::unordered_map<uint64_t, std::unique_ptr<PeerLink>> links;
+        std::unordered_map<std::string, uint64_t> link_ids; // "host:port" -> link id
+        std::vector<uint64_t> dirty_links; // Links with requests queued this iteration
+        std::unique_ptr<WriteAheadLog> wal; // Null when persistence is off
+        NearCache near_cache;
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights; // Remote GETs in flight, by key
+        std::unordered_map<std::string, std::vector<Lease>> leases; // Other nodes caching this shard's keys
+        std::vector<std::pair<Callback, Reply>> unsynced; // Write replies waiting for the next fdatasync
+        std::chrono::steady_clock::time_point next_expiry;
+        std::chrono::steady_clock::time_point next_defrag; // Earliest start of the next compaction pass
+        bool defragging = false;
+        // This worker's copy of the membership, refreshed between loop iterations
+        std::shared_ptr<const Topology> topology;
+        std::shared_ptr<const Topology> previous; // Until the rebalance in progress settles
+        bool overlapped = false;
+        uint64_t topology_epoch = 0;
+        // Pass over the shard sending keys to the nodes that hold them under a new topology
+        bool migrating = false;
+        bool migrate_scanned = false; // Reached the shard's last key
+        bool migrate_failed = false;  // Some batch was not acknowledged; the pass runs again
+        uint64_t migrate_pass = 0;
+        std::string migrate_after;    // The pass continues after this key
+        size_t migrate_inflight = 0;  // Batches waiting for their acknowledgements
+        int64_t migrate_budget = 0;   // Bytes that may be sent before the next refill
+        std::chrono::steady_clock::time_point next_migrate_pass;
+        std::chrono::steady_clock::time_point next_status_poll; // Worker 0 only
+        size_t status_polls = 0;
+        uint64_t next_conn_id = kFirstConnectionId;
+        uint64_t next_tag = 1;
+        std::thread thread;
+    };
+
+    // One sorted input of a scan: a local shard or a peer node, read a page at a time
+    struct ScanSource {
+        const Node* node = nullptr; // Null for a local shard
+        size_t shard = 0;
+        std::deque<std::pair<std::string, std::string>> buffered; // Key, value
+        std::string last;           // Last key received; the next page starts after it
+        uint64_t pin = 0;           // Peer: the version its first page pinned, which later pages read at
+        bool pending = false;       // Page request in flight
+        bool exhausted = false;
+        bool failed = false;        // Gave up on it; its remaining keys are missing
+    };
+
+    // Where a scan's merged output goes
+    struct ScanSink {
+        std::function<void(const std::string& key, const std::string& value)> emit;
+        // True if the output is backed up; resume is then called once it drains.
+        // A sink whose client has gone stays stalled and never resumes.
+        std::function<bool(std::function<void()> resume)> stalled;
+        // incomplete: a source failed, so keys may be missing; with more,
+        // snapshot holds the pins the next page reads at
+        std::function<void(bool more, bool incomplete, const std::string& snapshot)> finish;
+    };
+
+    // A RANGE/PREFIX in progress: a k-way merge over its sources that holds at
+    // most one page per source in memory. Local shards are all read at the
+    // version in cmd.pin, and each peer at a version it pinned.
+    struct ScanStream {
+        Command cmd;
+        bool local_only = false; // A page of a scan a peer coordinates
+        std::string self;        // This node's id in snapshots
+        std::shared_ptr<const Topology> topology, previous; // Own the sources' nodes
+        std::vector<ScanSource> sources;
+        ScanSink sink;
+        size_t emitted = 0;
+        size_t failed = 0;
+        bool pumping = false;
+        bool arrived = false; // A page arrived while pumping
+        bool finished = false;
+    };
+
+    static constexpr size_t kMaxInputBuffer = 1 << 20;
+    static constexpr size_t kMaxOutputBuffer = 4 << 20;
+    static constexpr size_t kMaxPipelined = 1024;
+    static constexpr size_t kInboxCapacity = 4096;
+    static constexpr uint64_t kListenerId = 0;
+    static constexpr uint64_t kWakeId = 1;
+    static constexpr uint64_t kFirstConnectionId = 16;
+    static constexpr std::chrono::milliseconds kRpcTimeout{5000};
+    static constexpr std::chrono::milliseconds kPeerRetryDelay{100};
+    static constexpr uint32_t kScanPage = 256;      // Keys per page requested from each scan source
+    static constexpr size_t kScanChunk = 16 << 10;  // Streamed scan output is flushed in chunks this size
+    static constexpr size_t kWarmUpBlocks = 16; // Snapshot blocks loaded per loop iteration while warming
+    static constexpr size_t kDefragSlots = 4096; // Store slots compacted per loop iteration
+    static constexpr size_t kExpirySlots = 1024; // Store slots checked per active expiry step
+    static constexpr size_t kMigrateBatchBytes = 256 << 10; // Keys and values per migration batch
+    static constexpr size_t kMigrateScanKeys = 4096; // Keys looked at per migration step
+    static constexpr size_t kMigrateWindow = 2;      // Migration batches in flight per worker
+    static constexpr std::chrono::seconds kMigrateRetryDelay{1};
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    Config config;
+    std::string ip;
+    int port;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> next_seq{1}; // Numbers writes across workers: key versions and log records
+    VersionPins pins; // Versions snapshot scans on this node read at
+    std::thread log_syncer; // fdatasyncs the logs under FsyncPolicy::Interval
+    std::mutex log_mutex;   // Held by log_syncer while it uses the logs, and while they rotate
+    std::atomic<uint64_t> log_bytes{0}; // Logged since the last snapshot
+    int metrics_fd = -1;        // METRICS_PORT listener
+    std::thread metrics_server; // Answers it
+    std::atomic<size_t> warming{0};     // Workers still loading the startup snapshot
+    std::chrono::steady_clock::time_point started_at;
+    // Snapshot barrier: worker 0 sets pause_requested and the others park until it clears
+    std::atomic<bool> pause_requested{false};
+    std::atomic<size_t> paused{0};
+    pid_t snapshot_pid = -1; // Child writing a snapshot; worker 0 only
+    uint64_t snapshot_seq = 0;
+    bool snapshot_rotated = false; // The workers moved to new logs when it started
+    std::chrono::steady_clock::time_point snapshot_started;
+    // Cluster membership. NODE ADD/REMOVE publish a new topology here and
+    // bump topology_epoch; each worker takes its own copy of the pointers.
+    std::mutex topology_mutex;
+    std::shared_ptr<const Topology> topology;
+    std::shared_ptr<const Topology> previous; // Where keys were before the rebalance in progress
+    bool overlapped = false;       // Another change arrived before the last one settled
+    std::vector<Node> waiting_for; // Members that may still be sending keys for this change
+    size_t sending = 0;            // Local workers still sending keys for this change
+    std::atomic<uint64_t> topology_epoch{0};
+
+    uint32_t hashKey(std::string_view key) const {
+        return ringHash(config.ring_hash, key);
+    }
+
+    const Node* findNodeForHash(const Worker& w, uint32_t keyHash) const {
+        if (w.topology->ring.empty()) return nullptr;
+        return &w.topology->nodes[w.topology->ring.ownerOf(keyHash)];
+    }
+
+    bool isSelf(const Node& node) const {
+        return node.self;
+    }
+
+    // True if host:port reaches this process: our port on one of this machine's addresses
+    bool isLocalEndpoint(const std::string& host, int node_port) const {
+        if (node_port != port) return false;
+        if (host == ip || host == "0.0.0.0" || host == "localhost" || host.rfind("127.", 0) == 0) return true;
+        char hostname[256] = {0};
+        if (gethostname(hostname, sizeof(hostname) - 1) == 0 && host == hostname) return true;
+
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        addrinfo* resolved = nullptr;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &resolved) != 0) return false;
+        ifaddrs* interfaces = nullptr;
+        bool local = false;
+        if (getifaddrs(&interfaces) == 0) {
+            for (addrinfo* a = resolved; a && !local; a = a->ai_next) {
+                auto addr = reinterpret_cast<sockaddr_in*>(a->ai_addr)->sin_addr.s_addr;
+                for (ifaddrs* ifa = interfaces; ifa; ifa = ifa->ifa_next) {
+                    if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+                        reinterpret_cast<sockaddr_in*>(ifa->ifa_addr)->sin_addr.s_addr == addr) {
+                        local = true;
+                        break;
+                    }
+                }
+            }
+            freeifaddrs(interfaces);
+        }
+        freeaddrinfo(resolved);
+        return local;
+    }
+
+    // Spreads the hash range a node owns evenly over its shards
+    size_t shardForHash(uint32_t keyHash) const {
+        uint32_t mixed = keyHash * 0x9E3779B1u;
+        return (static_cast<uint64_t>(mixed) * workers.size()) >> 32;
+    }
+
+    PeerLink& getLink(Worker& w, const Node& node) {
+        std::string key = node.ip + ":" + std::to_string(node.port);
+        auto it = w.link_ids.find(key);
+        if (it != w.link_ids.end()) return *w.links[it->second];
+        uint64_t link_id = w.next_conn_id++;
+        auto link = std::make_unique<PeerLink>();
+        link->host = node.ip;
+        link->port = node.port;
+        PeerLink& ref = *link;
+        w.links.emplace(link_id, std::move(link));
+        w.link_ids.emplace(key, link_id);
+        ref.id = link_id;
+        return ref;
+    }
+
+    // Starts a non-blocking connect
+    bool openLink(Worker& w, PeerLink& link) {
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        int rc = getaddrinfo(link.host.c_str(), std::to_string(link.port).c_str(), &hints, &result);
+        if (rc != 0 || !result) {
+            LOG_WARN("Failed to resolve peer", "host", link.host, "error", gai_strerror(rc));
+            return false;
+        }
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock == -1) {
+            freeaddrinfo(result);
+            LOG_ERROR("Failed to create socket", "error", strerror(errno));
+            return false;
+        }
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        rc = connect(sock, result->ai_addr, result->ai_addrlen);
+        freeaddrinfo(result);
+        if (rc == -1 && errno != EINPROGRESS) {
+            LOG_WARN("Failed to connect to peer", "host", link.host, "port", link.port, "error", strerror(errno));
+            close(sock);
+            return false;
+        }
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = link.id;
+        if (epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+            LOG_ERROR("Failed to register peer link", "error", strerror(errno));
+            close(sock);
+            return false;
+        }
+        link.fd = sock;
+        link.connecting = true;
+        link.in.clear();
+        link.out.clear();
+        link.out_offset = 0;
+        return true;
+    }
+
+    // Drops the connection and fails every call still waiting on it
+    void failLink(Worker& w, PeerLink& link, const char* reason) {
+        if (link.fd != -1) {
+            LOG_WARN("Lost peer link", "host", link.host, "port", link.port, "reason", reason);
+            epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, link.fd, nullptr);
+            close(link.fd);
+        }
+        link.fd = -1;
+        link.connecting = false;
+        link.in.clear();
+        link.out.clear();
+        link.out_offset = 0;
+        link.retry_after = std::chrono::steady_clock::now() + kPeerRetryDelay;
+        auto inflight = std::move(link.inflight);
+        link.inflight.clear();
+        for (auto& [_, call] : inflight) {
+            recordHop(w, call, false);
+            call.done(false, Reply());
+        }
+    }
+
+    bool flushLink(PeerLink& link) {
+        while (link.out_offset < link.out.size()) {
+            ssize_t sent = write(link.fd, link.out.data() + link.out_offset, link.out.size() - link.out_offset);
+            if (sent > 0) {
+                link.out_offset += sent;
+                continue;
+            }
+            if (sent == -1 && errno == EINTR) continue;
+            if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            return false;
+        }
+        link.out.clear();
+        link.out_offset = 0;
+        return true;
+    }
+
+    void serviceLink(Worker& w, PeerLink& link, uint32_t events) {
+        if (link.fd == -1) return;
+        if (link.connecting) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(link.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) {
+                failLink(w, link, strerror(err));
+                return;
+            }
+            if (!(events & (EPOLLOUT | EPOLLIN))) return;
+            link.connecting = false;
+        }
+        if (!flushLink(link)) {
+            failLink(w, link, strerror(errno));
+            return;
+        }
+
+        char buffer[65536];
+        bool closed = false;
+        while (true) {
+            ssize_t bytes = read(link.fd, buffer, sizeof(buffer));
+            if (bytes > 0) {
+                link.in.append(buffer, bytes);
+                continue;
+            }
+            if (bytes == 0) closed = true;
+            else if (errno == EINTR) continue;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) closed = true;
+            break;
+        }
+
+        // Collect completions first: callbacks may issue new calls on this link
+        std::vector<std::pair<RpcCallback, Reply>> completed;
+        std::string_view pending(link.in);
+        while (true) {
+            uint32_t id;
+            Reply reply;
+            size_t consumed;
+            ParseStatus status = parseBinaryReply(pending, id, reply, consumed);
+            if (status == ParseStatus::Incomplete) break;
+            if (status != ParseStatus::Ok) {
+                closed = true;
+                break;
+            }
+            pending.remove_prefix(consumed);
+            auto it = link.inflight.find(id);
+            if (it == link.inflight.end()) continue; // Already timed out
+            recordHop(w, it->second, reply.status != Status::Error);
+            completed.emplace_back(std::move(it->second.done), std::move(reply));
+            link.inflight.erase(it);
+        }
+        link.in.erase(0, link.in.size() - pending.size());
+
+        if (closed || (events & EPOLLERR)) failLink(w, link, "connection closed");
+        for (auto& [done, reply] : completed) done(true, std::move(reply));
+    }
+
+    // Sends cmd to node over this worker's persistent link, calling done with
+    // the reply or with ok == false if the peer is unreachable
+    void callNode(Worker& w, const Node& node, const Command& cmd, RpcCallback&& done,
+                  std::chrono::milliseconds timeout = kRpcTimeout) {
+        PeerLink& link = getLink(w, node);
+        if (link.fd == -1) {
+            if (std::chrono::steady_clock::now() < link.retry_after || !openLink(w, link)) {
+                link.retry_after = std::chrono::steady_clock::now() + kPeerRetryDelay;
+                w.stats.hop_errors[static_cast<size_t>(cmd.op)].fetch_add(1, std::memory_order_relaxed);
+                done(false, Reply());
+                return;
+            }
+        }
+        uint32_t id = link.next_id++;
+        if (id == 0) id = link.next_id++;
+        if (link.out.size() == link.out_offset) w.dirty_links.push_back(link.id);
+        appendBinaryRequest(link.out, id, kFlagLocal, cmd);
+        auto now = std::chrono::steady_clock::now();
+        link.inflight.emplace(id, RpcCall{std::move(done), now + timeout, now, cmd.op});
+    }
+
+    // Writes the requests queued on each link this iteration in as few syscalls as possible
+    void flushDirtyLinks(Worker& w) {
+        std::vector<uint64_t> dirty;
+        dirty.swap(w.dirty_links);
+        for (uint64_t link_id : dirty) {
+            auto it = w.links.find(link_id);
+            if (it == w.links.end()) continue;
+            PeerLink& link = *it->second;
+            if (link.fd == -1 || link.connecting) continue;
+            if (!flushLink(link)) failLink(w, link, strerror(errno));
+        }
+    }
+
+    // Fails calls that are past their deadline
+    void expireCalls(Worker& w) {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<RpcCallback> expired;
+        for (auto& [_, link] : w.links) {
+            for (auto it = link->inflight.begin(); it != link->inflight.end();) {
+                if (it->second.deadline <= now) {
+                    recordHop(w, it->second, false);
+                    expired.push_back(std::move(it->second.done));
+                    it = link->inflight.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (auto& done : expired) done(false, Reply());
+    }
+
+    // Forwards a key operation to the node that owns the key
+    void forwardToNode(Worker& w, const Node& node, const Command& cmd, Callback&& done) {
+        callNode(w, node, cmd, [done = std::move(done)](bool ok, Reply&& reply) {
+            if (!ok) reply.status = Status::Error;
+            done(std::move(reply));
+        });
+    }
+
+    void wakeWorker(Worker& target) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!target.wake_pending.exchange(true)) {
+            uint64_t one = 1;
+            if (write(target.wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                LOG_ERROR("Failed to wake worker", "worker", target.id, "error", strerror(errno));
+            }
+        }
+    }
+
+    void sendToWorker(Worker& w, size_t to, ShardMessage&& msg) {
+        msg.from = static_cast<uint32_t>(w.id);
+        Worker& target = *workers[to];
+        if (!w.backlog[to].empty() || !target.inbox->enqueue(std::move(msg))) {
+            w.backlog[to].push_back(std::move(msg)); // Keeps this sender's ordering
+            return;
+        }
+        wakeWorker(target);
+    }
+
+    // Retries messages that found their target's inbox full
+    void flushBacklog(Worker& w) {
+        for (size_t to = 0; to < w.backlog.size(); ++to) {
+            auto& queue = w.backlog[to];
+            if (queue.empty()) continue;
+            Worker& target = *workers[to];
+            while (!queue.empty() && target.inbox->enqueue(std::move(queue.front()))) {
+                queue.pop_front();
+            }
+            wakeWorker(target);
+        }
+    }
+
+    static bool isWrite(Op op) {
+        return op == Op::Put || op == Op::Remove || op == Op::MPut || op == Op::MDel || op == Op::Cas;
+    }
+
+    // Copies kept of each key, capped at the cluster size
+    size_t replicationFactor(const Topology& t) const {
+        return std::min(std::max<size_t>(config.replicas, 1), t.nodes.size());
+    }
+
+    size_t requiredCopies(const Topology& t) const {
+        switch (config.write_ack) {
+            case WriteAck::One:
+                return 1;
+            case WriteAck::Quorum:
+                return replicationFactor(t) / 2 + 1;
+            case WriteAck::All:
+                return replicationFactor(t);
+        }
+        return 1;
+    }
+
+    // The nodes holding copies of a key, its primary first
+    void holdersOf(const Topology& t, uint32_t keyHash, std::vector<const Node*>& out) const {
+        std::vector<uint32_t> owners;
+        t.ring.ownersOf(keyHash, replicationFactor(t), owners);
+        out.clear();
+        for (uint32_t owner : owners) out.push_back(&t.nodes[owner]);
+    }
+
+    bool holdsCopy(const Topology& t, uint32_t keyHash) const {
+        std::vector<const Node*> holders;
+        holdersOf(t, keyHash, holders);
+        return std::any_of(holders.begin(), holders.end(), [&](const Node* node) { return isSelf(*node); });
+    }
+
+    // Whether a request a peer routed here is served here. While membership
+    // is changing the peer may still be on the old ring; what it sent to a
+    // node that no longer holds the key is passed on, once, to the primary.
+    bool servesHere(const Worker& w, const Command& cmd, uint32_t keyHash) const {
+        if (!w.previous || cmd.rerouted || cmd.replica) return true;
+        if (cmd.op == Op::Get || cmd.op == Op::MGet) return holdsCopy(*w.topology, keyHash);
+        const Node* primary = findNodeForHash(w, keyHash);
+        return !primary || isSelf(*primary);
+    }
+
+    // Replies once every key has enough copies, or fails the write once
+    // every copy has answered and some key is still short
+    static void settleWrite(WriteAcks& acks) {
+        if (acks.replied || !acks.local) return;
+        bool enough = std::all_of(acks.copies.begin(), acks.copies.end(),
+                                  [&](uint8_t copies) { return copies >= acks.needed; });
+        if (enough || acks.pending == 0) {
+            acks.replied = true;
+            acks.done(enough ? std::move(acks.reply) : errorReply("ERROR: too few replicas acknowledged the write"));
+        }
+    }
+
+    // Streams a write this shard just applied as its primary to the other
+    // nodes holding copies of its keys. It runs on the shard's worker, so each
+    // replica receives the shard's writes in the order they were applied.
+    // Returns the callback for the primary's own copy; done runs once enough
+    // copies are applied for config.write_ack.
+    Callback replicate(Worker& w, const Command& cmd, Callback&& done) {
+        auto acks = std::make_shared<WriteAcks>();
+        acks->done = std::move(done);
+        acks->needed = requiredCopies(*w.topology);
+        bool batch = isBatch(cmd.op);
+        size_t keys = batch ? cmd.items.size() : 1;
+        acks->copies.assign(keys, 0);
+
+        // One command per replica, holding the keys it has copies of
+        std::vector<std::pair<const Node*, Command>> sends;
+        std::vector<std::vector<size_t>> covered;
+        std::vector<const Node*> holders;
+        std::vector<uint32_t> hashes;
+        ringHashes(config.ring_hash, keys, [&](size_t i) -> std::string_view {
+            return batch ? cmd.items[i].first : cmd.key;
+        }, hashes);
+        for (size_t i = 0; i < keys; ++i) {
+            holdersOf(*w.topology, hashes[i], holders);
+            for (const Node* node : holders) {
+                if (isSelf(*node)) continue;
+                size_t s = 0;
+                while (s < sends.size() && sends[s].first != node) ++s;
+                if (s == sends.size()) {
+                    Command copy;
+                    if (batch) {
+                        copy.op = cmd.op;
+                    } else {
+                        copy = cmd;
+                    }
+                    // A CAS the primary applied is a plain write for its replicas,
+                    // whose versions are their own
+                    if (copy.op == Op::Cas) copy.op = Op::Put;
+                    copy.replica = true;
+                    sends.emplace_back(node, std::move(copy));
+                    covered.emplace_back();
+                }
+                if (batch) sends[s].second.items.push_back(cmd.items[i]);
+                covered[s].push_back(i);
+            }
+        }
+
+        acks->pending = sends.size() + 1;
+        for (size_t s = 0; s < sends.size(); ++s) {
+            callNode(w, *sends[s].first, sends[s].second,
+                     [acks, positions = std::move(covered[s])](bool ok, Reply&& reply) {
+                --acks->pending;
+                if (ok && reply.status != Status::Error) {
+                    for (size_t i : positions) ++acks->copies[i];
+                }
+                settleWrite(*acks);
+            });
+        }
+        return [acks](Reply&& reply) {
+            --acks->pending;
+            acks->local = true;
+            if (reply.status == Status::Error) {
+                // The primary could not log it; the client hears that whatever the replicas did
+                acks->replied = true;
+                acks->done(std::move(reply));
+                return;
+            }
+            for (auto& copies : acks->copies) ++copies;
+            acks->reply = std::move(reply);
+            settleWrite(*acks);
+        };
+    }
+
+    // Fewer for a better node to read from: this one, then the peer this
+    // worker has the fewest requests in flight to
+    size_t readCost(Worker& w, const Node& node) {
+        return isSelf(node) ? 0 : 1 + getLink(w, node).inflight.size();
+    }
+
+    // Serves a GET from a node holding a copy of the key, trying the next
+    // one whenever a node cannot be reached
+    void readReplicated(Worker& w, Command&& cmd, uint32_t keyHash, Callback&& done) {
+        auto order = std::make_shared<ReadOrder>();
+        order->topology = w.topology;
+        holdersOf(*w.topology, keyHash, order->nodes);
+        if (config.read_from == ReadFrom::Replica) {
+            std::stable_sort(order->nodes.begin(), order->nodes.end(), [&](const Node* a, const Node* b) {
+                return readCost(w, *a) < readCost(w, *b);
+            });
+        }
+        readFrom(w, std::move(order), 0, std::move(cmd), std::move(done));
+    }
+
+    void readFrom(Worker& w, std::shared_ptr<ReadOrder> order, size_t next, Command&& cmd, Callback&& done) {
+        const Node& node = *order->nodes[next];
+        if (isSelf(node)) {
+            cmd.lease = false; // Writes here would not be reported back to this node
+            callShard(w, shardForHash(hashKey(cmd.key)), std::move(cmd), std::move(done));
+            return;
+        }
+        callNode(w, node, cmd, [this, &w, order, next, cmd, done = std::move(done)](bool ok, Reply&& reply) mutable {
+            if (!ok && next + 1 < order->nodes.size()) {
+                readFrom(w, std::move(order), next + 1, std::move(cmd), std::move(done));
+                return;
+            }
+            if (!ok) reply.status = Status::Error;
+            done(std::move(reply));
+        });
+    }
+
+    // Whether a GET this node coordinates is answered by another node
+    bool readsRemotely(const Worker& w, uint32_t keyHash) const {
+        const Node* primary = findNodeForHash(w, keyHash);
+        if (!primary || isSelf(*primary)) return false;
+        return !(config.read_from == ReadFrom::Replica && replicationFactor(*w.topology) > 1 &&
+                 holdsCopy(*w.topology, keyHash));
+    }
+
+    // A GET for a key held elsewhere: answered from the near cache if it can
+    // be, else it joins a GET for the key already in flight from this worker,
+    // else it is sent. A key the near cache has missed before asks its owner
+    // for a lease, and the value is cached if the owner grants one and
+    // nothing was invalidated while the GET was in flight.
+    void readRemote(Worker& w, Command&& cmd, uint32_t keyHash, Callback&& done) {
+        auto now = std::chrono::steady_clock::now();
+        Reply cached;
+        if (w.near_cache.enabled() && w.near_cache.get(cmd.key, now, &cached.value)) {
+            w.stats.near_cache_hits.fetch_add(1, std::memory_order_relaxed);
+            done(std::move(cached));
+            return;
+        }
+        auto [it, inserted] = w.flights.try_emplace(cmd.key);
+        if (!inserted) {
+            w.stats.coalesced_gets.fetch_add(1, std::memory_order_relaxed);
+            it->second->waiters.push_back(std::move(done));
+            return;
+        }
+        auto flight = std::make_shared<Flight>();
+        flight->waiters.push_back(std::move(done));
+        it->second = flight;
+        if (w.near_cache.enabled() && w.near_cache.admit(cmd.key)) {
+            for (const Node& node : w.topology->nodes) {
+                if (!isSelf(node)) continue;
+                cmd.lease = true;
+                cmd.value = std::to_string(config.near_cache_lease.count()) + " " + node.id();
+                break;
+            }
+        }
+        uint64_t generation = w.near_cache.generation();
+        auto finish = [&w, this, flight, key = cmd.key, lease = cmd.lease, generation, now](Reply&& reply) {
+            auto it = w.flights.find(key);
+            if (it != w.flights.end() && it->second == flight) w.flights.erase(it);
+            if (lease && reply.leased && reply.status == Status::Ok && w.near_cache.generation() == generation) {
+                w.near_cache.put(key, reply.value, now + config.near_cache_lease);
+            }
+            reply.leased = false;
+            std::vector<Callback> waiters;
+            waiters.swap(flight->waiters);
+            for (size_t i = 0; i + 1 < waiters.size(); ++i) waiters[i](Reply(reply));
+            waiters.back()(std::move(reply));
+        };
+        if (replicationFactor(*w.topology) > 1) {
+            readReplicated(w, std::move(cmd), keyHash, std::move(finish));
+        } else {
+            forwardToNode(w, *findNodeForHash(w, keyHash), cmd, std::move(finish));
+        }
+    }
+
+    // A write coordinated here: later GETs on this worker must not see what
+    // was read before it
+    void forgetReads(Worker& w, const std::string& key) {
+        w.near_cache.invalidate(key);
+        w.flights.erase(key);
+    }
+
+    // Records that the node named in a GET's lease request may cache the key
+    void grantLease(Worker& w, const Command& cmd, Reply& reply) {
+        size_t space = cmd.value.find(' ');
+        uint32_t ms = 0;
+        if (space == std::string::npos ||
+            std::from_chars(cmd.value.data(), cmd.value.data() + space, ms).ec != std::errc() || ms == 0) {
+            return;
+        }
+        std::string holder = cmd.value.substr(space + 1);
+        auto expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+        std::vector<Lease>& held = w.leases[cmd.key];
+        auto lease = std::find_if(held.begin(), held.end(), [&](const Lease& l) { return l.holder == holder; });
+        if (lease != held.end()) {
+            lease->expires = std::max(lease->expires, expires);
+        } else {
+            held.push_back({std::move(holder), expires});
+        }
+        reply.leased = true;
+        w.stats.leases_granted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Tells the nodes holding a lease on key that it changed. Nothing waits
+    // for them; a holder that does not hear stops serving it when the lease ends.
+    void revokeLeases(Worker& w, const std::string& key) {
+        auto it = w.leases.find(key);
+        if (it == w.leases.end()) return;
+        auto now = std::chrono::steady_clock::now();
+        for (const Lease& lease : it->second) {
+            if (lease.expires <= now) continue;
+            for (const Node& node : w.topology->nodes) {
+                if (isSelf(node) || node.id() != lease.holder) continue;
+                Command invalidate;
+                invalidate.op = Op::Node;
+                invalidate.key = "INVALIDATE";
+                invalidate.value = key;
+                callNode(w, node, invalidate, [](bool, Reply&&) {});
+                w.stats.invalidations_sent.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+        }
+        w.leases.erase(it);
+    }
+
+    // Drops the leases that have run out
+    static void expireLeases(Worker& w, std::chrono::steady_clock::time_point now) {
+        for (auto it = w.leases.begin(); it != w.leases.end();) {
+            auto& held = it->second;
+            held.erase(std::remove_if(held.begin(), held.end(), [&](const Lease& l) { return l.expires <= now; }),
+                       held.end());
+            it = held.empty() ? w.leases.erase(it) : std::next(it);
+        }
+    }
+
+    // Runs cmd on this worker's shard. Writes join the current log batch; under
+    // FsyncPolicy::Always their replies wait in unsynced until commitLog.
+    void executeLocal(Worker& w, const Command& cmd, Callback&& done) {
+        if (cmd.op == Op::Node) { // NODE INVALIDATE passed on by the worker that received it
+            w.near_cache.invalidate(cmd.value);
+            done(Reply());
+            return;
+        }
+        Reply reply = w.shard.execute(cmd);
+        // Keys evicted to make room are logged as REMOVEs ahead of the write,
+        // even when it failed anyway
+        bool evicted = !w.shard.evictedKeys().empty();
+        if (w.wal && evicted) {
+            for (const auto& [key, version] : w.shard.evictedKeys()) w.wal->append(version, Op::Remove, key, std::string());
+        }
+        if (evicted && !w.leases.empty()) {
+            for (const auto& evictee : w.shard.evictedKeys()) revokeLeases(w, evictee.first);
+        }
+        if (evicted) w.shard.clearEvicted();
+        if (cmd.lease && reply.status == Status::Ok) grantLease(w, cmd, reply);
+        if (isWrite(cmd.op) && reply.status == Status::Ok && !w.leases.empty()) {
+            if (isBatch(cmd.op)) {
+                for (const auto& item : cmd.items) revokeLeases(w, item.first);
+            } else {
+                revokeLeases(w, cmd.key);
+            }
+        }
+        if (cmd.op == Op::Get && reply.status == Status::NotFound && !cmd.rerouted && w.previous &&
+            w.shard.mayBeImporting(cmd.key)) {
+            readImporting(w, cmd, std::move(done));
+            return;
+        }
+        if (isWrite(cmd.op) && reply.status == Status::Ok && !cmd.replica && replicationFactor(*w.topology) > 1) {
+            done = replicate(w, cmd, std::move(done));
+        }
+        // Records are numbered with the versions the shard gave the writes
+        if (w.wal && isWrite(cmd.op) && reply.status == Status::Ok) {
+            bool logged = !isBatch(cmd.op);
+            if (logged) {
+                w.wal->append(reply.version, cmd.op == Op::Cas ? Op::Put : cmd.op, cmd.key, cmd.value,
+                              cmd.op == Op::Remove ? 0 : cmd.expires);
+            }
+            // A batch is logged as the PUTs and REMOVEs it performed
+            for (size_t i = 0; isBatch(cmd.op) && i < cmd.items.size(); ++i) {
+                if ((cmd.op == Op::MDel || cmd.migrate) && !reply.found[i]) continue;
+                const auto& [key, value] = cmd.items[i];
+                uint64_t seq = reply.version + i;
+                if (cmd.op == Op::MPut && cmd.migrate) {
+                    w.wal->append(seq, Op::Put, key, value.substr(4), loadBE32(value.data()));
+                } else {
+                    w.wal->append(seq, cmd.op == Op::MPut ? Op::Put : Op::Remove, key, value);
+                }
+                logged = true;
+            }
+            if ((logged || evicted) && config.fsync == FsyncPolicy::Always) {
+                w.unsynced.emplace_back(std::move(done), std::move(reply));
+                return;
+            }
+        }
+        done(std::move(reply));
+    }
+
+    // A GET for a key this node has become a holder of, before the key's
+    // previous holder has sent it over: asks that holder, then looks here
+    // again in case the key arrived in the meantime
+    void readImporting(Worker& w, const Command& cmd, Callback&& done) {
+        std::vector<const Node*> holders;
+        holdersOf(*w.previous, hashKey(cmd.key), holders);
+        if (holders.empty() || std::any_of(holders.begin(), holders.end(), [&](const Node* n) { return isSelf(*n); })) {
+            done(w.shard.execute(cmd));
+            return;
+        }
+        Command get = cmd;
+        get.rerouted = true;
+        callNode(w, *holders.front(), get, [&w, cmd, done = std::move(done)](bool ok, Reply&& reply) {
+            done(ok && reply.status == Status::Ok ? std::move(reply) : w.shard.execute(cmd));
+        });
+    }
+
+    // Group commit: one write, and under FsyncPolicy::Always one fdatasync, for
+    // every write logged this iteration, then the replies that waited on it
+    void commitLog(Worker& w) {
+        if (!w.wal || w.wal->pendingBytes() == 0) return;
+        log_bytes.fetch_add(w.wal->pendingBytes(), std::memory_order_relaxed);
+        bool ok = w.wal->commit(config.fsync == FsyncPolicy::Always);
+        std::vector<std::pair<Callback, Reply>> waiting;
+        waiting.swap(w.unsynced);
+        for (auto& [done, reply] : waiting) {
+            done(ok ? std::move(reply) : errorReply("ERROR: write-ahead log failed"));
+        }
+    }
+
+    // Runs cmd on the given shard, calling done on this worker once it completes
+    void callShard(Worker& w, size_t shard, Command&& cmd, Callback&& done) {
+        if (shard == w.id) {
+            executeLocal(w, cmd, std::move(done));
+            return;
+        }
+        uint64_t tag = w.next_tag++;
+        w.callbacks.emplace(tag, std::move(done));
+        ShardMessage msg;
+        msg.tag = tag;
+        msg.cmd = std::move(cmd);
+        sendToWorker(w, shard, std::move(msg));
+    }
+
+    // Takes everything the other workers have published in one batch and
+    // applies it in order; the writes all join this iteration's log commit
+    void drainInbox(Worker& w) {
+        if (!w.inbox) return;
+        w.batch.clear();
+        w.inbox->dequeueBatch(w.batch, kInboxCapacity);
+        for (ShardMessage& msg : w.batch) {
+            if (msg.is_reply) {
+                auto it = w.callbacks.find(msg.tag);
+                if (it == w.callbacks.end()) continue;
+                Callback done = std::move(it->second);
+                w.callbacks.erase(it);
+                done(std::move(msg.reply));
+            } else {
+                size_t from = msg.from;
+                uint64_t tag = msg.tag;
+                executeLocal(w, msg.cmd, [this, &w, from, tag](Reply&& result) {
+                    ShardMessage reply;
+                    reply.is_reply = true;
+                    reply.tag = tag;
+                    reply.reply = std::move(result);
+                    sendToWorker(w, from, std::move(reply));
+                });
+            }
+        }
+    }
+
+    // Requests the next page from one source of a scan
+    void fetchPage(Worker& w, const std::shared_ptr<ScanStream>& scan, size_t index) {
+        ScanSource& src = scan->sources[index];
+        src.pending = true;
+        Command page;
+        page.op = scan->cmd.op;
+        page.key = scan->cmd.key;
+        page.end = scan->cmd.end;
+        page.values = scan->cmd.values;
+        page.after = src.last.empty() ? scan->cmd.after : src.last;
+        page.pin = src.node ? src.pin : scan->cmd.pin;
+        // A client's next page may read this peer again after it ran out
+        page.hold_pin = src.node && scan->cmd.resumable;
+        page.limit = kScanPage;
+        if (scan->cmd.limit) page.limit = std::min<size_t>(kScanPage, scan->cmd.limit - scan->emitted - src.buffered.size());
+
+        auto arrived = [this, &w, scan, index](Reply&& reply) {
+            ScanSource& src = scan->sources[index];
+            src.pending = false;
+            src.exhausted = reply.status != Status::Ok || !reply.more;
+            if (reply.status != Status::Ok) {
+                src.failed = true;
+                ++scan->failed;
+                LOG_WARN("Scan is missing keys", "node", src.node ? src.node->id() : std::string("local"),
+                         "shard", src.shard, "error", reply.value);
+            }
+            if (reply.pin) src.pin = reply.pin;
+            for (size_t i = 0; i < reply.keys.size(); ++i) {
+                src.buffered.emplace_back(std::move(reply.keys[i]),
+                                          i < reply.values.size() ? std::move(reply.values[i]) : std::string());
+            }
+            if (!src.buffered.empty()) src.last = src.buffered.back().first;
+            scan->arrived = true;
+            pumpScan(w, scan);
+        };
+        if (src.node) {
+            callNode(w, *src.node, page, [arrived](bool ok, Reply&& reply) {
+                if (!ok) reply.status = Status::Error;
+                arrived(std::move(reply));
+            }, config.scan_timeout);
+        } else if (!pins.renew(page.pin, std::chrono::steady_clock::now())) {
+            // Its output stalled for longer than a pin's lease
+            arrived(errorReply("ERROR: scan snapshot expired"));
+        } else {
+            callShard(w, src.shard, std::move(page), arrived);
+        }
+    }
+
+    // Tells each peer that held its pin for a paged scan that the scan is over.
+    // Nothing waits for them; a peer that does not hear lets the pin lapse.
+    void releasePins(Worker& w, const ScanStream& scan) {
+        for (const auto& src : scan.sources) {
+            if (!src.node || !src.pin || src.failed) continue;
+            Command unpin;
+            unpin.op = Op::Node;
+            unpin.key = "UNPIN";
+            unpin.value = std::to_string(src.pin);
+            callNode(w, *src.node, unpin, [](bool, Reply&&) {});
+        }
+    }
+
+    // Emits keys in order for as long as every open source has one buffered,
+    // fetching the next page of any source that runs dry
+    void pumpScan(Worker& w, const std::shared_ptr<ScanStream>& scan) {
+        if (scan->pumping) return; // A local page arrived synchronously; the outer call continues
+        scan->pumping = true;
+        while (!scan->finished) {
+            bool at_limit = scan->cmd.limit && scan->emitted == scan->cmd.limit;
+            ScanSource* next = nullptr;
+            bool waiting = false;
+            bool more = false;
+            scan->arrived = false;
+            for (size_t i = 0; i < scan->sources.size(); ++i) {
+                ScanSource& src = scan->sources[i];
+                more |= !src.buffered.empty() || !src.exhausted;
+                if (at_limit) continue;
+                if (src.buffered.empty()) {
+                    if (src.exhausted) continue;
+                    if (!src.pending) fetchPage(w, scan, i);
+                    waiting = true;
+                    continue;
+                }
+                // Ask a peer for its next page while the last one is merged
+                if (src.node && !src.pending && !src.exhausted && src.buffered.size() < kScanPage / 2 &&
+                    (!scan->cmd.limit || scan->cmd.limit - scan->emitted > src.buffered.size())) {
+                    fetchPage(w, scan, i);
+                }
+                if (!next || src.buffered.front().first < next->buffered.front().first) next = &src;
+            }
+            if (at_limit || (!waiting && !next)) {
+                scan->finished = true;
+                // A page with more keeps its pin for the next one, which renews it
+                bool keep = (at_limit && more && (scan->local_only || scan->cmd.resumable)) || scan->cmd.hold_pin;
+                if (!keep) pins.unpin(scan->cmd.pin);
+                if (!keep && scan->cmd.resumable) releasePins(w, *scan);
+                std::string snapshot;
+                if (at_limit && more && scan->cmd.resumable) {
+                    if (!scan->self.empty()) appendPin(snapshot, scan->self, scan->cmd.pin);
+                    for (const auto& src : scan->sources) {
+                        if (src.node && src.pin) appendPin(snapshot, src.node->id(), src.pin);
+                    }
+                }
+                // Every key has a copy on some node that answered unless as
+                // many nodes failed as there are copies
+                scan->sink.finish(at_limit && more, scan->failed >= replicationFactor(*scan->topology), snapshot);
+                break;
+            }
+            if (waiting) {
+                if (scan->arrived) continue;
+                break;
+            }
+            if (scan->sink.stalled([this, &w, scan] { pumpScan(w, scan); })) break;
+            scan->sink.emit(next->buffered.front().first, next->buffered.front().second);
+            // Replicated keys arrive from every node holding a copy; emit them once
+            for (auto& src : scan->sources) {
+                if (&src != next && !src.buffered.empty() && src.buffered.front().first == next->buffered.front().first) {
+                    src.buffered.pop_front();
+                }
+            }
+            next->buffered.pop_front();
+            ++scan->emitted;
+        }
+        scan->pumping = false;
+    }
+
+    // Merges a RANGE/PREFIX from every local shard, and from every other node
+    // too unless the request itself came from a peer. During a rebalance the
+    // nodes that are leaving are read as well, as they may still hold keys.
+    // A page resuming a paged scan reads every node at its pin in cmd.snapshot.
+    void startScan(Worker& w, Command&& cmd, bool local_only, ScanSink&& sink) {
+        auto scan = std::make_shared<ScanStream>();
+        scan->cmd = std::move(cmd);
+        scan->local_only = local_only;
+        scan->sink = std::move(sink);
+        scan->topology = w.topology;
+        scan->previous = w.previous;
+        for (const Topology* t : {scan->topology.get(), scan->previous.get()}) {
+            if (!t || !scan->self.empty()) continue;
+            for (const auto& node : t->nodes) {
+                if (isSelf(node)) scan->self = node.id();
+            }
+        }
+        auto pinOf = [&scan](const std::string& node) {
+            uint64_t pin = 0;
+            forEachPin(scan->cmd.snapshot, [&](std::string_view id, uint64_t version) {
+                if (id == node) pin = version;
+            });
+            return pin;
+        };
+        if (!scan->cmd.pin && !scan->self.empty()) scan->cmd.pin = pinOf(scan->self);
+        auto now = std::chrono::steady_clock::now();
+        if (!scan->cmd.pin) {
+            scan->cmd.pin = pins.pin(next_seq, now);
+        } else if (!pins.renew(scan->cmd.pin, now)) {
+            LOG_DEBUG("Scan snapshot expired", "pin", scan->cmd.pin);
+            scan->sink.finish(false, true, std::string());
+            return;
+        }
+        for (size_t shard = 0; shard < workers.size(); ++shard) {
+            ScanSource src;
+            src.shard = shard;
+            scan->sources.push_back(std::move(src));
+        }
+        auto addNodes = [&](const Topology& t) {
+            for (const auto& node : t.nodes) {
+                if (isSelf(node) || std::any_of(scan->sources.begin(), scan->sources.end(), [&](const ScanSource& src) {
+                        return src.node && src.node->id() == node.id();
+                    })) {
+                    continue;
+                }
+                ScanSource src;
+                src.node = &node;
+                src.pin = pinOf(node.id());
+                scan->sources.push_back(std::move(src));
+            }
+        };
+        if (!local_only) {
+            addNodes(*scan->topology);
+            if (scan->previous) addNodes(*scan->previous);
+        }
+        pumpScan(w, scan);
+    }
+
+    // Runs a scan to completion and returns it as one Reply (a page for a
+    // peer), naming the version it read this node's keys at
+    void collectScan(Worker& w, Command&& cmd, bool local_only, Callback&& done) {
+        auto now = std::chrono::steady_clock::now();
+        if (!cmd.pin) {
+            cmd.pin = pins.pin(next_seq, now);
+        } else if (!pins.renew(cmd.pin, now)) {
+            done(errorReply("ERROR: scan snapshot expired"));
+            return;
+        }
+        auto result = std::make_shared<Reply>();
+        result->pin = cmd.pin;
+        bool values = cmd.values;
+        ScanSink sink;
+        sink.emit = [result, values](const std::string& key, const std::string& value) {
+            result->keys.push_back(key);
+            if (values) result->values.push_back(value);
+        };
+        sink.stalled = [](std::function<void()>) { return false; };
+        sink.finish = [result, local_only, done = std::move(done)](bool more, bool incomplete,
+                                                                   const std::string& snapshot) {
+            result->more = more;
+            result->incomplete = incomplete;
+            if (!local_only) result->snapshot = snapshot;
+            done(std::move(*result));
+        };
+        startScan(w, std::move(cmd), local_only, std::move(sink));
+    }
+
+    // Splits an MGET/MPUT/MDEL into one sub-batch per local shard and per peer
+    // that owns some of its keys, sends them all at once, and puts the results
+    // back in request order
+    void executeBatch(Worker& w, Command&& cmd, bool from_peer, Callback&& done) {
+        struct Group {
+            Command cmd;
+            std::vector<size_t> positions; // Of its keys in the request
+        };
+        // Groups [0, workers) are local shards, the rest index nodes
+        const std::vector<Node>& nodes = w.topology->nodes;
+        std::vector<Group> groups(workers.size() + nodes.size());
+        std::vector<uint32_t> hashes;
+        ringHashes(config.ring_hash, cmd.items.size(), [&](size_t i) -> std::string_view {
+            return cmd.items[i].first;
+        }, hashes);
+        for (size_t i = 0; i < cmd.items.size(); ++i) {
+            uint32_t keyHash = hashes[i];
+            if (!from_peer && isWrite(cmd.op)) forgetReads(w, cmd.items[i].first);
+            bool routed = from_peer && servesHere(w, cmd, keyHash);
+            const Node* target = routed ? nullptr : findNodeForHash(w, keyHash);
+            if (!routed && !target) {
+                done(errorReply("ERROR"));
+                return;
+            }
+            // Replica reads serve the keys this node has copies of locally
+            if (cmd.op == Op::MGet && config.read_from == ReadFrom::Replica && target && !isSelf(*target) &&
+                replicationFactor(*w.topology) > 1 && holdsCopy(*w.topology, keyHash)) {
+                target = nullptr;
+            }
+            size_t group = target && !isSelf(*target) ? workers.size() + (target - nodes.data()) : shardForHash(keyHash);
+            groups[group].positions.push_back(i);
+            groups[group].cmd.items.push_back(std::move(cmd.items[i]));
+        }
+
+        struct Gather {
+            Reply reply;
+            size_t pending = 0;
+            Callback done;
+        };
+        auto gather = std::make_shared<Gather>();
+        if (cmd.op != Op::MPut || cmd.migrate) gather->reply.found.resize(cmd.items.size());
+        if (cmd.op == Op::MGet) gather->reply.values.resize(cmd.items.size());
+        gather->done = std::move(done);
+        for (const auto& group : groups) gather->pending += !group.positions.empty();
+
+        for (size_t i = 0; i < groups.size(); ++i) {
+            Group& group = groups[i];
+            if (group.positions.empty()) continue;
+            group.cmd.op = cmd.op;
+            group.cmd.replica = cmd.replica;
+            group.cmd.migrate = cmd.migrate;
+            group.cmd.rerouted = from_peer; // Keys a peer sent here by an older ring go on only once
+            auto arrived = [gather, positions = std::move(group.positions)](Reply&& reply) {
+                Reply& result = gather->reply;
+                bool complete = reply.found.size() == (result.found.empty() ? 0 : positions.size());
+                if (reply.status != Status::Ok || !complete) {
+                    result.status = Status::Error;
+                    if (result.value.empty()) result.value = reply.value.empty() ? "ERROR" : reply.value;
+                } else {
+                    for (size_t j = 0; j < reply.found.size(); ++j) {
+                        result.found[positions[j]] = reply.found[j];
+                        if (!result.values.empty()) result.values[positions[j]] = std::move(reply.values[j]);
+                    }
+                }
+                if (--gather->pending == 0) gather->done(std::move(result));
+            };
+            if (i < workers.size()) {
+                callShard(w, i, std::move(group.cmd), std::move(arrived));
+            } else {
+                forwardToNode(w, nodes[i - workers.size()], group.cmd, std::move(arrived));
+            }
+        }
+    }
+
+    static const char* opName(Op op) {
+        static const char* const names[kOpSlots] = {"",      "put",  "get",  "remove", "range", "prefix",
+                                                    "mget", "mput", "mdel", "memory", "node",  "stats", "cas"};
+        return names[static_cast<size_t>(op)];
+    }
+
+    void recordCommand(Worker& w, Op op, std::chrono::steady_clock::time_point started, bool error,
+                       bool from_peer = false) {
+        auto elapsed = std::chrono::steady_clock::now() - started;
+        size_t i = static_cast<size_t>(op);
+        (from_peer ? w.stats.served : w.stats.commands)[i].record(std::chrono::nanoseconds(elapsed).count());
+        if (error) (from_peer ? w.stats.served_errors : w.stats.command_errors)[i].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A peer call that got its reply (ok) or was given up on
+    void recordHop(Worker& w, const RpcCall& call, bool ok) {
+        auto elapsed = std::chrono::steady_clock::now() - call.sent;
+        w.stats.hops[static_cast<size_t>(call.op)].record(std::chrono::nanoseconds(elapsed).count());
+        if (!ok) w.stats.hop_errors[static_cast<size_t>(call.op)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Times a scan from its arrival until its last key is sent; an
+    // incomplete scan counts as an error
+    using ScanFinish = std::function<void(bool, bool, const std::string&)>;
+    ScanFinish timedFinish(Worker& w, Op op, std::chrono::steady_clock::time_point started, ScanFinish&& finish) {
+        return [this, &w, op, started, finish = std::move(finish)](bool more, bool incomplete,
+                                                                   const std::string& snapshot) {
+            recordCommand(w, op, started, incomplete);
+            finish(more, incomplete, snapshot);
+        };
+    }
+
+    // Every worker's metrics for one opcode, added up
+    struct OpStats {
+        LatencyHistogram::Counts commands, served, hops;
+        uint64_t command_errors = 0, served_errors = 0, hop_errors = 0;
+    };
+
+    std::vector<OpStats> collectStats() const {
+        std::vector<OpStats> ops(kOpSlots);
+        for (const auto& worker : workers) {
+            for (size_t i = 0; i < kOpSlots; ++i) {
+                worker->stats.commands[i].addTo(ops[i].commands);
+                worker->stats.served[i].addTo(ops[i].served);
+                worker->stats.hops[i].addTo(ops[i].hops);
+                ops[i].command_errors += worker->stats.command_errors[i].load(std::memory_order_relaxed);
+                ops[i].served_errors += worker->stats.served_errors[i].load(std::memory_order_relaxed);
+                ops[i].hop_errors += worker->stats.hop_errors[i].load(std::memory_order_relaxed);
+            }
+        }
+        return ops;
+    }
+
+    // Point-in-time figures for the whole node
+    struct Gauges {
+        double uptime = 0; // Seconds
+        size_t connections = 0, keys = 0, used_bytes = 0, rss_bytes = 0, open_fds = 0;
+        uint64_t evicted = 0, expired = 0;
+        uint64_t near_cache_hits = 0, coalesced_gets = 0, leases_granted = 0, invalidations_sent = 0;
+        size_t scan_pins = 0, kept_versions = 0;
+    };
+
+    Gauges readGauges() const {
+        Gauges g;
+        g.uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_at).count();
+        for (const auto& worker : workers) {
+            g.connections += worker->stats.connections.load(std::memory_order_relaxed);
+            const FlatMap& data = worker->shard.data();
+            g.keys += data.size();
+            g.used_bytes += data.tableBytes() + data.allocator().usedBytes();
+            g.evicted += worker->shard.evictedCount();
+            g.expired += worker->shard.expiredCount();
+            g.near_cache_hits += worker->stats.near_cache_hits.load(std::memory_order_relaxed);
+            g.coalesced_gets += worker->stats.coalesced_gets.load(std::memory_order_relaxed);
+            g.leases_granted += worker->stats.leases_granted.load(std::memory_order_relaxed);
+            g.invalidations_sent += worker->stats.invalidations_sent.load(std::memory_order_relaxed);
+            g.kept_versions += worker->shard.historySize();
+        }
+        g.scan_pins = pins.size();
+        g.rss_bytes = residentBytes();
+        g.open_fds = openFileDescriptors();
+        return g;
+    }
+
+    // STATS: this node's gauges, then for every command it has seen the
+    // number of client requests, errors and latency percentiles in
+    // microseconds; the same for requests peers sent it (peer_*) and for
+    // the calls it made to peers (hop_*)
+    Reply statsReport() const {
+        Gauges g = readGauges();
+        char text[160];
+        snprintf(text, sizeof(text), "uptime_seconds:%.0f", g.uptime);
+        std::string out = text;
+        out += " connections:" + std::to_string(g.connections) + " open_fds:" + std::to_string(g.open_fds) +
+               " keys:" + std::to_string(g.keys) + " used_bytes:" + std::to_string(g.used_bytes) +
+               " rss_bytes:" + std::to_string(g.rss_bytes) + " near_cache_hits:" + std::to_string(g.near_cache_hits) +
+               " coalesced_gets:" + std::to_string(g.coalesced_gets) + " leases_granted:" +
+               std::to_string(g.leases_granted) + " invalidations_sent:" + std::to_string(g.invalidations_sent) +
+               " scan_pins:" + std::to_string(g.scan_pins) + " kept_versions:" + std::to_string(g.kept_versions);
+        auto latency = [&out, &text](const std::string& prefix, const LatencyHistogram::Counts& counts,
+                                     uint64_t errors) {
+            if (counts.count == 0 && errors == 0) return;
+            snprintf(text, sizeof(text), " %s_calls:%llu %s_errors:%llu %s_p50_us:%.1f %s_p99_us:%.1f %s_p999_us:%.1f %s_max_us:%.1f",
+                     prefix.c_str(), static_cast<unsigned long long>(counts.count), prefix.c_str(),
+                     static_cast<unsigned long long>(errors), prefix.c_str(), counts.percentile(0.5) / 1e3,
+                     prefix.c_str(), counts.percentile(0.99) / 1e3, prefix.c_str(), counts.percentile(0.999) / 1e3,
+                     prefix.c_str(), counts.max / 1e3);
+            out += text;
+        };
+        std::vector<OpStats> ops = collectStats();
+        for (size_t i = 1; i < kOpSlots; ++i) latency(opName(static_cast<Op>(i)), ops[i].commands, ops[i].command_errors);
+        for (size_t i = 1; i < kOpSlots; ++i) {
+            latency(std::string("peer_") + opName(static_cast<Op>(i)), ops[i].served, ops[i].served_errors);
+        }
+        for (size_t i = 1; i < kOpSlots; ++i) {
+            latency(std::string("hop_") + opName(static_cast<Op>(i)), ops[i].hops, ops[i].hop_errors);
+        }
+        Reply reply;
+        reply.value = std::move(out);
+        return reply;
+    }
+
+    // The same figures in the Prometheus text exposition format. Histogram
+    // buckets are counted from the finer latency buckets that lie wholly
+    // under each bound.
+    std::string metricsText() const {
+        static const double bounds[] = {5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3,
+                                        5e-3, 1e-2, 2.5e-2, 5e-2, 0.1,  0.25,   0.5,  1,    2.5,    5};
+        std::string out;
+        char line[256];
+        auto gauge = [&](const char* name, const char* type, const char* help, double value) {
+            snprintf(line, sizeof(line), "# HELP kvstore_%s %s\n# TYPE kvstore_%s %s\nkvstore_%s %.15g\n", name, help,
+                     name, type, name, value);
+            out += line;
+        };
+        using Counts = LatencyHistogram::Counts;
+        auto histogram = [&](const char* name, const char* help, const std::vector<OpStats>& ops,
+                             Counts OpStats::*member) {
+            snprintf(line, sizeof(line), "# HELP kvstore_%s %s\n# TYPE kvstore_%s histogram\n", name, help, name);
+            out += line;
+            for (size_t i = 1; i < kOpSlots; ++i) {
+                const Counts& counts = ops[i].*member;
+                if (counts.count == 0) continue;
+                const char* op = opName(static_cast<Op>(i));
+                for (double bound : bounds) {
+                    snprintf(line, sizeof(line), "kvstore_%s_bucket{command=\"%s\",le=\"%g\"} %llu\n", name, op, bound,
+                             static_cast<unsigned long long>(counts.countAtOrBelow(static_cast<uint64_t>(bound * 1e9))));
+                    out += line;
+                }
+                snprintf(line, sizeof(line),
+                         "kvstore_%s_bucket{command=\"%s\",le=\"+Inf\"} %llu\nkvstore_%s_sum{command=\"%s\"} %.9f\n"
+                         "kvstore_%s_count{command=\"%s\"} %llu\n",
+                         name, op, static_cast<unsigned long long>(counts.count), name, op, counts.sum / 1e9, name, op,
+                         static_cast<unsigned long long>(counts.count));
+                out += line;
+            }
+        };
+        auto errors = [&](const char* name, const char* help, const std::vector<OpStats>& ops,
+                          Counts OpStats::*member, uint64_t OpStats::*count) {
+            snprintf(line, sizeof(line), "# HELP kvstore_%s %s\n# TYPE kvstore_%s counter\n", name, help, name);
+            out += line;
+            for (size_t i = 1; i < kOpSlots; ++i) {
+                if ((ops[i].*member).count == 0 && ops[i].*count == 0) continue;
+                snprintf(line, sizeof(line), "kvstore_%s{command=\"%s\"} %llu\n", name, opName(static_cast<Op>(i)),
+                         static_cast<unsigned long long>(ops[i].*count));
+                out += line;
+            }
+        };
+
+        Gauges g = readGauges();
+        gauge("uptime_seconds", "gauge", "Seconds since the node started.", g.uptime);
+        gauge("connections", "gauge", "Open client and peer connections.", g.connections);
+        gauge("open_fds", "gauge", "Open file descriptors.", g.open_fds);
+        gauge("keys", "gauge", "Keys held in memory.", g.keys);
+        gauge("used_bytes", "gauge", "Bytes the hash tables and entries need.", g.used_bytes);
+        gauge("resident_bytes", "gauge", "Resident set size.", g.rss_bytes);
+        gauge("evicted_keys_total", "counter", "Keys evicted at MAXMEMORY.", g.evicted);
+        gauge("expired_keys_total", "counter", "Keys removed after their expiry time.", g.expired);
+        gauge("near_cache_hits_total", "counter", "GETs answered from the near cache of other nodes' keys.",
+              g.near_cache_hits);
+        gauge("coalesced_gets_total", "counter", "GETs that shared another GET's call to the key's owner.",
+              g.coalesced_gets);
+        gauge("leases_granted_total", "counter", "Leases given to other nodes to cache this node's keys.",
+              g.leases_granted);
+        gauge("invalidations_sent_total", "counter", "Lease holders told that a key changed.", g.invalidations_sent);
+        gauge("scan_pins", "gauge", "Versions pinned by scans in progress.", g.scan_pins);
+        gauge("kept_versions", "gauge", "Replaced values kept for pinned scans.", g.kept_versions);
+        std::vector<OpStats> ops = collectStats();
+        histogram("command_duration_seconds", "Client requests from arrival to reply.", ops, &OpStats::commands);
+        errors("command_errors_total", "Client requests answered with an error.", ops, &OpStats::commands,
+               &OpStats::command_errors);
+        histogram("peer_request_duration_seconds", "Requests from peer nodes from arrival to reply.", ops,
+                  &OpStats::served);
+        errors("peer_request_errors_total", "Requests from peer nodes answered with an error.", ops,
+               &OpStats::served, &OpStats::served_errors);
+        histogram("peer_call_duration_seconds", "Calls to peer nodes from send to reply.", ops, &OpStats::hops);
+        errors("peer_call_errors_total", "Calls to peer nodes that failed or timed out.", ops, &OpStats::hops,
+               &OpStats::hop_errors);
+        return out;
+    }
+
+    // MEMORY: this node's key/value memory over all shards. used is what the
+    // data needs (hash tables plus entry bytes), allocated adds size-class
+    // rounding, and reserved adds the unused parts of partly empty slabs;
+    // fragmentation_ratio is reserved / used. evicted_keys and expired_keys
+    // count removals since startup.
+    Reply memoryReport() const {
+        size_t used = 0, allocated = 0, reserved = 0;
+        uint64_t evicted = 0, expired = 0;
+        for (const auto& worker : workers) {
+            evicted += worker->shard.evictedCount();
+            expired += worker->shard.expiredCount();
+            const FlatMap& data = worker->shard.data();
+            used += data.tableBytes() + data.allocator().usedBytes();
+            allocated += data.tableBytes() + data.allocator().allocatedBytes();
+            reserved += data.memoryUsage();
+        }
+        char ratio[32];
+        snprintf(ratio, sizeof(ratio), "%.2f", used ? double(reserved) / used : 1.0);
+        Reply reply;
+        reply.value = "used_bytes:" + std::to_string(used) + " allocated_bytes:" + std::to_string(allocated) +
+                      " reserved_bytes:" + std::to_string(reserved) + " fragmentation_ratio:" + ratio +
+                      " rss_bytes:" + std::to_string(residentBytes()) +
+                      " maxmemory:" + std::to_string(config.max_memory) + " evicted_keys:" + std::to_string(evicted) +
+                      " expired_keys:" + std::to_string(expired);
+        return reply;
+    }
+
+    // Builds a topology from a member list, marking this node and dropping duplicates
+    std::shared_ptr<Topology> makeTopology(uint64_t version, std::vector<Node> members) const {
+        auto t = std::make_shared<Topology>();
+        t->version = version;
+        std::stable_sort(members.begin(), members.end(), [](const Node& a, const Node& b) { return a.id() < b.id(); });
+        for (auto& node : members) {
+            if (!t->nodes.empty() && t->nodes.back().id() == node.id()) continue;
+            node.self = isLocalEndpoint(node.ip, node.port);
+            t->nodes.push_back(std::move(node));
+        }
+        t->ring.build(t->nodes, config.vnodes, config.ring_hash);
+        return t;
+    }
+
+    // Makes members the cluster's membership as of version, unless this node
+    // already has that version or a later one. Until the rebalance settles the
+    // previous topology is kept to find keys that have not moved yet.
+    bool installTopology(uint64_t version, std::vector<Node> members) {
+        std::shared_ptr<const Topology> next = makeTopology(version, std::move(members));
+        std::lock_guard<std::mutex> lock(topology_mutex);
+        if (version <= topology->version) return false;
+        overlapped = previous != nullptr;
+        if (!previous) previous = topology;
+        // Any member of the old rings may hold keys that now belong elsewhere,
+        // and a joining node may have known only itself until now
+        waiting_for.clear();
+        for (const Topology* t : {previous.get(), topology.get(), next.get()}) {
+            for (const auto& node : t->nodes) {
+                if (isSelf(node) || std::any_of(waiting_for.begin(), waiting_for.end(),
+                                                [&](const Node& n) { return n.id() == node.id(); })) {
+                    continue;
+                }
+                waiting_for.push_back(node);
+            }
+        }
+        sending = workers.size();
+        topology = std::move(next);
+        ++topology_epoch;
+        LOG_INFO("Cluster membership changed", "version", version, "members", formatMembers(topology->nodes));
+        for (auto& worker : workers) wakeWorker(*worker);
+        return true;
+    }
+
+    // Ends the rebalance once this node has sent its keys and every other
+    // member has too. Called with topology_mutex held.
+    void settleRebalance() {
+        if (!previous || sending > 0 || !waiting_for.empty()) return;
+        previous.reset();
+        overlapped = false;
+        ++topology_epoch;
+        LOG_INFO("Rebalance finished", "version", topology->version);
+        for (auto& worker : workers) wakeWorker(*worker);
+    }
+
+    // Takes up a membership change made on any worker. A new topology starts
+    // a migration pass over this worker's shard.
+    void refreshTopology(Worker& w) {
+        if (topology_epoch.load() == w.topology_epoch) return;
+        std::lock_guard<std::mutex> lock(topology_mutex);
+        bool changed = w.topology != topology;
+        w.topology = topology;
+        w.previous = previous;
+        w.overlapped = overlapped;
+        w.topology_epoch = topology_epoch.load();
+        if (changed && w.previous) {
+            w.migrating = true;
+            w.migrate_scanned = false;
+            w.migrate_failed = false;
+            ++w.migrate_pass;
+            w.migrate_after.clear();
+            w.next_migrate_pass = std::chrono::steady_clock::now();
+        }
+        w.shard.setImporting(w.previous != nullptr);
+        if (changed) w.near_cache.clear(); // Owners may have changed; their leases went with them
+    }
+
+    bool migrationReady(const Worker& w) const {
+        return w.migrating && !w.migrate_scanned && !w.shard.warming() && w.migrate_inflight < kMigrateWindow &&
+               w.migrate_budget > 0 && std::chrono::steady_clock::now() >= w.next_migrate_pass;
+    }
+
+    // One step of a migration pass: walks the shard from where the pass left
+    // off and sends each key to the nodes that hold it under the new topology
+    // but did not under the old one, one MPUT per node. Once all of them are
+    // acknowledged, the keys this node no longer holds are deleted. Budget and
+    // window keep the transfer to config.migrate_rate.
+    void migrateSome(Worker& w) {
+        if (!migrationReady(w)) return;
+        struct Batch {
+            uint64_t pass;
+            size_t pending = 0;
+            bool failed = false;
+            Command drop; // Keys to delete once every node has its copy
+        };
+        auto batch = std::make_shared<Batch>();
+        batch->pass = w.migrate_pass;
+        batch->drop.op = Op::MDel;
+        batch->drop.replica = true;
+        batch->drop.migrate = true;
+        std::vector<std::pair<const Node*, Command>> sends;
+        std::vector<const Node*> holders, old_holders;
+        size_t bytes = 0, scanned = 0;
+        bool more = w.shard.forEachAfter(w.migrate_after, [&](const std::string& key, std::string_view value,
+                                                              uint32_t expires) {
+            uint32_t keyHash = hashKey(key);
+            holdersOf(*w.topology, keyHash, holders);
+            // After overlapping changes the old holders may not have the key yet
+            old_holders.clear();
+            if (!w.overlapped) holdersOf(*w.previous, keyHash, old_holders);
+            bool keep = false;
+            for (const Node* node : holders) {
+                if (isSelf(*node)) {
+                    keep = true;
+                    continue;
+                }
+                if (std::any_of(old_holders.begin(), old_holders.end(), [&](const Node* n) { return n->id() == node->id(); })) {
+                    continue;
+                }
+                size_t s = 0;
+                while (s < sends.size() && sends[s].first != node) ++s;
+                if (s == sends.size()) {
+                    Command copy;
+                    copy.op = Op::MPut;
+                    copy.replica = true;
+                    copy.migrate = true;
+                    sends.emplace_back(node, std::move(copy));
+                }
+                std::string entry;
+                entry.reserve(4 + value.size());
+                appendBE32(entry, expires);
+                entry += value;
+                sends[s].second.items.emplace_back(key, std::move(entry));
+                bytes += key.size() + value.size();
+            }
+            if (!keep) batch->drop.items.emplace_back(key, std::string());
+            w.migrate_after = key;
+            return bytes < kMigrateBatchBytes && ++scanned < kMigrateScanKeys;
+        });
+        w.migrate_scanned = !more;
+        w.migrate_budget -= bytes;
+
+        if (sends.empty()) {
+            if (!batch->drop.items.empty()) executeLocal(w, batch->drop, [](Reply&&) {});
+            finishMigration(w);
+            return;
+        }
+        ++w.migrate_inflight;
+        batch->pending = sends.size();
+        for (auto& [node, send] : sends) {
+            callNode(w, *node, send, [this, &w, batch](bool ok, Reply&& reply) {
+                if (!ok || reply.status != Status::Ok) batch->failed = true;
+                if (--batch->pending > 0) return;
+                --w.migrate_inflight;
+                if (batch->pass != w.migrate_pass) return; // A newer topology restarted the pass
+                if (batch->failed) {
+                    w.migrate_failed = true;
+                } else if (!batch->drop.items.empty()) {
+                    executeLocal(w, batch->drop, [](Reply&&) {});
+                }
+                finishMigration(w);
+            });
+        }
+    }
+
+    // Ends a migration pass once it has walked the whole shard and every batch
+    // is answered. A pass in which some node did not take its keys runs again.
+    void finishMigration(Worker& w) {
+        if (!w.migrating || !w.migrate_scanned || w.migrate_inflight > 0) return;
+        if (w.migrate_failed) {
+            LOG_WARN("Could not move every key to its new holders; retrying", "worker", w.id);
+            w.migrate_scanned = false;
+            w.migrate_failed = false;
+            w.migrate_after.clear();
+            w.next_migrate_pass = std::chrono::steady_clock::now() + kMigrateRetryDelay;
+            return;
+        }
+        w.migrating = false;
+        std::lock_guard<std::mutex> lock(topology_mutex);
+        if (topology != w.topology) return; // Counted against the newer topology's pass instead
+        --sending;
+        settleRebalance();
+    }
+
+    // Worker 0, every second during a rebalance: asks the members it is
+    // waiting for whether they have finished sending keys. One that is still
+    // on an older topology is sent the current one; one that cannot be
+    // reached is not waited for.
+    void pollMembers(Worker& w) {
+        std::vector<Node> members;
+        Command set;
+        {
+            std::lock_guard<std::mutex> lock(topology_mutex);
+            if (!previous || w.status_polls > 0) return;
+            members = waiting_for;
+            set.op = Op::Node;
+            set.key = "SET";
+            set.value = std::to_string(topology->version) + ";" + formatMembers(topology->nodes) + ";" +
+                        ringHashName(config.ring_hash);
+        }
+        uint64_t version = std::strtoull(set.value.c_str(), nullptr, 10);
+        Command status;
+        status.op = Op::Node;
+        status.key = "STATUS";
+        for (const Node& node : members) {
+            ++w.status_polls;
+            callNode(w, node, status, [this, &w, node, set, version](bool ok, Reply&& reply) {
+                --w.status_polls;
+                uint64_t their_version = 0;
+                size_t their_sending = 1;
+                if (ok && reply.status == Status::Ok) {
+                    std::istringstream(reply.value) >> their_version >> their_sending;
+                    if (their_version < version) callNode(w, node, set, [](bool, Reply&&) {});
+                }
+                std::lock_guard<std::mutex> lock(topology_mutex);
+                if (ok && (their_version < version || their_sending > 0)) return;
+                if (!ok) LOG_WARN("Not waiting for unreachable member to rebalance", "node", node.id());
+                waiting_for.erase(std::remove_if(waiting_for.begin(), waiting_for.end(),
+                                                 [&](const Node& n) { return n.id() == node.id(); }),
+                                  waiting_for.end());
+                settleRebalance();
+            });
+        }
+    }
+
+    // NODE ADD/REMOVE: changes the membership from this node and sends the
+    // new member list to every node in the old or the new ring. Replies once
+    // they have all taken it; the keys then move in the background.
+    void changeMembership(Worker& w, const Command& cmd, Callback&& done) {
+        std::string host;
+        int node_port;
+        uint32_t weight;
+        if (!parseNodeSpec(cmd.value, host, node_port, weight)) {
+            done(errorReply("ERROR: invalid node " + cmd.value));
+            return;
+        }
+        std::shared_ptr<const Topology> current;
+        {
+            std::lock_guard<std::mutex> lock(topology_mutex);
+            if (previous) {
+                done(errorReply("ERROR: rebalance in progress"));
+                return;
+            }
+            current = topology;
+        }
+        std::vector<Node> members = current->nodes;
+        std::string id = host + ":" + std::to_string(node_port);
+        auto it = std::find_if(members.begin(), members.end(), [&](const Node& n) { return n.id() == id; });
+        if (cmd.key == "ADD") {
+            if (it != members.end()) {
+                done(errorReply("ERROR: " + id + " is already a member"));
+                return;
+            }
+            members.emplace_back(host, node_port, weight);
+        } else {
+            if (it == members.end()) {
+                done(errorReply("ERROR: " + id + " is not a member"));
+                return;
+            }
+            if (members.size() == 1) {
+                done(errorReply("ERROR: cannot remove the last member"));
+                return;
+            }
+            members.erase(it);
+        }
+        uint64_t version = current->version + 1;
+        Command set;
+        set.op = Op::Node;
+        set.key = "SET";
+        set.value = std::to_string(version) + ";" + formatMembers(members) + ";" + ringHashName(config.ring_hash);
+        std::vector<Node> targets;
+        for (const auto& node : current->nodes) {
+            if (!isSelf(node)) targets.push_back(node);
+        }
+        if (cmd.key == "ADD" && !isLocalEndpoint(host, node_port)) targets.push_back(members.back());
+        if (!installTopology(version, std::move(members))) {
+            done(errorReply("ERROR: membership changed concurrently"));
+            return;
+        }
+
+        struct Acks {
+            size_t pending = 0;
+            std::string failed;
+            Callback done;
+        };
+        auto acks = std::make_shared<Acks>();
+        acks->pending = targets.size();
+        acks->done = std::move(done);
+        Reply ok;
+        ok.value = "OK";
+        if (targets.empty()) acks->done(std::move(ok));
+        for (const auto& node : targets) {
+            callNode(w, node, set, [acks, ok, id = node.id()](bool sent, Reply&& reply) {
+                if (!sent || reply.status != Status::Ok) acks->failed += (acks->failed.empty() ? "" : ",") + id;
+                if (--acks->pending > 0) return;
+                acks->done(acks->failed.empty() ? Reply(ok) : errorReply("ERROR: not acknowledged by " + acks->failed));
+            });
+        }
+    }
+
+    // NODE: ADD and REMOVE change the membership, LIST shows it. SET (a new
+    // member list from the node that changed it), STATUS (its version and
+    // how many workers are still sending keys), INVALIDATE (a key this node
+    // holds a lease on has changed) and UNPIN (a paged scan that held a pin
+    // here has ended) pass between members.
+    void nodeCommand(Worker& w, const Command& cmd, Callback&& done) {
+        if (cmd.key == "ADD" || cmd.key == "REMOVE") {
+            changeMembership(w, cmd, std::move(done));
+            return;
+        }
+        Reply reply;
+        if (cmd.key == "INVALIDATE") {
+            // Every worker may have read the key; the others hear it from this one
+            w.near_cache.invalidate(cmd.value);
+            for (size_t i = 0; i < workers.size(); ++i) {
+                if (i != w.id) callShard(w, i, Command(cmd), [](Reply&&) {});
+            }
+            reply.value = "OK";
+            done(std::move(reply));
+            return;
+        }
+        if (cmd.key == "UNPIN") {
+            uint64_t version = 0;
+            if (std::from_chars(cmd.value.data(), cmd.value.data() + cmd.value.size(), version).ec != std::errc()) {
+                done(errorReply("ERROR: malformed version"));
+                return;
+            }
+            pins.unpin(version);
+            reply.value = "OK";
+            done(std::move(reply));
+            return;
+        }
+        if (cmd.key == "SET") {
+            std::string_view arg = cmd.value;
+            size_t semicolon = arg.find(';');
+            size_t hash_at = arg.find(';', semicolon == std::string_view::npos ? arg.size() : semicolon + 1);
+            uint64_t version = 0;
+            std::vector<Node> members;
+            if (semicolon == std::string_view::npos ||
+                std::from_chars(arg.data(), arg.data() + semicolon, version).ec != std::errc() ||
+                !parseMembers(arg.substr(semicolon + 1, hash_at - semicolon - 1), members)) {
+                done(errorReply("ERROR: malformed member list"));
+                return;
+            }
+            // A member hashing keys differently would put them where no one looks
+            if (hash_at != std::string_view::npos && arg.substr(hash_at + 1) != ringHashName(config.ring_hash)) {
+                LOG_ERROR("Refusing membership from a node with another ring hash", "theirs", arg.substr(hash_at + 1),
+                          "ours", ringHashName(config.ring_hash));
+                done(errorReply("ERROR: ring hash mismatch"));
+                return;
+            }
+            installTopology(version, std::move(members));
+            reply.value = "OK";
+            done(std::move(reply));
+            return;
+        }
+        if (cmd.key == "STATUS" || cmd.key == "LIST") {
+            std::lock_guard<std::mutex> lock(topology_mutex);
+            if (cmd.key == "STATUS") {
+                reply.value = std::to_string(topology->version) + " " + std::to_string(sending);
+            } else {
+                reply.value = "version:" + std::to_string(topology->version) + " members:" +
+                              formatMembers(topology->nodes) + " rebalancing:" + (previous ? "1" : "0") +
+                              " hash:" + ringHashName(config.ring_hash) + " vnodes:" + std::to_string(config.vnodes);
+            }
+        } else {
+            reply = errorReply("ERROR: unknown NODE subcommand");
+        }
+        done(std::move(reply));
+    }
+
+    // Routes a command to the owning node and shard. Requests from peers were
+    // already routed by the sender and are always served from this node.
+    void execute(Worker& w, Command&& cmd, bool from_peer, Callback&& done) {
+        if (cmd.op == Op::Range || cmd.op == Op::Prefix) {
+            collectScan(w, std::move(cmd), from_peer, std::move(done));
+            return;
+        }
+        if (isBatch(cmd.op)) {
+            executeBatch(w, std::move(cmd), from_peer, std::move(done));
+            return;
+        }
+        if (cmd.op == Op::Memory) {
+            done(memoryReport());
+            return;
+        }
+        if (cmd.op == Op::Stats) {
+            done(statsReport());
+            return;
+        }
+        if (cmd.op == Op::Node) {
+            nodeCommand(w, cmd, std::move(done));
+            return;
+        }
+        uint32_t keyHash = hashKey(cmd.key);
+        if (from_peer && !servesHere(w, cmd, keyHash)) {
+            from_peer = false;
+            cmd.rerouted = true;
+        }
+        if (!from_peer && !cmd.rerouted) {
+            // A versioned GET is read from the key's primary, whose versions CAS checks
+            if (cmd.op == Op::Get && !cmd.versioned && readsRemotely(w, keyHash)) {
+                readRemote(w, std::move(cmd), keyHash, std::move(done));
+                return;
+            }
+            if (isWrite(cmd.op)) forgetReads(w, cmd.key);
+        }
+        if (!from_peer && cmd.op == Op::Get && !cmd.versioned && replicationFactor(*w.topology) > 1) {
+            readReplicated(w, std::move(cmd), keyHash, std::move(done));
+            return;
+        }
+        const Node* target = from_peer ? nullptr : findNodeForHash(w, keyHash);
+        if (!from_peer && !target) {
+            Reply reply;
+            reply.status = Status::Error;
+            done(std::move(reply));
+        } else if (target && !isSelf(*target)) {
+            forwardToNode(w, *target, cmd, std::move(done));
+        } else {
+            callShard(w, shardForHash(keyHash), std::move(cmd), std::move(done));
+        }
+    }
+
+    // Fills the reply slot for seq and moves every leading completed slot to the output buffer
+    void deliver(Worker& w, uint64_t conn_id, uint64_t seq, std::string&& text) {
+        auto it = w.connections.find(conn_id);
+        if (it == w.connections.end()) return; // Client went away
+        Connection& conn = it->second;
+        PendingReply& slot = conn.replies[seq - conn.first_seq];
+        slot.ready = true;
+        if (slot.text.empty()) {
+            slot.text = std::move(text);
+        } else {
+            slot.text += text; // Tail of a streamed reply
+        }
+        while (!conn.replies.empty() && conn.replies.front().ready) {
+            LOG_DEBUG("Sending response", "reply", conn.replies.front().text);
+            conn.out += conn.replies.front().text;
+            conn.out += '\n';
+            conn.replies.pop_front();
+            ++conn.first_seq;
+        }
+        // A streamed reply that is now first in line sends what it has so far
+        if (!conn.replies.empty() && !conn.replies.front().text.empty()) {
+            conn.out += conn.replies.front().text;
+            conn.replies.front().text.clear();
+        }
+        if (!conn.in_service) w.dirty.push_back(conn_id);
+    }
 
-// Lock-free queue for write buffering
-template<typename T>
-class LockFreeQueue {
-private:
-    std::vector<T> buffer;
-    std::atomic<size_t> head;
-    std::atomic<size_t> tail;
-    size_t capacity;
+    // Adds part of a reply that is still being produced to slot seq
+    void streamText(Worker& w, uint64_t conn_id, uint64_t seq, const std::string& chunk) {
+        auto it = w.connections.find(conn_id);
+        if (it == w.connections.end()) return;
+        Connection& conn = it->second;
+        if (seq == conn.first_seq) {
+            conn.out += chunk;
+        } else {
+            conn.replies[seq - conn.first_seq].text += chunk;
+        }
+        if (!conn.in_service) w.dirty.push_back(conn_id);
+    }
 
-public:
-    LockFreeQueue(size_t size) : capacity(size), head(0), tail(0) {
-        buffer.resize(size);
+    static size_t unsent(const Connection& conn) {
+        return conn.out.size() - conn.out_offset;
     }
 
-    bool enqueue(const T& item) {
-        size_t current_tail = tail.load(std::memory_order_relaxed);
-        size_t next_tail = (current_tail + 1) % capacity;
-        if (next_tail == head.load(std::memory_order_acquire)) return false; // Queue full
-        buffer[current_tail] = item;
-        tail.store(next_tail, std::memory_order_release);
-        return true;
+    static bool isScan(Op op) {
+        return op == Op::Range || op == Op::Prefix;
     }
 
-    bool dequeue(T& item) {
-        size_t current_head = head.load(std::memory_order_relaxed);
-        if (current_head == tail.load(std::memory_order_acquire)) return false; // Queue empty
-        item = buffer[current_head];
-        head.store((current_head + 1) % capacity, std::memory_order_release);
-        return true;
+    // Streams a text client's RANGE/PREFIX into its reply slot. Keys (and
+    // values) are space separated as before; with LIMIT the line ends in END,
+    // or in >key@snapshot to pass to AFTER for the next page, which reads every
+    // node at the same pins. A final INCOMPLETE means a node did not answer, or
+    // the pins lapsed, and keys are missing.
+    ScanSink textScanSink(Worker& w, uint64_t conn_id, uint64_t seq, bool paged, bool values) {
+        struct State {
+            std::string chunk;
+            std::string last;
+            size_t count = 0;
+        };
+        auto state = std::make_shared<State>();
+        ScanSink sink;
+        sink.emit = [this, &w, conn_id, seq, state, paged, values](const std::string& key, const std::string& value) {
+            state->chunk += key;
+            state->chunk += ' ';
+            if (values) {
+                state->chunk += value;
+                state->chunk += ' ';
+            }
+            if (paged) state->last = key;
+            ++state->count;
+            if (state->chunk.size() >= kScanChunk) {
+                streamText(w, conn_id, seq, state->chunk);
+                state->chunk.clear();
+            }
+        };
+        sink.stalled = [this, &w, conn_id, seq](std::function<void()> resume) {
+            auto it = w.connections.find(conn_id);
+            if (it == w.connections.end()) return true;
+            Connection& conn = it->second;
+            if (unsent(conn) + conn.replies[seq - conn.first_seq].text.size() < kMaxOutputBuffer) return false;
+            conn.drain_waiters.push_back(std::move(resume));
+            return true;
+        };
+        sink.finish = [this, &w, conn_id, seq, state, paged](bool more, bool incomplete, const std::string& snapshot) {
+            std::string text = std::move(state->chunk);
+            if (paged) {
+                text += more ? ">" + state->last + (snapshot.empty() ? "" : "@" + snapshot) : "END";
+            } else if (state->count == 0) {
+                text = "NONE";
+            }
+            if (incomplete) text += paged || state->count == 0 ? " INCOMPLETE" : "INCOMPLETE";
+            deliver(w, conn_id, seq, std::move(text));
+        };
+        return sink;
     }
-};
 
-// Simplified r-index for range queries and prefix scans
-class RIndex {
-private:
-    struct Run {
-        std::string prefix;
-        uint32_t start;
-        uint32_t length;
-    };
-    std::vector<Run> runs;
-    std::vector<std::string> keys; // Sorted keys for binary search
+    void handleTextRequest(Worker& w, uint64_t conn_id, Connection& conn, std::string_view line) {
+        uint64_t seq = conn.first_seq + conn.replies.size();
+        conn.replies.emplace_back();
 
-public:
-    void build(const std::unordered_map<std::string, std::string>& store) {
-        keys.clear();
-        runs.clear();
-        for (const auto& [key, _] : store) {
-            keys.push_back(key);
-        }
-        std::sort(keys.begin(), keys.end());
-
-        // Build runs for consecutive keys with common prefixes
-        if (!keys.empty()) {
-            std::string last_prefix = keys[0];
-            uint32_t start = 0;
-            for (size_t i = 1; i <= keys.size(); ++i) {
-                if (i == keys.size() || !hasCommonPrefix(last_prefix, keys[i])) {
-                    runs.push_back({last_prefix, start, static_cast<uint32_t>(i - start)});
-                    if (i < keys.size()) {
-                        last_prefix = keys[i];
-                        start = i;
-                    }
-                }
+        RequestView req(&w.scratch);
+        std::string error;
+        if (!parseTextRequest(line, req, error)) {
+            deliver(w, conn_id, seq, std::move(error));
+            return;
+        }
+        Op op = req.op;
+        auto started = std::chrono::steady_clock::now();
+        try {
+            Command cmd = toCommand(req);
+            if (isScan(op)) {
+                ScanSink sink = textScanSink(w, conn_id, seq, cmd.limit > 0, cmd.values);
+                sink.finish = timedFinish(w, op, started, std::move(sink.finish));
+                startScan(w, std::move(cmd), false, std::move(sink));
+            } else {
+                execute(w, std::move(cmd), false, [this, &w, conn_id, seq, op, started](Reply&& reply) {
+                    recordCommand(w, op, started, reply.status == Status::Error);
+                    deliver(w, conn_id, seq, formatReply(op, reply));
+                });
             }
+        } catch (const std::exception& e) {
+            LOG_ERROR("Exception processing request", "error", e.what());
+            deliver(w, conn_id, seq, "ERROR: Server exception");
         }
     }
 
-    bool hasCommonPrefix(const std::string& a, const std::string& b) {
-        size_t min_len = std::min(a.length(), b.length());
-        for (size_t i = 0; i < min_len; ++i) {
-            if (a[i] != b[i]) return false;
-        }
-        return true;
+    void deliverBinary(Worker& w, uint64_t conn_id, uint32_t id, Op op, const Reply& reply) {
+        auto it = w.connections.find(conn_id);
+        if (it == w.connections.end()) return;
+        Connection& conn = it->second;
+        appendBinaryReply(conn.out, id, op, reply);
+        --conn.binary_inflight;
+        if (!conn.in_service) w.dirty.push_back(conn_id);
     }
 
-    std::vector<std::string> rangeQuery(const std::string& start, const std::string& end) {
-        std::vector<std::string> result;
-        auto lower = std::lower_bound(keys.begin(), keys.end(), start);
-        auto upper = std::upper_bound(keys.begin(), keys.end(), end);
-        for (auto it = lower; it != upper; ++it) {
-            result.push_back(*it);
-        }
-        return result;
+    void sendScanFrame(Worker& w, uint64_t conn_id, uint32_t id, Op op, Status status, uint8_t flags,
+                       const std::string& body) {
+        auto it = w.connections.find(conn_id);
+        if (it == w.connections.end()) return;
+        Connection& conn = it->second;
+        appendBinaryHeader(conn.out, id, op, status, flags, body.size());
+        conn.out += body;
+        if (status != Status::Partial) --conn.binary_inflight;
+        if (!conn.in_service) w.dirty.push_back(conn_id);
     }
 
-    std::vector<std::string> prefixScan(const std::string& prefix) {
-        std::vector<std::string> result;
-        for (const auto& run : runs) {
-            if (run.prefix.find(prefix) == 0) {
-                for (uint32_t i = run.start; i < run.start + run.length; ++i) {
-                    result.push_back(keys[i]);
-                }
+    // Streams a binary client's RANGE/PREFIX as Partial frames and a final Ok frame
+    ScanSink binaryScanSink(Worker& w, uint64_t conn_id, uint32_t id, Op op, bool values) {
+        auto body = std::make_shared<std::string>();
+        uint8_t flags = values ? kReplyValues : 0;
+        ScanSink sink;
+        sink.emit = [this, &w, conn_id, id, op, body, flags, values](const std::string& key, const std::string& value) {
+            appendScanEntry(*body, key, values ? &value : nullptr);
+            if (body->size() >= kScanChunk) {
+                sendScanFrame(w, conn_id, id, op, Status::Partial, flags, *body);
+                body->clear();
             }
-        }
-        return result;
+        };
+        sink.stalled = [&w, conn_id](std::function<void()> resume) {
+            auto it = w.connections.find(conn_id);
+            if (it == w.connections.end()) return true;
+            if (unsent(it->second) < kMaxOutputBuffer) return false;
+            it->second.drain_waiters.push_back(std::move(resume));
+            return true;
+        };
+        sink.finish = [this, &w, conn_id, id, op, body, flags](bool more, bool incomplete, const std::string& snapshot) {
+            uint8_t final_flags = flags | (more ? kReplyMore : 0) | (incomplete ? kReplyIncomplete : 0);
+            if (more && !snapshot.empty()) {
+                // The pins go ahead of the frame's keys
+                std::string pinned;
+                appendBE32(pinned, static_cast<uint32_t>(snapshot.size()));
+                pinned += snapshot;
+                body->insert(0, pinned);
+                final_flags |= kReplySnapshot;
+            }
+            sendScanFrame(w, conn_id, id, op, Status::Ok, final_flags, *body);
+        };
+        return sink;
     }
-};
-
-class Node {
-public:
-    std::string ip;
-    int port;
-    uint32_t hash;
 
-    Node(const std::string& ip, int port) : ip(ip), port(port) {
-        std::string id = ip + ":" + std::to_string(port);
-        hash = MurmurHash3_x86_32(id.c_str(), id.length(), 0);
+    static Reply errorReply(std::string message) {
+        Reply reply;
+        reply.status = Status::Error;
+        reply.value = std::move(message);
+        return reply;
     }
-};
 
-class DistributedKVStore {
-private:
-    std::unordered_map<std::string, std::string> store;
-    RIndex rindex;
-    LockFreeQueue<std::pair<std::string, std::string>> write_buffer;
-    std::vector<Node> nodes;
-    int server_fd;
-    std::string ip;
-    int port;
-    std::atomic<bool> running;
+    void handleBinaryRequest(Worker& w, uint64_t conn_id, Connection& conn, const RequestView& req) {
+        ++conn.binary_inflight;
+        uint32_t id = req.id;
+        Op op = req.op;
+        auto started = std::chrono::steady_clock::now();
+        try {
+            Command cmd = toCommand(req);
+            bool from_peer = req.flags & kFlagLocal;
+            if (isScan(op) && !from_peer) {
+                ScanSink sink = binaryScanSink(w, conn_id, id, op, cmd.values);
+                sink.finish = timedFinish(w, op, started, std::move(sink.finish));
+                startScan(w, std::move(cmd), false, std::move(sink));
+            } else {
+                execute(w, std::move(cmd), from_peer, [this, &w, conn_id, id, op, started, from_peer](Reply&& reply) {
+                    recordCommand(w, op, started, reply.status == Status::Error, from_peer);
+                    deliverBinary(w, conn_id, id, op, reply);
+                });
+            }
+        } catch (const std::exception& e) {
+            LOG_ERROR("Exception processing request", "error", e.what());
+            deliverBinary(w, conn_id, id, op, errorReply("ERROR: Server exception"));
+        }
+    }
 
-    uint32_t hashKey(const std::string& key) {
-        return MurmurHash3_x86_32(key.c_str(), key.length(), 0);
+    static size_t inFlight(const Connection& conn) {
+        return conn.replies.size() + conn.binary_inflight;
     }
 
-    Node* findNodeForKey(const std::string& key) {
-        if (nodes.empty()) return nullptr;
-        uint32_t keyHash = hashKey(key);
-        Node* target = &nodes[0];
-        for (auto& node : nodes) {
-            if (node.hash >= keyHash && node.hash < target->hash) {
-                target = &node;
-            }
-        }
-        return target;
+    // Binary frames may exceed the usual input cap; allow the pending one to complete
+    static size_t inputLimit(const Connection& conn) {
+        if (conn.protocol != Protocol::Binary || conn.in.size() < kRequestHeaderSize) return kMaxInputBuffer;
+        size_t frame = kRequestHeaderSize + static_cast<size_t>(loadBE32(conn.in.data() + 8)) +
+                       loadBE32(conn.in.data() + 12);
+        return std::max(kMaxInputBuffer, frame);
     }
 
-    std::string sendToNode(const std::string& ip, int port, const std::string& request) {
-        std::cerr << "Attempting to send to " << ip << ":" << port << ": " << request << std::endl;
-        const int max_retries = 3;
-        for (int attempt = 1; attempt <= max_retries; ++attempt) {
-            int sock = socket(AF_INET, SOCK_STREAM, 0);
-            if (sock == -1) {
-                std::cerr << "Attempt " << attempt << ": Failed to create socket: " << strerror(errno) << std::endl;
-                std::this_thread::sleep_for(std::chrono::milliseconds(200 * attempt));
-                continue;
+    void acceptClients(Worker& w) {
+        // Edge-triggered: drain the accept queue until EAGAIN
+        while (true) {
+            sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
+            int client_fd = accept4(w.listen_fd, (sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                LOG_WARN("Failed to accept client", "error", strerror(errno));
+                return;
             }
 
-            sockaddr_in server;
-            server.sin_family = AF_INET;
-            server.sin_port = htons(port);
-            inet_pton(AF_INET, ip.c_str(), &server.sin_addr);
-
-            // Set connect timeout
-            struct timeval tv = {10, 0}; // 10s timeout
-            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+            LOG_DEBUG("Accepted client", "peer", client_ip, "port", ntohs(client_addr.sin_port));
 
-            // Check socket buffer status
-            int pending;
-            ioctl(sock, TIOCOUTQ, &pending);
-            std::cerr << "Attempt " << attempt << ": Socket send buffer pending: " << pending << " bytes" << std::endl;
+            int opt = 1;
+            setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
 
-            if (connect(sock, (sockaddr*)&server, sizeof(server)) == -1) {
-                std::cerr << "Attempt " << attempt << ": Failed to connect to " << ip << ":" << port << ": " << strerror(errno) << std::endl;
-                close(sock);
-                std::this_thread::sleep_for(std::chrono::milliseconds(200 * attempt));
+            uint64_t conn_id = w.next_conn_id++;
+            epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.u64 = conn_id;
+            if (epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+                LOG_ERROR("Failed to register client", "error", strerror(errno));
+                close(client_fd);
                 continue;
             }
+            w.connections[conn_id].fd = client_fd;
+            w.stats.connections.store(w.connections.size(), std::memory_order_relaxed);
+        }
+    }
 
-            std::string msg = request + "\n";
-            if (write(sock, msg.c_str(), msg.length()) == -1) {
-                std::cerr << "Attempt " << attempt << ": Failed to send to " << ip << ":" << port << ": " << strerror(errno) << std::endl;
-                close(sock);
-                std::this_thread::sleep_for(std::chrono::milliseconds(200 * attempt));
-                continue;
-            }
+    void closeConnection(Worker& w, uint64_t conn_id) {
+        auto it = w.connections.find(conn_id);
+        if (it == w.connections.end()) return;
+        epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        close(it->second.fd);
+        w.connections.erase(it);
+        w.stats.connections.store(w.connections.size(), std::memory_order_relaxed);
+        LOG_DEBUG("Closed client connection");
+    }
 
-            char buffer[1024] = {0};
-            int bytes = read(sock, buffer, sizeof(buffer) - 1);
-            if (bytes <= 0) {
-                std::cerr << "Attempt " << attempt << ": Failed to read from " << ip << ":" << port << ": " << (bytes == 0 ? "Connection closed" : strerror(errno)) << std::endl;
-                close(sock);
-                std::this_thread::sleep_for(std::chrono::milliseconds(200 * attempt));
+    // Reads until EAGAIN, stopping early if the input buffer is full.
+    // Returns false if the connection failed.
+    bool readClient(Connection& conn) {
+        char buffer[16384];
+        while (conn.in.size() < inputLimit(conn)) {
+            ssize_t bytes = read(conn.fd, buffer, sizeof(buffer));
+            if (bytes > 0) {
+                conn.in.append(buffer, bytes);
                 continue;
             }
+            if (bytes == 0) {
+                conn.peer_closed = true;
+                conn.readable = false;
+                return true;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn.readable = false;
+                return true;
+            }
+            LOG_DEBUG("Failed to read from client", "error", strerror(errno));
+            return false;
+        }
+        conn.readable = true; // More data may be waiting in the socket
+        return true;
+    }
 
-            close(sock);
-            std::cerr << "Received from " << ip << ":" << port << ": " << std::string(buffer, bytes) << std::endl;
-            return std::string(buffer, bytes);
+    // Executes every complete request in the input buffer until the output
+    // buffer or the number of in-flight requests reaches its limit
+    void processInput(Worker& w, uint64_t conn_id, Connection& conn) {
+        if (conn.protocol == Protocol::Unknown) {
+            if (conn.in.empty()) return;
+            conn.protocol = static_cast<uint8_t>(conn.in[0]) == kBinaryMagic ? Protocol::Binary : Protocol::Text;
         }
+        auto has_room = [&]() {
+            return conn.out.size() - conn.out_offset < kMaxOutputBuffer && inFlight(conn) < kMaxPipelined;
+        };
+        std::string_view pending(conn.in);
 
-        std::cerr << "All " << max_retries << " attempts to " << ip << ":" << port << " failed" << std::endl;
-        return "ERROR";
-    }
+        if (conn.protocol == Protocol::Text) {
+            while (has_room()) {
+                size_t newline = pending.find('\n');
+                if (newline == std::string_view::npos) {
+                    // A client that half-closes without a trailing newline still gets its last request served
+                    if (!conn.peer_closed || pending.empty()) break;
+                    newline = pending.size();
+                }
+                std::string_view line = pending.substr(0, newline);
+                pending.remove_prefix(std::min(newline + 1, pending.size()));
+                if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+                if (line.empty()) continue;
 
-    void processWriteBuffer() {
-        while (running) {
-            std::pair<std::string, std::string> item;
-            if (write_buffer.dequeue(item)) {
-                store[item.first] = item.second;
-                rindex.build(store);
+                LOG_DEBUG("Received request", "request", line);
+                handleTextRequest(w, conn_id, conn, line);
+            }
+            if (pending.size() >= kMaxInputBuffer && pending.find('\n') == std::string_view::npos) {
+                LOG_WARN("Request too long, dropping client", "limit", kMaxInputBuffer);
+                conn.failed = true;
+            }
+        } else {
+            while (has_room()) {
+                RequestView req(&w.scratch);
+                size_t consumed = 0;
+                std::string error;
+                ParseStatus status = parseBinaryRequest(pending, req, consumed, error);
+                if (status == ParseStatus::Incomplete) {
+                    if (conn.peer_closed) pending = {}; // Truncated frame from a client that went away
+                    break;
+                }
+                if (status == ParseStatus::Invalid) {
+                    LOG_WARN("Malformed binary frame, dropping client");
+                    conn.failed = true;
+                    break;
+                }
+                if (status == ParseStatus::Ok) {
+                    handleBinaryRequest(w, conn_id, conn, req);
+                } else {
+                    ++conn.binary_inflight;
+                    deliverBinary(w, conn_id, req.id, req.op, errorReply(error));
+                }
+                pending.remove_prefix(consumed);
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
+        conn.in.erase(0, conn.in.size() - pending.size());
+        w.scratch.reset(); // Every request was turned into an owning Command
     }
 
-    void logFileDescriptors() {
-        while (running) {
-            std::string cmd = "ls /proc/" + std::to_string(getpid()) + "/fd | wc -l";
-            FILE* pipe = popen(cmd.c_str(), "r");
-            if (pipe) {
-                char buffer[128];
-                if (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-                    std::cerr << "Current file descriptors: " << std::stoi(buffer) << std::endl;
-                }
-                pclose(pipe);
+    // Writes buffered responses until EAGAIN. Returns false if the connection failed.
+    bool flushClient(Connection& conn) {
+        while (conn.out_offset < conn.out.size()) {
+            ssize_t sent = write(conn.fd, conn.out.data() + conn.out_offset, conn.out.size() - conn.out_offset);
+            if (sent > 0) {
+                conn.out_offset += sent;
+                continue;
             }
-            std::this_thread::sleep_for(std::chrono::seconds(30));
+            if (sent == -1 && errno == EINTR) continue;
+            if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            LOG_DEBUG("Failed to write to client", "error", strerror(errno));
+            return false;
         }
+        conn.out.clear();
+        conn.out_offset = 0;
+        return true;
     }
 
-public:
-    DistributedKVStore(const std::string& ip, int port, const std::vector<std::pair<std::string, int>>& node_list)
-        : ip(ip), port(port), write_buffer(1000), running(true) {
-        // Increase file descriptor limit
-        struct rlimit limit;
-        getrlimit(RLIMIT_NOFILE, &limit);
-        limit.rlim_cur = limit.rlim_max = 4096;
-        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
-            std::cerr << "Failed to set file descriptor limit: " << strerror(errno) << std::endl;
-        } else {
-            std::cerr << "Set file descriptor limit to 4096" << std::endl;
+    void serviceClient(Worker& w, uint64_t conn_id, uint32_t events) {
+        auto it = w.connections.find(conn_id);
+        if (it == w.connections.end()) return;
+        Connection& conn = it->second;
+        if (events & EPOLLERR) {
+            closeConnection(w, conn_id);
+            return;
         }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) conn.readable = true;
 
-        nodes.emplace_back(ip, port);
-        for (const auto& [node_ip, node_port] : node_list) {
-            addNode(node_ip, node_port);
+        // Keep reading, executing and writing until the socket would block,
+        // replies are still in flight, or backpressure stops progress
+        conn.in_service = true;
+        bool keep = true;
+        while (true) {
+            if (conn.readable && !readClient(conn)) {
+                keep = false;
+                break;
+            }
+            processInput(w, conn_id, conn);
+            if (conn.failed || !flushClient(conn)) {
+                keep = false;
+                break;
+            }
+            if (!conn.out.empty()) break; // Wait for EPOLLOUT
+            if (conn.peer_closed) {
+                if (conn.in.empty() && inFlight(conn) == 0) keep = false;
+                if (!conn.in.empty() && inFlight(conn) < kMaxPipelined) continue;
+                break;
+            }
+            if (!conn.readable || inFlight(conn) >= kMaxPipelined) break; // Wait for EPOLLIN or replies
+        }
+        conn.in_service = false;
+        if (!keep) {
+            closeConnection(w, conn_id);
+            return;
+        }
+        if (conn.out.empty() && !conn.drain_waiters.empty()) {
+            std::vector<std::function<void()>> waiters;
+            waiters.swap(conn.drain_waiters);
+            for (auto& resume : waiters) resume();
         }
-        std::thread(&DistributedKVStore::processWriteBuffer, this).detach();
-        std::thread(&DistributedKVStore::logFileDescriptors, this).detach();
     }
 
-    bool startServer() {
-        server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd == -1) {
-            std::cerr << "Failed to create socket: " << strerror(errno) << std::endl;
+    bool createListener(Worker& w) {
+        w.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (w.listen_fd == -1) {
+            LOG_ERROR("Failed to create socket", "error", strerror(errno));
             return false;
         }
 
+        // Every worker binds the same port; the kernel spreads new connections across them
         int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-            std::cerr << "Failed to set socket options: " << strerror(errno) << std::endl;
-            close(server_fd);
-            return false;
-        }
-
-        // Set non-blocking
-        int flags = fcntl(server_fd, F_GETFL, 0);
-        if (flags == -1 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-            std::cerr << "Failed to set non-blocking: " << strerror(errno) << std::endl;
-            close(server_fd);
+        if (setsockopt(w.listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+            setsockopt(w.listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+            LOG_ERROR("Failed to set socket options", "error", strerror(errno));
             return false;
         }
 
@@ -329,230 +6235,503 @@ public:
         addr.sin_port = htons(port);
         inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
 
-        if (bind(server_fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
-            std::cerr << "Failed to bind socket: " << strerror(errno) << std::endl;
-            close(server_fd);
+        if (bind(w.listen_fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+            LOG_ERROR("Failed to bind socket", "error", strerror(errno));
             return false;
         }
 
-        if (listen(server_fd, 100) == -1) { // Increased backlog
-            std::cerr << "Failed to listen on socket: " << strerror(errno) << std::endl;
-            close(server_fd);
+        if (listen(w.listen_fd, 100) == -1) { // Increased backlog
+            LOG_ERROR("Failed to listen on socket", "error", strerror(errno));
             return false;
         }
 
+        w.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        w.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w.epoll_fd == -1 || w.wake_fd == -1) {
+            LOG_ERROR("Failed to create worker event fds", "error", strerror(errno));
+            return false;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = kListenerId;
+        epoll_event wake_ev = {};
+        wake_ev.events = EPOLLIN | EPOLLET;
+        wake_ev.data.u64 = kWakeId;
+        if (epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, w.listen_fd, &ev) == -1 ||
+            epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, w.wake_fd, &wake_ev) == -1) {
+            LOG_ERROR("Failed to register worker fds", "error", strerror(errno));
+            return false;
+        }
         return true;
     }
 
-    void addNode(const std::string& ip, int port) {
-        nodes.emplace_back(ip, port);
-        std::sort(nodes.begin(), nodes.end(), 
-            [](const Node& a, const Node& b) { return a.hash < b.hash; });
-    }
+    void runWorker(Worker& w) {
+        Log::setThreadName("worker-" + std::to_string(w.id));
+        epoll_event events[256];
+        while (running) {
+            int timeout = w.shard.warming() || w.defragging || migrationReady(w) ? 0 : 100;
+            int n = epoll_wait(w.epoll_fd, events, 256, timeout);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("epoll_wait failed", "error", strerror(errno));
+                break;
+            }
+            refreshTopology(w);
+            for (int i = 0; i < n; ++i) {
+                uint64_t id = events[i].data.u64;
+                if (id == kListenerId) {
+                    acceptClients(w);
+                } else if (id == kWakeId) {
+                    uint64_t count;
+                    while (read(w.wake_fd, &count, sizeof(count)) > 0) {}
+                } else if (auto link = w.links.find(id); link != w.links.end()) {
+                    serviceLink(w, *link->second, events[i].events);
+                } else {
+                    serviceClient(w, id, events[i].events);
+                }
+            }
 
-    bool put(const std::string& key, const std::string& value) {
-        Node* target = findNodeForKey(key);
-        if (!target) return false;
-        if (target->ip == ip && target->port == port) {
-            store[key] = value;
-            rindex.build(store);
-            return true;
-        } else {
-            std::string request = "PUT " + key + " " + value;
-            std::string response = sendToNode(target->ip, target->port, request);
-            return response == "OK";
+            // Clear the wake flag before draining so a message sent after the
+            // drain always triggers a new wakeup
+            w.wake_pending.store(false);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            drainInbox(w);
+            flushBacklog(w);
+            commitLog(w);
+
+            auto now = std::chrono::steady_clock::now();
+            if (now >= w.next_expiry) {
+                expireCalls(w);
+                if (w.id == 0) checkSnapshot(w);
+                if (!w.defragging && now >= w.next_defrag) w.defragging = w.shard.fragmented();
+                // Expired keys nobody reads are swept in slices of at most ~1 ms
+                auto deadline = now + std::chrono::milliseconds(1);
+                while (!w.shard.expireSome(kExpirySlots) && std::chrono::steady_clock::now() < deadline) {
+                }
+                // Migration gets a tenth of this worker's share of MIGRATE_RATE per tick;
+                // a batch that overdraws it is paid back from the next refill
+                w.migrate_budget = std::min<int64_t>(w.migrate_budget, 0) + config.migrate_rate / 10 / workers.size();
+                if (w.id == 0 && now >= w.next_status_poll) {
+                    pollMembers(w);
+                    w.next_status_poll = now + std::chrono::seconds(1);
+                }
+                expireLeases(w, now);
+                w.shard.pruneHistory(pins.expire(now));
+                w.next_expiry = now + std::chrono::milliseconds(100);
+            }
+            migrateSome(w);
+
+            while (!w.dirty.empty() || !w.dirty_links.empty()) {
+                std::vector<uint64_t> dirty;
+                dirty.swap(w.dirty);
+                for (uint64_t conn_id : dirty) serviceClient(w, conn_id, 0);
+                flushDirtyLinks(w);
+                commitLog(w);
+            }
+
+            if (w.shard.warming() && w.shard.warmUp(kWarmUpBlocks) && --warming == 0) {
+                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - started_at);
+                LOG_INFO("Snapshot fully loaded", "ms_after_startup", elapsed.count());
+            }
+            // Slabs left sparse by churn are compacted a slice at a time, one
+            // pass per second at most
+            if (w.defragging && w.shard.defragment(kDefragSlots)) {
+                w.defragging = false;
+                w.next_defrag = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            }
+            if (w.id != 0 && pause_requested.load()) {
+                ++paused;
+                while (pause_requested.load()) std::this_thread::yield();
+                --paused;
+            }
         }
     }
 
-    std::string get(const std::string& key) {
-        Node* target = findNodeForKey(key);
-        if (!target) return "ERROR";
-        if (target->ip == ip && target->port == port) {
-            auto it = store.find(key);
-            return it != store.end() ? it->second : "";
-        } else {
-            std::string request = "GET " + key;
-            return sendToNode(target->ip, target->port, request);
-        }
+    // Logs are rotated at every snapshot and restart. A generation's files
+    // hold only records with seq >= generation, one file per worker.
+    std::string logPath(uint64_t generation, size_t worker) const {
+        return config.data_dir + "/wal-" + std::to_string(generation) + "-" + std::to_string(worker) + ".log";
     }
 
-    bool remove(const std::string& key) {
-        Node* target = findNodeForKey(key);
-        if (!target) return false;
-        if (target->ip == ip && target->port == port) {
-            return store.erase(key) > 0;
-        } else {
-            std::string request = "REMOVE " + key;
-            std::string response = sendToNode(target->ip, target->port, request);
-            return response == "OK";
+    std::string snapshotPath(uint64_t seq, const char* suffix = ".snap") const {
+        return config.data_dir + "/snapshot-" + std::to_string(seq) + suffix;
+    }
+
+    // Data directory entries named <prefix><number><rest>, with the number, sorted by it
+    std::vector<std::pair<uint64_t, std::string>> listData(const char* prefix, const char* suffix) const {
+        std::vector<std::pair<uint64_t, std::string>> files;
+        DIR* dir = opendir(config.data_dir.c_str());
+        if (!dir) return files;
+        size_t prefix_len = strlen(prefix), suffix_len = strlen(suffix);
+        while (dirent* entry = readdir(dir)) {
+            std::string_view name = entry->d_name;
+            if (name.size() <= prefix_len + suffix_len || name.substr(0, prefix_len) != prefix ||
+                name.substr(name.size() - suffix_len) != suffix || !isdigit(name[prefix_len])) {
+                continue;
+            }
+            files.emplace_back(std::strtoull(entry->d_name + prefix_len, nullptr, 10),
+                               config.data_dir + "/" + entry->d_name);
         }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+        return files;
     }
 
-    std::vector<std::string> rangeQuery(const std::string& start, const std::string& end) {
-        std::vector<std::string> result;
-        for (auto& node : nodes) {
-            if (node.ip == ip && node.port == port) {
-                auto local_result = rindex.rangeQuery(start, end);
-                result.insert(result.end(), local_result.begin(), local_result.end());
-            } else {
-                std::string request = "RANGE " + start + " " + end;
-                std::string response = sendToNode(node.ip, node.port, request);
-                if (response != "ERROR" && response != "NONE") {
-                    std::istringstream iss(response);
-                    std::string key;
-                    while (iss >> key) {
-                        result.push_back(key);
-                    }
+    // Rebuilds the shards from the logs, skipping records already in the
+    // snapshot (seq <= after). Each file is in seq order, so a k-way merge on
+    // seq replays every write in its original order even if keys have moved
+    // between workers since the files were written. A torn record ends its
+    // file; the tail from there on is cut off.
+    bool replayLogs(uint64_t after) {
+        auto started = std::chrono::steady_clock::now();
+        auto logs = listData("wal-", ".log");
+        std::vector<std::unique_ptr<WalReader>> readers;
+        std::vector<WalReader::Record> heads(logs.size());
+        using Entry = std::pair<uint64_t, size_t>; // seq, reader
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> order;
+        for (size_t i = 0; i < logs.size(); ++i) {
+            readers.push_back(std::make_unique<WalReader>());
+            if (!readers[i]->open(logs[i].second)) return false;
+            if (readers[i]->next(heads[i])) order.push({heads[i].seq, i});
+        }
+
+        size_t records = 0;
+        uint64_t last_seq = after;
+        while (!order.empty()) {
+            size_t i = order.top().second;
+            order.pop();
+            const WalReader::Record& rec = heads[i];
+            if (rec.seq > after) {
+                std::string key(rec.key);
+                Shard& shard = workers[shardForHash(hashKey(key))]->shard;
+                if (rec.op == Op::Put) {
+                    shard.put(key, rec.value, rec.expires, rec.seq);
+                } else {
+                    shard.remove(key, rec.seq);
                 }
+                last_seq = std::max(last_seq, rec.seq);
+                ++records;
             }
+            if (readers[i]->next(heads[i])) order.push({heads[i].seq, i});
         }
-        std::sort(result.begin(), result.end());
-        return result;
+
+        for (size_t i = 0; i < logs.size(); ++i) {
+            if (!readers[i]->isDamaged()) continue;
+            const std::string& path = logs[i].second;
+            LOG_WARN("Truncating damaged write-ahead log", "path", path, "at_byte", readers[i]->validLength());
+            if (truncate(path.c_str(), readers[i]->validLength()) == -1) {
+                LOG_ERROR("Failed to truncate write-ahead log", "path", path, "error", strerror(errno));
+                return false;
+            }
+        }
+        next_seq = last_seq + 1;
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+        LOG_INFO("Replayed write-ahead logs", "records", records, "logs", logs.size(), "ms", elapsed.count());
+        return true;
     }
 
-    std::vector<std::string> prefixScan(const std::string& prefix) {
-        std::vector<std::string> result;
-        for (auto& node : nodes) {
-            if (node.ip == ip && node.port == port) {
-                auto local_result = rindex.prefixScan(prefix);
-                result.insert(result.end(), local_result.begin(), local_result.end());
-            } else {
-                std::string request = "PREFIX " + prefix;
-                std::string response = sendToNode(node.ip, node.port, request);
-                if (response != "ERROR" && response != "NONE") {
-                    std::istringstream iss(response);
-                    std::string key;
-                    while (iss >> key) {
-                        result.push_back(key);
-                    }
-                }
+    // Maps the newest readable snapshot and hands it to every shard to serve
+    // from while they warm up. Returns the last seq it covers, or 0.
+    uint64_t loadSnapshot() {
+        auto snapshots = listData("snapshot-", ".snap");
+        for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+            std::shared_ptr<const Snapshot> snapshot = Snapshot::open(it->second);
+            if (!snapshot) continue;
+            for (auto& w : workers) {
+                size_t shard = w->id;
+                w->shard.attachSnapshot(snapshot, [this, shard](std::string_view key) {
+                    return shardForHash(hashKey(key)) == shard;
+                });
             }
+            warming = workers.size();
+            LOG_INFO("Mapped snapshot", "path", it->second, "keys", snapshot->size());
+            return snapshot->seq();
         }
-        std::sort(result.begin(), result.end());
-        return result;
+        return 0;
     }
 
-    void run() {
+    // Opens every worker's log for the generation before switching any, so on
+    // failure all of them stay on their current logs
+    bool openLogs(uint64_t generation) {
+        std::vector<std::unique_ptr<WriteAheadLog>> logs;
+        for (auto& w : workers) {
+            logs.push_back(std::make_unique<WriteAheadLog>());
+            if (!logs.back()->open(logPath(generation, w->id))) return false;
+        }
+        for (size_t i = 0; i < workers.size(); ++i) {
+            Worker& w = *workers[i];
+            if (w.wal && config.fsync != FsyncPolicy::Never) w.wal->sync();
+            w.wal = std::move(logs[i]);
+        }
+        return true;
+    }
+
+    // Restores the node from its snapshot and logs and starts a new log
+    // generation; a no-op without a data directory
+    bool openStorage() {
+        if (config.data_dir.empty()) return true;
+        if (mkdir(config.data_dir.c_str(), 0755) == -1 && errno != EEXIST) {
+            LOG_ERROR("Failed to create data directory", "path", config.data_dir, "error", strerror(errno));
+            return false;
+        }
+        for (auto& [_, path] : listData("snapshot-", ".tmp")) unlink(path.c_str()); // Left by a crashed snapshot
+        uint64_t snapshot_seq = loadSnapshot();
+        if (!replayLogs(snapshot_seq) || !openLogs(next_seq)) return false;
+        if (config.fsync == FsyncPolicy::Interval) {
+            log_syncer = std::thread(&DistributedKVStore::syncLogs, this);
+        }
+        return true;
+    }
+
+    // Workers only write() under FsyncPolicy::Interval; this thread makes it durable
+    void syncLogs() {
+        Log::setThreadName("wal-sync");
         while (running) {
-            sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int client_fd = accept(server_fd, (sockaddr*)&client_addr, &client_len);
-            if (client_fd == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                    continue;
-                }
-                std::cerr << "Failed to accept client: " << strerror(errno) << std::endl;
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                continue;
+            std::this_thread::sleep_for(config.fsync_interval);
+            std::lock_guard<std::mutex> lock(log_mutex);
+            for (auto& w : workers) w->wal->sync();
+        }
+    }
+
+    // Worker 0, every 100 ms: reaps a finished snapshot child, or starts a
+    // new snapshot once enough has been logged since the last one
+    void checkSnapshot(Worker& w) {
+        if (snapshot_pid > 0) {
+            int status;
+            if (waitpid(snapshot_pid, &status, WNOHANG) != snapshot_pid) return;
+            snapshot_pid = -1;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                LOG_ERROR("Snapshot failed", "seq", snapshot_seq);
+                return;
             }
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - snapshot_started);
+            LOG_INFO("Wrote snapshot", "seq", snapshot_seq, "ms", elapsed.count());
+            removeObsoleteFiles(snapshot_seq, snapshot_rotated);
+            return;
+        }
+        if (config.data_dir.empty() || config.snapshot_log_bytes == 0 || warming > 0 ||
+            log_bytes.load(std::memory_order_relaxed) < config.snapshot_log_bytes) {
+            return;
+        }
+        startSnapshot(w);
+    }
 
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-            std::cerr << "Accepted client: " << client_ip << ":" << ntohs(client_addr.sin_port) << std::endl;
+    // Stops every worker between loop iterations, so all writes up to seq are
+    // applied and logged, then forks. The child writes the snapshot from its
+    // copy-on-write view of the shards while the workers resume on a new log
+    // generation.
+    void startSnapshot(Worker& w) {
+        pause_requested = true;
+        for (auto& other : workers) {
+            if (other.get() != &w) wakeWorker(*other);
+        }
+        while (paused.load() != workers.size() - 1) std::this_thread::yield();
 
-            // Set client timeout
-            struct timeval tv = {10, 0}; // 10s timeout
-            setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        uint64_t seq = next_seq.load() - 1;
+        pid_t pid = fork();
+        if (pid == 0) {
+            Log::afterFork();
+            _exit(writeSnapshot(seq) ? 0 : 1);
+        }
+        if (pid == -1) {
+            LOG_ERROR("Failed to fork snapshot writer", "error", strerror(errno));
+        } else {
+            snapshot_pid = pid;
+            snapshot_seq = seq;
+            snapshot_started = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> lock(log_mutex);
+            // Without new logs, the old ones go on to hold writes after seq and must outlive the snapshot
+            snapshot_rotated = openLogs(seq + 1);
+            if (!snapshot_rotated) LOG_WARN("Continuing on the previous write-ahead logs", "seq", seq);
+            log_bytes = 0;
+        }
 
-            char buffer[1024] = {0};
-            int bytes = read(client_fd, buffer, sizeof(buffer) - 1);
-            if (bytes == -1) {
-                std::cerr << "Failed to read from client: " << strerror(errno) << std::endl;
-                close(client_fd);
-                continue;
-            }
-            if (bytes == 0) {
-                std::cerr << "Client disconnected" << std::endl;
-                close(client_fd);
-                continue;
-            }
+        pause_requested = false;
+        while (paused.load() != 0) std::this_thread::yield();
+    }
 
-            std::string request(buffer, bytes);
-            request.erase(std::remove(request.begin(), request.end(), '\n'), request.end());
-            std::cerr << "Received request: \"" << request << "\"" << std::endl;
+    // Runs in the forked child: merges the shards, each already in key order
+    bool writeSnapshot(uint64_t seq) {
+        struct Entry {
+            std::string_view key;
+            std::string_view value;
+            uint32_t expires;
+        };
+        std::vector<std::vector<Entry>> parts(workers.size());
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i]->shard.forEach([&](std::string_view key, std::string_view value, uint32_t expires) {
+                parts[i].push_back({key, value, expires});
+            });
+        }
 
-            std::istringstream iss(request);
-            std::string command, key, value, start, end, prefix;
-            iss >> command;
+        std::string tmp = snapshotPath(seq, ".tmp");
+        SnapshotWriter writer;
+        if (!writer.open(tmp, seq)) return false;
+        auto later = [&](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) {
+            return parts[a.first][a.second].key > parts[b.first][b.second].key;
+        };
+        std::priority_queue<std::pair<size_t, size_t>, std::vector<std::pair<size_t, size_t>>, decltype(later)> heads(later);
+        for (size_t i = 0; i < parts.size(); ++i) {
+            if (!parts[i].empty()) heads.push({i, 0});
+        }
+        while (!heads.empty()) {
+            auto [part, pos] = heads.top();
+            heads.pop();
+            const Entry& entry = parts[part][pos];
+            writer.add(entry.key, entry.value, entry.expires);
+            if (pos + 1 < parts[part].size()) heads.push({part, pos + 1});
+        }
+        if (!writer.finish() || rename(tmp.c_str(), snapshotPath(seq).c_str()) == -1) return false;
 
-            std::string response;
-            try {
-                if (command == "PUT") {
-                    iss >> key >> value;
-                    if (key.empty() || value.empty()) {
-                        response = "ERROR: PUT requires key and value";
-                        std::cerr << "Invalid PUT request: key or value missing" << std::endl;
-                    } else {
-                        response = put(key, value) ? "OK" : "ERROR";
-                    }
-                } else if (command == "GET") {
-                    iss >> key;
-                    if (key.empty()) {
-                        response = "ERROR: GET requires key";
-                        std::cerr << "Invalid GET request: key missing" << std::endl;
-                    } else {
-                        response = get(key);
-                        if (response.empty()) response = "NOT_FOUND";
-                    }
-                } else if (command == "REMOVE") {
-                    iss >> key;
-                    if (key.empty()) {
-                        response = "ERROR: REMOVE requires key";
-                        std::cerr << "Invalid REMOVE request: key missing" << std::endl;
-                    } else {
-                        response = remove(key) ? "OK" : "NOT_FOUND";
-                    }
-                } else if (command == "RANGE") {
-                    iss >> start >> end;
-                    if (start.empty() || end.empty()) {
-                        response = "ERROR: RANGE requires start and end keys";
-                        std::cerr << "Invalid RANGE request: start or end missing" << std::endl;
-                    } else {
-                        auto keys = rangeQuery(start, end);
-                        for (const auto& k : keys) {
-                            response += k + " ";
-                        }
-                        if (response.empty()) response = "NONE";
-                    }
-                } else if (command == "PREFIX") {
-                    iss >> prefix;
-                    if (prefix.empty()) {
-                        response = "ERROR: PREFIX requires prefix";
-                        std::cerr << "Invalid PREFIX request: prefix missing" << std::endl;
-                    } else {
-                        auto keys = prefixScan(prefix);
-                        for (const auto& k : keys) {
-                            response += k + " ";
-                        }
-                        if (response.empty()) response = "NONE";
-                    }
-                } else {
-                    response = "INVALID_COMMAND";
-                    std::cerr << "Invalid command: " << command << std::endl;
-                }
-            } catch (const std::exception& e) {
-                response = "ERROR: Server exception";
-                std::cerr << "Exception processing request: " << e.what() << std::endl;
-            }
+        int dir = ::open(config.data_dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir == -1) return false;
+        bool synced = fsync(dir) == 0;
+        close(dir);
+        return synced;
+    }
+
+    // Drops the logs and snapshots made redundant by the snapshot at seq; the
+    // logs only if the workers moved off them when it was taken
+    void removeObsoleteFiles(uint64_t seq, bool logs) {
+        for (auto& [generation, path] : listData("wal-", ".log")) {
+            if (logs && generation <= seq) unlink(path.c_str());
+        }
+        for (auto& [snapshot, path] : listData("snapshot-", ".snap")) {
+            if (snapshot < seq) unlink(path.c_str());
+        }
+    }
+
+public:
+    DistributedKVStore(const std::string& ip, int port, const std::vector<Node>& node_list,
+                       const Config& config = Config())
+        : config(config), ip(ip), port(port), running(true), started_at(std::chrono::steady_clock::now()) {
+        // Increase file descriptor limit
+        struct rlimit limit;
+        getrlimit(RLIMIT_NOFILE, &limit);
+        limit.rlim_cur = limit.rlim_max = 4096;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            LOG_WARN("Failed to set file descriptor limit", "error", strerror(errno));
+        } else {
+            LOG_INFO("Set file descriptor limit", "limit", 4096);
+        }
+
+        size_t num_workers = std::max<size_t>(config.workers, 1);
+        for (size_t i = 0; i < num_workers; ++i) {
+            auto worker = std::make_unique<Worker>();
+            worker->id = i;
+            worker->backlog.resize(num_workers);
+            worker->shard.setMaxMemory(config.max_memory / num_workers, config.eviction, config.eviction_samples);
+            worker->shard.setVersions(&next_seq, &pins);
+            worker->near_cache.setCapacity((config.near_cache_keys + num_workers - 1) / num_workers);
+            if (num_workers > 1) worker->inbox = std::make_unique<MpscQueue<ShardMessage>>(kInboxCapacity);
+            workers.push_back(std::move(worker));
+        }
+
+        std::vector<Node> members = node_list;
+        if (std::none_of(members.begin(), members.end(), [&](const Node& node) {
+                return isLocalEndpoint(node.ip, node.port);
+            })) {
+            // Not listed in NODES (e.g. running standalone); join the ring under our listen address
+            members.emplace_back(ip, port);
+        }
+        topology = makeTopology(0, std::move(members));
+        for (auto& w : workers) w->topology = topology;
+    }
+
+    // METRICS_PORT: a plain HTTP listener for Prometheus. It runs on its own
+    // blocking thread, so a slow scraper never holds up a worker.
+    bool openMetricsListener() {
+        if (config.metrics_port == 0) return true;
+        metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (metrics_fd == -1) {
+            LOG_ERROR("Failed to create metrics socket", "error", strerror(errno));
+            return false;
+        }
+        int opt = 1;
+        setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.metrics_port);
+        inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
+        if (bind(metrics_fd, (sockaddr*)&addr, sizeof(addr)) == -1 || listen(metrics_fd, 16) == -1) {
+            LOG_ERROR("Failed to listen for metrics", "port", config.metrics_port, "error", strerror(errno));
+            return false;
+        }
+        metrics_server = std::thread(&DistributedKVStore::serveMetrics, this);
+        LOG_INFO("Serving metrics", "port", config.metrics_port, "path", "/metrics");
+        return true;
+    }
+
+    // Answers GET /metrics, one request per connection
+    void serveMetrics() {
+        Log::setThreadName("metrics");
+        while (running) {
+            pollfd listener = {metrics_fd, POLLIN, 0};
+            if (poll(&listener, 1, 200) <= 0) continue; // Wakes up to notice shutdown
+            int fd = accept4(metrics_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd == -1) continue;
+            timeval timeout = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-            std::cerr << "Sending response: \"" << response << "\"" << std::endl;
-            std::string msg = response + "\n";
-            ssize_t sent = write(client_fd, msg.c_str(), msg.length());
-            if (sent == -1) {
-                std::cerr << "Failed to write to client: " << strerror(errno) << std::endl;
-            } else if (sent != static_cast<ssize_t>(msg.length())) {
-                std::cerr << "Incomplete write to client: sent " << sent << " of " << msg.length() << " bytes" << std::endl;
+            std::string request;
+            char buffer[1024];
+            while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+                ssize_t n = read(fd, buffer, sizeof(buffer));
+                if (n <= 0) break;
+                request.append(buffer, n);
+            }
+            bool found = request.compare(0, 13, "GET /metrics ") == 0;
+            std::string body = found ? metricsText() : "Not found\n";
+            std::string response = std::string("HTTP/1.1 ") + (found ? "200 OK" : "404 Not Found") +
+                                   "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            for (size_t sent = 0; sent < response.size();) {
+                ssize_t n = write(fd, response.data() + sent, response.size() - sent);
+                if (n <= 0 && errno != EINTR) break;
+                if (n > 0) sent += n;
             }
+            close(fd);
+        }
+    }
 
-            shutdown(client_fd, SHUT_WR);
-            close(client_fd);
-            std::cerr << "Closed client connection" << std::endl;
+    bool startServer() {
+        if (!openStorage()) return false;
+        for (auto& w : workers) {
+            if (!createListener(*w)) return false;
+        }
+        return openMetricsListener();
+    }
+
+    // Runs worker 0 on the calling thread and the rest on their own threads
+    void run() {
+        for (size_t i = 1; i < workers.size(); ++i) {
+            workers[i]->thread = std::thread(&DistributedKVStore::runWorker, this, std::ref(*workers[i]));
+        }
+        runWorker(*workers[0]);
+        for (size_t i = 1; i < workers.size(); ++i) {
+            workers[i]->thread.join();
         }
     }
 
     ~DistributedKVStore() {
         running = false;
-        close(server_fd);
+        for (auto& w : workers) {
+            if (w->thread.joinable()) w->thread.join();
+            for (auto& [_, conn] : w->connections) close(conn.fd);
+            for (auto& [_, link] : w->links) {
+                if (link->fd != -1) close(link->fd);
+            }
+            if (w->listen_fd != -1) close(w->listen_fd);
+            if (w->epoll_fd != -1) close(w->epoll_fd);
+            if (w->wake_fd != -1) close(w->wake_fd);
+            if (w->wal) w->wal->commit(true);
+        }
+        if (log_syncer.joinable()) log_syncer.join();
+        if (metrics_server.joinable()) metrics_server.join();
+        if (metrics_fd != -1) close(metrics_fd);
     }
 };
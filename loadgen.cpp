@@ -0,0 +1,679 @@
+// Load generator for the kvstore text protocol.
+// Build: g++ -O2 -std=c++17 -pthread -o loadgen loadgen.cpp
+// Usage: ./loadgen [--host 127.0.0.1] [--port 8081] [--connections 8]
+//                  [--seconds 10] [--warmup 0] [--keys 10000]
+//                  [--workload a|b|c|d|e|f] [--get-ratio 0.5]
+//                  [--distribution uniform|zipfian|sequential|latest]
+//                  [--zipf-theta 0.99] [--value-size 5] [--pipeline 1]
+//                  [--rate 0] [--preload] [--reconnect] [--json]
+//
+// Each connection runs on its own thread with up to --pipeline requests in
+// flight. Without --rate the load is closed loop: a connection sends its
+// next request as soon as one completes. With --rate (total requests per
+// second) it is open loop: requests are due on a fixed schedule whether or
+// not earlier ones have been answered, and latency is measured from when a
+// request was due, not from when it could be sent. Closed-loop latencies are
+// corrected for coordinated omission afterwards the way HdrHistogram does,
+// with the mean latency as the expected interval; both forms are reported.
+//
+// --workload picks one of the YCSB core workloads:
+//   a  50% read, 50% update              zipfian
+//   b  95% read, 5% update               zipfian
+//   c  100% read                         zipfian
+//   d  95% read, 5% insert               latest
+//   e  95% scan (1-100 keys), 5% insert  zipfian
+//   f  50% read, 50% read-modify-write   zipfian
+// Otherwise --get-ratio sets the share of reads, the rest are updates, and
+// keys are uniform. --reconnect opens a new connection for every request,
+// matching the old accept-per-request server loop and nc-based scripts.
+// --json prints one JSON object with the settings and results instead, for
+// comparing builds.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+enum class Distribution { Uniform, Zipfian, Sequential, Latest };
+enum class OpKind { Read, Update, Insert, Scan, ReadModifyWrite, Count };
+
+static const char* const kOpNames[] = {"read", "update", "insert", "scan", "rmw"};
+static const char* const kDistributionNames[] = {"uniform", "zipfian", "sequential", "latest"};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8081;
+    int connections = 8;
+    int seconds = 10;
+    int warmup = 0;
+    uint64_t keys = 10000;
+    std::string workload = "custom";
+    // Share of each OpKind, in order
+    std::array<double, static_cast<size_t>(OpKind::Count)> mix = {0.5, 0.5, 0, 0, 0};
+    Distribution distribution = Distribution::Uniform;
+    bool distribution_set = false;
+    double zipf_theta = 0.99;
+    size_t value_size = 5;
+    int pipeline = 1;
+    double rate = 0; // Requests per second over all connections; 0 for closed loop
+    bool preload = false;
+    bool reconnect = false;
+    bool json = false;
+};
+
+// Latency histogram: 16 linear buckets per power of two of nanoseconds, as in
+// HdrHistogram, so every percentile is within about 6%
+struct Histogram {
+    static constexpr int kSubBits = 4;
+    static constexpr int kMaxBits = 40;
+    static constexpr size_t kBuckets = (kMaxBits - kSubBits + 1) << kSubBits;
+
+    std::vector<uint64_t> counts = std::vector<uint64_t>(kBuckets);
+    uint64_t total = 0;
+    uint64_t max = 0;
+    double sum = 0;
+
+    static size_t bucketOf(uint64_t value) {
+        value = std::min<uint64_t>(value, (uint64_t(1) << kMaxBits) - 1);
+        if (value < (1u << kSubBits)) return value;
+        int shift = 63 - __builtin_clzll(value) - kSubBits;
+        return (static_cast<size_t>(shift + 1) << kSubBits) + ((value >> shift) & ((1u << kSubBits) - 1));
+    }
+
+    static uint64_t upperBound(size_t i) {
+        if (i < (1u << kSubBits)) return i;
+        int shift = static_cast<int>(i >> kSubBits) - 1;
+        uint64_t sub = i & ((1u << kSubBits) - 1);
+        return (((1u << kSubBits) + sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t nanos, uint64_t n = 1) {
+        counts[bucketOf(nanos)] += n;
+        total += n;
+        sum += double(nanos) * n;
+        max = std::max(max, nanos);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < kBuckets; ++i) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(upperBound(i), max);
+        }
+        return max;
+    }
+
+    double mean() const {
+        return total ? sum / total : 0;
+    }
+
+    // HdrHistogram's copyCorrectedForCoordinatedOmission: a sample that took
+    // longer than expected stands in for the requests a steady sender would
+    // have issued meanwhile, each waiting expected less than the one before
+    Histogram corrected(uint64_t expected) const {
+        Histogram out = *this;
+        if (expected == 0) return out;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            if (counts[i] == 0) continue;
+            uint64_t value = std::min(upperBound(i), max);
+            for (uint64_t missing = value; missing > expected;) {
+                missing -= expected;
+                if (missing < expected) break;
+                out.record(missing, counts[i]);
+            }
+        }
+        return out;
+    }
+};
+
+// YCSB's Zipfian generator (Gray et al., "Quickly generating billion-record
+// synthetic databases"): ranks 0..n-1, rank 0 the most popular
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint64_t n, double theta) : n(std::max<uint64_t>(n, 1)), theta(theta) {
+        for (uint64_t i = 1; i <= this->n; ++i) zetan += 1.0 / std::pow(double(i), theta);
+        double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - std::pow(2.0 / this->n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    }
+
+    uint64_t next(std::mt19937_64& rng) const {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + std::pow(0.5, theta)) return 1;
+        return std::min<uint64_t>(n - 1, static_cast<uint64_t>(n * std::pow(eta * u - eta + 1.0, alpha)));
+    }
+
+private:
+    uint64_t n;
+    double theta;
+    double zetan = 0;
+    double alpha = 0;
+    double eta = 0;
+};
+
+// State every connection shares
+struct Shared {
+    const Options& opts;
+    std::unique_ptr<ZipfianGenerator> zipf;
+    std::atomic<uint64_t> next_sequential{0};
+    std::atomic<uint64_t> inserted; // Keys 0..inserted-1 exist
+    std::atomic<bool> stop{false};
+    Clock::time_point start;        // Measurement starts here, after the warmup
+    Clock::time_point end;
+    std::string value;
+
+    explicit Shared(const Options& opts) : opts(opts), inserted(opts.keys), value(opts.value_size, 'x') {
+        if (opts.distribution == Distribution::Zipfian || opts.distribution == Distribution::Latest) {
+            zipf = std::make_unique<ZipfianGenerator>(opts.keys, opts.zipf_theta);
+        }
+    }
+};
+
+struct Result {
+    std::array<Histogram, static_cast<size_t>(OpKind::Count)> latency;     // From when each request was due
+    std::array<Histogram, static_cast<size_t>(OpKind::Count)> uncorrected; // From when each was sent
+    uint64_t errors = 0;
+};
+
+// A request sent and not yet answered. A read-modify-write is sent as its
+// read, and its update goes out when the read's reply arrives.
+struct InFlight {
+    OpKind kind;
+    bool rmw_read = false;
+    std::string key;
+    Clock::time_point due;
+    Clock::time_point sent;
+};
+
+std::string makeKey(uint64_t id) {
+    return "key" + std::to_string(id);
+}
+
+// FNV-1a, to scatter zipfian ranks over the key space as YCSB does
+uint64_t scramble(uint64_t rank) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < 8; ++i) {
+        hash ^= (rank >> (i * 8)) & 0xff;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t chooseKey(Shared& shared, std::mt19937_64& rng) {
+    const Options& opts = shared.opts;
+    uint64_t existing = shared.inserted.load(std::memory_order_relaxed);
+    switch (opts.distribution) {
+        case Distribution::Zipfian:
+            return scramble(shared.zipf->next(rng)) % opts.keys;
+        case Distribution::Latest: {
+            uint64_t rank = shared.zipf->next(rng);
+            return rank < existing ? existing - 1 - rank : 0;
+        }
+        case Distribution::Sequential:
+            return shared.next_sequential.fetch_add(1, std::memory_order_relaxed) % existing;
+        case Distribution::Uniform:
+        default:
+            return std::uniform_int_distribution<uint64_t>(0, existing - 1)(rng);
+    }
+}
+
+OpKind chooseOp(const Options& opts, std::mt19937_64& rng) {
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    for (size_t i = 0; i < opts.mix.size(); ++i) {
+        if (u < opts.mix[i]) return static_cast<OpKind>(i);
+        u -= opts.mix[i];
+    }
+    return OpKind::Read;
+}
+
+int connectTo(const Options& opts) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) return -1;
+    sockaddr_in server = {};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(opts.port);
+    inet_pton(AF_INET, opts.host.c_str(), &server.sin_addr);
+    if (connect(sock, (sockaddr*)&server, sizeof(server)) == -1) {
+        close(sock);
+        return -1;
+    }
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return sock;
+}
+
+bool writeAll(int sock, const std::string& msg) {
+    size_t off = 0;
+    while (off < msg.size()) {
+        ssize_t n = write(sock, msg.data() + off, msg.size() - off);
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+// Reads one newline-terminated response, keeping any bytes past it in pending
+bool readLine(int sock, std::string& pending, std::string& line) {
+    char buffer[4096];
+    while (true) {
+        size_t newline = pending.find('\n');
+        if (newline != std::string::npos) {
+            line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            return true;
+        }
+        ssize_t n = read(sock, buffer, sizeof(buffer));
+        if (n <= 0) return false;
+        pending.append(buffer, n);
+    }
+}
+
+bool isError(const std::string& line) {
+    return line.compare(0, 5, "ERROR") == 0 || line.compare(0, 7, "INVALID") == 0;
+}
+
+// Writes keys 0..keys-1 before the run, this connection's share of them
+void preload(Shared& shared, int id) {
+    const Options& opts = shared.opts;
+    int sock = connectTo(opts);
+    if (sock == -1) return;
+    std::string pending, line, batch;
+    uint64_t key = id;
+    while (key < opts.keys) {
+        batch.clear();
+        int sent = 0;
+        for (; sent < 64 && key < opts.keys; ++sent, key += opts.connections) {
+            batch += "PUT " + makeKey(key) + " " + shared.value + "\n";
+        }
+        if (!writeAll(sock, batch)) break;
+        for (int i = 0; i < sent; ++i) {
+            if (!readLine(sock, pending, line)) break;
+        }
+    }
+    close(sock);
+}
+
+class Connection {
+public:
+    Connection(Shared& shared, int id, Result& result)
+        : shared(shared), opts(shared.opts), rng(id * 7919 + 1), result(result) {
+        if (opts.rate > 0) {
+            interval = std::chrono::nanoseconds(static_cast<int64_t>(1e9 * opts.connections / opts.rate));
+            // Spread the connections' schedules over one interval
+            next_due = Clock::now() + interval * id / opts.connections;
+        }
+    }
+
+    ~Connection() {
+        if (sock != -1) close(sock);
+    }
+
+    void run() {
+        while (!shared.stop.load(std::memory_order_relaxed)) {
+            if (sock == -1 && !reconnect()) continue;
+            Clock::time_point now = Clock::now();
+            while (inflight.size() < static_cast<size_t>(opts.pipeline) && (opts.rate == 0 || next_due <= now)) {
+                Clock::time_point due = opts.rate > 0 ? next_due : now;
+                issue(chooseOp(opts, rng), due, now);
+                if (opts.rate > 0) next_due += interval;
+            }
+            if (!flush() || !receive(opts.rate > 0 ? next_due : Clock::time_point::max())) fail();
+        }
+        // Wait briefly for the answers still outstanding
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(2);
+        while (sock != -1 && !inflight.empty() && Clock::now() < deadline) {
+            if (!flush() || !receive(deadline)) fail();
+        }
+    }
+
+private:
+    Shared& shared;
+    const Options& opts;
+    std::mt19937_64 rng;
+    Result& result;
+    int sock = -1;
+    std::string in;
+    std::string out;
+    std::deque<InFlight> inflight;
+    std::chrono::nanoseconds interval{0};
+    Clock::time_point next_due;
+
+    bool reconnect() {
+        sock = connectTo(opts);
+        if (sock == -1) {
+            ++result.errors;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return false;
+        }
+        in.clear();
+        return true;
+    }
+
+    void issue(OpKind kind, Clock::time_point due, Clock::time_point now) {
+        InFlight request{kind, false, {}, due, now};
+        switch (kind) {
+            case OpKind::Read:
+                request.key = makeKey(chooseKey(shared, rng));
+                out += "GET " + request.key + "\n";
+                break;
+            case OpKind::Update:
+                request.key = makeKey(chooseKey(shared, rng));
+                out += "PUT " + request.key + " " + shared.value + "\n";
+                break;
+            case OpKind::Insert:
+                request.key = makeKey(shared.inserted.fetch_add(1, std::memory_order_relaxed));
+                out += "PUT " + request.key + " " + shared.value + "\n";
+                break;
+            case OpKind::Scan: {
+                request.key = makeKey(chooseKey(shared, rng));
+                int length = std::uniform_int_distribution<int>(1, 100)(rng);
+                out += "RANGE " + request.key + " key~ LIMIT " + std::to_string(length) + "\n";
+                break;
+            }
+            case OpKind::ReadModifyWrite:
+            default:
+                request.key = makeKey(chooseKey(shared, rng));
+                request.rmw_read = true;
+                out += "GET " + request.key + "\n";
+                break;
+        }
+        inflight.push_back(std::move(request));
+    }
+
+    bool flush() {
+        bool ok = writeAll(sock, out);
+        out.clear();
+        return ok;
+    }
+
+    // Reads replies until one arrives or until is reached
+    bool receive(Clock::time_point until) {
+        char buffer[16384];
+        while (true) {
+            if (completeLines()) return true;
+            // Sleep until a reply arrives or, if another request may be sent, until it is due
+            std::chrono::nanoseconds timeout = std::chrono::milliseconds(100);
+            if (until != Clock::time_point::max() && inflight.size() < static_cast<size_t>(opts.pipeline)) {
+                auto left = until - Clock::now();
+                if (left <= Clock::duration::zero()) return true;
+                timeout = std::min(timeout, std::chrono::duration_cast<std::chrono::nanoseconds>(left));
+            }
+            timespec wait = {static_cast<time_t>(timeout.count() / 1000000000), static_cast<long>(timeout.count() % 1000000000)};
+            pollfd pfd = {sock, POLLIN, 0};
+            int ready = ppoll(&pfd, 1, &wait, nullptr);
+            if (ready == 0) {
+                if (shared.stop.load(std::memory_order_relaxed) || until != Clock::time_point::max()) return true;
+                continue;
+            }
+            if (ready < 0) return errno == EINTR;
+            ssize_t n = read(sock, buffer, sizeof(buffer));
+            if (n <= 0) return false;
+            in.append(buffer, n);
+        }
+    }
+
+    // Completes the requests whose replies are in; true if there were any
+    bool completeLines() {
+        size_t start = 0, newline;
+        bool any = false;
+        while (!inflight.empty() && (newline = in.find('\n', start)) != std::string::npos) {
+            bool error = isError(in.substr(start, newline - start));
+            start = newline + 1;
+            InFlight done = std::move(inflight.front());
+            inflight.pop_front();
+            any = true;
+            if (done.rmw_read && !error) {
+                // The write half goes out now, timed from the read's due time
+                InFlight write{OpKind::ReadModifyWrite, false, done.key, done.due, done.sent};
+                out += "PUT " + done.key + " " + shared.value + "\n";
+                inflight.push_back(std::move(write));
+                continue;
+            }
+            record(done, error);
+        }
+        in.erase(0, start);
+        if (opts.reconnect && inflight.empty()) {
+            close(sock);
+            sock = -1;
+        }
+        return any;
+    }
+
+    void record(const InFlight& done, bool error) {
+        Clock::time_point now = Clock::now();
+        if (done.due < shared.start || done.due >= shared.end) return; // Warmup, or past the end
+        if (error) {
+            ++result.errors;
+            return;
+        }
+        size_t kind = static_cast<size_t>(done.kind);
+        result.latency[kind].record(std::chrono::nanoseconds(now - done.due).count());
+        result.uncorrected[kind].record(std::chrono::nanoseconds(now - done.sent).count());
+    }
+
+    void fail() {
+        for (const InFlight& lost : inflight) {
+            if (lost.due >= shared.start && lost.due < shared.end) ++result.errors;
+        }
+        inflight.clear();
+        out.clear();
+        if (sock != -1) close(sock);
+        sock = -1;
+    }
+};
+
+void runWorker(Shared& shared, int id, Result& result) {
+    Connection connection(shared, id, result);
+    connection.run();
+}
+
+bool setWorkload(Options& opts, const std::string& name) {
+    using Mix = std::array<double, static_cast<size_t>(OpKind::Count)>;
+    //                                read  update insert scan  rmw
+    if (name == "a") opts.mix = Mix{0.50, 0.50, 0, 0, 0};
+    else if (name == "b") opts.mix = Mix{0.95, 0.05, 0, 0, 0};
+    else if (name == "c") opts.mix = Mix{1, 0, 0, 0, 0};
+    else if (name == "d") opts.mix = Mix{0.95, 0, 0.05, 0, 0};
+    else if (name == "e") opts.mix = Mix{0, 0, 0.05, 0.95, 0};
+    else if (name == "f") opts.mix = Mix{0.50, 0, 0, 0, 0.50};
+    else return false;
+    opts.workload = name;
+    if (!opts.distribution_set) opts.distribution = name == "d" ? Distribution::Latest : Distribution::Zipfian;
+    return true;
+}
+
+std::string describeMix(const Options& opts) {
+    std::string text;
+    for (size_t i = 0; i < opts.mix.size(); ++i) {
+        if (opts.mix[i] <= 0) continue;
+        if (!text.empty()) text += ", ";
+        text += std::to_string(static_cast<int>(std::lround(opts.mix[i] * 100))) + "% " + kOpNames[i];
+    }
+    return text;
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    Options opts;
+    std::string workload;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << std::endl;
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--host") opts.host = next();
+        else if (arg == "--port") opts.port = std::stoi(next());
+        else if (arg == "--connections") opts.connections = std::max(1, std::stoi(next()));
+        else if (arg == "--seconds") opts.seconds = std::max(1, std::stoi(next()));
+        else if (arg == "--warmup") opts.warmup = std::max(0, std::stoi(next()));
+        else if (arg == "--keys") opts.keys = std::max<uint64_t>(1, std::stoull(next()));
+        else if (arg == "--workload") workload = next();
+        else if (arg == "--get-ratio") {
+            double ratio = std::clamp(std::stod(next()), 0.0, 1.0);
+            opts.mix = {ratio, 1 - ratio, 0, 0, 0};
+        } else if (arg == "--distribution") {
+            std::string name = next();
+            auto it = std::find(std::begin(kDistributionNames), std::end(kDistributionNames), name);
+            if (it == std::end(kDistributionNames)) {
+                std::cerr << "Unknown distribution: " << name << std::endl;
+                return 1;
+            }
+            opts.distribution = static_cast<Distribution>(it - std::begin(kDistributionNames));
+            opts.distribution_set = true;
+        } else if (arg == "--zipf-theta") opts.zipf_theta = std::stod(next());
+        else if (arg == "--value-size") opts.value_size = std::max<size_t>(1, std::stoull(next()));
+        else if (arg == "--pipeline") opts.pipeline = std::max(1, std::stoi(next()));
+        else if (arg == "--rate") opts.rate = std::max(0.0, std::stod(next()));
+        else if (arg == "--preload") opts.preload = true;
+        else if (arg == "--reconnect") opts.reconnect = true;
+        else if (arg == "--json") opts.json = true;
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (!workload.empty() && !setWorkload(opts, workload)) {
+        std::cerr << "Unknown workload: " << workload << std::endl;
+        return 1;
+    }
+    if (opts.reconnect) opts.pipeline = 1;
+
+    Shared shared(opts);
+    if (opts.preload) {
+        std::vector<std::thread> loaders;
+        for (int i = 0; i < opts.connections; ++i) loaders.emplace_back(preload, std::ref(shared), i);
+        for (auto& t : loaders) t.join();
+    }
+
+    shared.start = Clock::now() + std::chrono::seconds(opts.warmup);
+    shared.end = shared.start + std::chrono::seconds(opts.seconds);
+    std::vector<Result> results(opts.connections);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < opts.connections; ++i) {
+        workers.emplace_back(runWorker, std::ref(shared), i, std::ref(results[i]));
+    }
+    std::this_thread::sleep_until(shared.end);
+    shared.stop = true;
+    for (auto& t : workers) t.join();
+
+    Result total;
+    for (const auto& r : results) {
+        for (size_t i = 0; i < total.latency.size(); ++i) {
+            total.latency[i].merge(r.latency[i]);
+            total.uncorrected[i].merge(r.uncorrected[i]);
+        }
+        total.errors += r.errors;
+    }
+    Histogram all, raw;
+    for (size_t i = 0; i < total.latency.size(); ++i) {
+        all.merge(total.latency[i]);
+        raw.merge(total.uncorrected[i]);
+    }
+    if (all.total == 0) {
+        std::cerr << "No successful requests (" << total.errors << " errors)" << std::endl;
+        return 1;
+    }
+    // Open-loop latencies already count from when each request was due
+    uint64_t expected = opts.rate > 0 ? 0 : static_cast<uint64_t>(raw.mean());
+    auto corrected = [&](const Histogram& h) { return opts.rate > 0 ? h : h.corrected(expected); };
+    Histogram latency = corrected(all);
+    double ops = all.total / static_cast<double>(opts.seconds);
+    std::string mode = opts.rate > 0 ? "open" : "closed";
+    std::string connection_mode = opts.reconnect ? "reconnect" : "persistent";
+    auto us = [](uint64_t nanos) { return nanos / 1e3; };
+
+    if (opts.json) {
+        char buffer[512];
+        std::string out;
+        snprintf(buffer, sizeof(buffer),
+                 "{\"mode\":\"%s\",\"connection_mode\":\"%s\",\"workload\":\"%s\",\"distribution\":\"%s\","
+                 "\"connections\":%d,\"pipeline\":%d,\"rate\":%.0f,\"seconds\":%d,\"keys\":%llu,\"value_size\":%zu,"
+                 "\"requests\":%llu,\"errors\":%llu,\"ops_per_sec\":%.1f,",
+                 mode.c_str(), connection_mode.c_str(), opts.workload.c_str(),
+                 kDistributionNames[static_cast<int>(opts.distribution)], opts.connections, opts.pipeline, opts.rate,
+                 opts.seconds, static_cast<unsigned long long>(opts.keys), opts.value_size,
+                 static_cast<unsigned long long>(all.total), static_cast<unsigned long long>(total.errors), ops);
+        out += buffer;
+        // count is of real requests; a corrected histogram also holds the ones it stands in for
+        auto percentiles = [&](const char* name, const Histogram& h, uint64_t count) {
+            snprintf(buffer, sizeof(buffer),
+                     "\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}", name,
+                     static_cast<unsigned long long>(count), h.mean() / 1e3, us(h.percentile(0.5)),
+                     us(h.percentile(0.99)), us(h.percentile(0.999)), us(h.max));
+            out += buffer;
+        };
+        percentiles("latency_us", latency, all.total);
+        out += ",";
+        percentiles("uncorrected_latency_us", raw, raw.total);
+        out += ",\"operations\":{";
+        bool first = true;
+        for (size_t i = 0; i < total.latency.size(); ++i) {
+            if (total.latency[i].total == 0) continue;
+            if (!first) out += ",";
+            first = false;
+            percentiles(kOpNames[i], corrected(total.latency[i]), total.latency[i].total);
+        }
+        out += "}}";
+        std::cout << out << std::endl;
+        return 0;
+    }
+
+    auto line = [&](const Histogram& h) {
+        char buffer[160];
+        snprintf(buffer, sizeof(buffer), "p50 %.0f  p99 %.0f  p999 %.0f  max %.0f us", us(h.percentile(0.5)),
+                 us(h.percentile(0.99)), us(h.percentile(0.999)), us(h.max));
+        return std::string(buffer);
+    };
+    std::cout << "mode:        " << mode << " loop, " << connection_mode << " connections\n"
+              << "workload:    " << opts.workload << ": " << describeMix(opts) << ", "
+              << kDistributionNames[static_cast<int>(opts.distribution)] << " keys\n"
+              << "connections: " << opts.connections << " x pipeline " << opts.pipeline << "\n"
+              << "requests:    " << all.total << " (" << total.errors << " errors)\n"
+              << "ops/s:       " << static_cast<uint64_t>(ops) << "\n"
+              << "p50 us:      " << static_cast<uint64_t>(us(latency.percentile(0.5))) << "\n"
+              << "p99 us:      " << static_cast<uint64_t>(us(latency.percentile(0.99))) << "\n"
+              << "p999 us:     " << static_cast<uint64_t>(us(latency.percentile(0.999))) << "\n"
+              << "max us:      " << static_cast<uint64_t>(us(latency.max)) << "\n"
+              << "uncorrected: " << line(raw) << "\n";
+    for (size_t i = 0; i < total.latency.size(); ++i) {
+        if (total.latency[i].total == 0) continue;
+        std::string name = std::string(kOpNames[i]) + ":";
+        name.resize(13, ' ');
+        std::cout << name << total.latency[i].total << " ops, " << line(corrected(total.latency[i])) << "\n";
+    }
+    std::cout.flush();
+    return 0;
+}
@@ -2,55 +2,183 @@
 #include <iostream>
 #include <sstream>
 #include <cstdlib>
+#include <csignal>
 
 bool isDebug() {
     return std::getenv("DEBUG") && std::string(std::getenv("DEBUG")) == "true";
 }
 
-std::vector<std::pair<std::string, int>> parseNodeList(const std::string& node_list) {
-    std::vector<std::pair<std::string, int>> nodes;
-    if (isDebug()) std::cerr << "Parsing node list: " << node_list << std::endl;
+// Parses "host:port[:weight],..." into ring members
+std::vector<Node> parseNodeList(const std::string& node_list) {
+    std::vector<Node> nodes;
+    LOG_DEBUG("Parsing node list", "nodes", node_list);
     std::istringstream iss(node_list);
     std::string node;
     while (std::getline(iss, node, ',')) {
-        size_t colon = node.find(':');
-        if (colon != std::string::npos) {
-            std::string ip = node.substr(0, colon);
-            int port = std::stoi(node.substr(colon + 1));
-            if (isDebug()) std::cerr << "Added node: " << ip << ":" << port << std::endl;
-            nodes.emplace_back(ip, port);
+        std::string ip;
+        int port;
+        uint32_t weight;
+        if (parseNodeSpec(node, ip, port, weight)) {
+            LOG_DEBUG("Added node", "host", ip, "port", port, "weight", weight);
+            nodes.emplace_back(ip, port, weight);
         } else {
-            std::cerr << "Invalid node format: " << node << std::endl;
+            LOG_WARN("Invalid node format", "node", node);
         }
     }
     return nodes;
 }
 
+// A byte count with an optional k, m or g suffix
+size_t parseBytes(const std::string& value) {
+    size_t digits = 0;
+    size_t bytes = std::stoull(value, &digits);
+    char unit = digits < value.size() ? std::tolower(value[digits]) : 0;
+    return bytes << (unit == 'k' ? 10 : unit == 'm' ? 20 : unit == 'g' ? 30 : 0);
+}
+
 int main(int argc, char* argv[]) {
+    // Writes to a client or peer that has gone away must fail with EPIPE, not kill the node
+    signal(SIGPIPE, SIG_IGN);
+
+    // DEBUG=true logs every request and connection; otherwise INFO and above
+    Log::setLevel(isDebug() ? LogLevel::Debug : LogLevel::Info);
+
     std::string ip = "0.0.0.0"; // Listen on all interfaces
     int port = 8081;
-    std::vector<std::pair<std::string, int>> node_list;
+    std::vector<Node> node_list;
+    Config config;
 
     // Parse environment variable NODES
     if (const char* nodes_env = std::getenv("NODES")) {
         node_list = parseNodeList(nodes_env);
     } else {
-        std::cerr << "NODES environment variable not set" << std::endl;
+        LOG_WARN("NODES environment variable not set");
+    }
+
+    // Number of worker threads (shards); "auto" uses one per core
+    if (const char* workers_env = std::getenv("WORKERS")) {
+        std::string value = workers_env;
+        config.workers = value == "auto" ? std::thread::hardware_concurrency() : std::stoul(value);
+        LOG_DEBUG("Using worker threads", "workers", config.workers);
+    }
+
+    // Virtual nodes per ring member
+    if (const char* vnodes_env = std::getenv("VNODES")) {
+        config.vnodes = std::stoul(vnodes_env);
+        LOG_DEBUG("Using virtual nodes per member", "vnodes", config.vnodes);
+    }
+
+    // Write-ahead log directory; unset keeps everything in memory
+    if (const char* data_dir_env = std::getenv("DATA_DIR")) {
+        config.data_dir = data_dir_env;
+    }
+
+    // FSYNC=always, never, or an interval in milliseconds
+    if (const char* fsync_env = std::getenv("FSYNC")) {
+        std::string value = fsync_env;
+        if (value == "always") {
+            config.fsync = FsyncPolicy::Always;
+        } else if (value == "never") {
+            config.fsync = FsyncPolicy::Never;
+        } else {
+            config.fsync = FsyncPolicy::Interval;
+            config.fsync_interval = std::chrono::milliseconds(std::max(1, std::stoi(value)));
+        }
+    }
+
+    // Bytes of write-ahead log between snapshots; 0 turns snapshots off
+    if (const char* snapshot_env = std::getenv("SNAPSHOT_BYTES")) {
+        config.snapshot_log_bytes = std::stoull(snapshot_env);
+    }
+
+    // Milliseconds a peer has to answer each page of a RANGE/PREFIX
+    if (const char* scan_timeout_env = std::getenv("SCAN_TIMEOUT")) {
+        config.scan_timeout = std::chrono::milliseconds(std::max(1, std::stoi(scan_timeout_env)));
+    }
+
+    // Bytes of key/value data the node may hold, with an optional k, m or g suffix; unset for no limit
+    if (const char* maxmemory_env = std::getenv("MAXMEMORY")) {
+        config.max_memory = parseBytes(maxmemory_env);
+    }
+
+    // What happens at MAXMEMORY: EVICTION=none refuses writes, lru or lfu evicts keys
+    if (const char* eviction_env = std::getenv("EVICTION")) {
+        std::string value = eviction_env;
+        if (value == "lru") {
+            config.eviction = EvictionPolicy::Lru;
+        } else if (value == "lfu") {
+            config.eviction = EvictionPolicy::Lfu;
+        } else {
+            config.eviction = EvictionPolicy::None;
+        }
+    }
+
+    // Keys sampled per eviction; more samples approximate LRU/LFU more closely
+    if (const char* samples_env = std::getenv("EVICTION_SAMPLES")) {
+        config.eviction_samples = std::max(1, std::stoi(samples_env));
+    }
+
+    // Copies of each key, on its owner and the next nodes on the ring
+    if (const char* replicas_env = std::getenv("REPLICAS")) {
+        config.replicas = std::max(1, std::stoi(replicas_env));
+    }
+
+    // WRITE_ACK=one, quorum or all: copies applied before a write is acknowledged
+    if (const char* ack_env = std::getenv("WRITE_ACK")) {
+        std::string value = ack_env;
+        if (value == "quorum") {
+            config.write_ack = WriteAck::Quorum;
+        } else if (value == "all") {
+            config.write_ack = WriteAck::All;
+        } else {
+            config.write_ack = WriteAck::One;
+        }
+    }
+
+    // READ_FROM=primary or replica: where GETs go when keys are replicated
+    if (const char* read_env = std::getenv("READ_FROM")) {
+        config.read_from = std::string(read_env) == "replica" ? ReadFrom::Replica : ReadFrom::Primary;
+    }
+
+    // Bytes per second, with an optional k, m or g suffix, that the node sends
+    // to new holders of its keys after NODE ADD or NODE REMOVE
+    if (const char* migrate_env = std::getenv("MIGRATE_RATE")) {
+        config.migrate_rate = parseBytes(migrate_env);
+    }
+
+    // Port for Prometheus to scrape GET /metrics from; unset for none
+    if (const char* metrics_env = std::getenv("METRICS_PORT")) {
+        config.metrics_port = std::stoi(metrics_env);
+    }
+
+    // RING_HASH=murmur3 or crc32c: how keys are placed on the ring; must be the same on every node
+    if (const char* hash_env = std::getenv("RING_HASH")) {
+        config.ring_hash = std::string(hash_env) == "crc32c" ? RingHash::Crc32c : RingHash::Murmur3;
+    }
+
+    // Values read from other nodes that the node caches, split between workers; unset or 0 for none
+    if (const char* near_env = std::getenv("NEAR_CACHE")) {
+        config.near_cache_keys = std::stoull(near_env);
+    }
+
+    // Milliseconds a near-cached value may be served without hearing from its owner
+    if (const char* lease_env = std::getenv("NEAR_CACHE_LEASE")) {
+        config.near_cache_lease = std::chrono::milliseconds(std::max(1, std::stoi(lease_env)));
     }
 
     // Override port if provided as argument
     if (argc > 1) {
         port = std::stoi(argv[1]);
-        if (isDebug()) std::cerr << "Using port from argument: " << port << std::endl;
+        LOG_DEBUG("Using port from argument", "port", port);
     }
 
-    if (isDebug()) std::cerr << "Initializing DistributedKVStore on " << ip << ":" << port << std::endl;
-    DistributedKVStore kvstore(ip, port, node_list);
+    LOG_DEBUG("Initializing DistributedKVStore", "ip", ip, "port", port);
+    DistributedKVStore kvstore(ip, port, node_list, config);
     if (!kvstore.startServer()) {
-        std::cerr << "Failed to start server on " << ip << ":" << port << std::endl;
+        LOG_ERROR("Failed to start server", "ip", ip, "port", port);
         return 1;
     }
-    std::cerr << "Server running on " << ip << ":" << port << std::endl;
+    LOG_INFO("Server running", "ip", ip, "port", port);
     kvstore.run();
     return 0;
 }
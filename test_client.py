@@ -3,32 +3,110 @@ import time
 import random
 import os
 
+# One persistent connection per node; nodes accept any number of requests on it
+connections = {}
+
+def read_line(sock):
+    response = b""
+    while not response.endswith(b"\n"):
+        data = sock.recv(4096)
+        if not data:
+            raise ConnectionError("connection closed")
+        response += data
+    return response.decode().strip()
+
 def send_command(host, port, command):
     max_retries = 3
     for attempt in range(max_retries):
         try:
-            print(f"Attempt {attempt + 1}: Connecting to {host}:{port}")
-            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
-                sock.settimeout(30)  # Increased to 30s
-                sock.connect((host, port))
-                sock.sendall((command + "\n").encode())
-                print(f"Attempt {attempt + 1}: Sent to {host}:{port}: {command}")
-                response = ""
-                while True:
-                    data = sock.recv(1024).decode()
-                    if not data:
-                        break
-                    response += data
-                    if "\n" in data:
-                        break
-                return response.strip()
+            sock = connections.get((host, port))
+            if sock is None:
+                print(f"Attempt {attempt + 1}: Connecting to {host}:{port}")
+                sock = socket.create_connection((host, port), timeout=5)
+                connections[(host, port)] = sock
+            sock.sendall((command + "\n").encode())
+            print(f"Attempt {attempt + 1}: Sent to {host}:{port}: {command}")
+            return read_line(sock)
         except Exception as e:
             print(f"Attempt {attempt + 1}: Error with {host}:{port}: {e}")
+            sock = connections.pop((host, port), None)
+            if sock is not None:
+                sock.close()
             if attempt < max_retries - 1:
                 time.sleep(1)     # Wait 1s before retry
             continue
     return ""
 
+def expect(node, command, expected):
+    host, port = node
+    response = send_command(host, port, command)
+    print(f"Response: {response}")
+    assert response == expected, f"{command}: expected {expected!r}, got {response!r}"
+
+def expect_error(node, command):
+    host, port = node
+    response = send_command(host, port, command)
+    print(f"Response: {response}")
+    assert response.startswith("ERROR"), f"{command}: expected an error, got {response!r}"
+
+def expect_ok(node, command):
+    host, port = node
+    response = send_command(host, port, command)
+    print(f"Response: {response}")
+    assert response.startswith("OK "), f"{command}: expected OK <version>, got {response!r}"
+    return int(response.split()[1])
+
+def test_batches(nodes):
+    # Keys spread over every node; replies keep the order of the request
+    expect(random.choice(nodes), "MPUT batch:a 1 batch:b 2 batch:c 3", "OK")
+    expect(random.choice(nodes), "MGET batch:a batch:missing batch:c", "1 NOT_FOUND 3")
+    expect(random.choice(nodes), "MDEL batch:missing batch:b", "NOT_FOUND OK")
+    expect(random.choice(nodes), "MGET batch:a batch:b batch:c", "1 NOT_FOUND 3")
+    expect_error(random.choice(nodes), "MPUT a")
+    expect_error(random.choice(nodes), "MGET")
+    expect_error(random.choice(nodes), "MDEL")
+
+def test_ttl(nodes):
+    expect(random.choice(nodes), "PUT ttl:short value EX 1", "OK")
+    expect(random.choice(nodes), "GET ttl:short", "value")
+    time.sleep(2.5)  # EX rounds up to the next whole second
+    expect(random.choice(nodes), "GET ttl:short", "NOT_FOUND")
+    expect_error(random.choice(nodes), "PUT ttl:bad value EX -5")
+    expect_error(random.choice(nodes), "PUT ttl:bad value EX 0")
+    expect(random.choice(nodes), "GET ttl:bad", "NOT_FOUND")
+
+def test_versions(nodes):
+    key = f"cas:{random.randrange(1 << 30)}"
+    # Version 0 creates a key that does not exist yet
+    version = expect_ok(random.choice(nodes), f"CAS {key} 0 v1")
+    expect(random.choice(nodes), f"GETV {key}", f"{version} v1")
+    newer = expect_ok(random.choice(nodes), f"CAS {key} {version} v2")
+    assert newer > version, f"CAS gave {key} version {newer} after {version}"
+    expect(random.choice(nodes), f"CAS {key} {version} v3", f"CONFLICT {newer}")
+    expect(random.choice(nodes), f"CAS {key} 0 v3", f"CONFLICT {newer}")
+    expect(random.choice(nodes), f"GET {key}", "v2")
+    expect(random.choice(nodes), f"REMOVE {key}", "OK")
+    expect(random.choice(nodes), f"CAS {key} {newer} v4", "CONFLICT 0")
+
+def test_pinned_scan(nodes):
+    prefix = f"pinned:{random.randrange(1 << 30)}:"
+    old = {f"{prefix}{i}": f"old{i}" for i in range(6)}
+    expect(random.choice(nodes), "MPUT " + " ".join(f"{k} {v}" for k, v in old.items()), "OK")
+    pages = [send_command(*random.choice(nodes), f"PREFIX {prefix} LIMIT 2 VALUES")]
+    print(f"Response: {pages[0]}")
+    # Writes between pages must not show up in the rest of the scan
+    expect(random.choice(nodes), "MPUT " + " ".join(f"{k} new" for k in old), "OK")
+    expect(random.choice(nodes), f"PUT {prefix}45 new", "OK")
+    expect(random.choice(nodes), f"REMOVE {prefix}3", "OK")
+    while pages[-1].split()[-1] != "END":
+        assert pages[-1].split()[-1].startswith(">"), f"expected a continuation token, got {pages[-1]!r}"
+        token = pages[-1].split()[-1]
+        pages.append(send_command(*random.choice(nodes), f"PREFIX {prefix} LIMIT 2 VALUES AFTER {token}"))
+        print(f"Response: {pages[-1]}")
+    words = " ".join(page.rsplit(" ", 1)[0] for page in pages if page != "END").split()
+    seen = dict(zip(words[::2], words[1::2]))
+    assert seen == old, f"paged scan was not read at its first page's snapshot: {seen}"
+
 def main():
     # Check if running in Docker
     is_docker = os.getenv("IN_DOCKER", "false").lower() == "true"
@@ -65,5 +143,11 @@ def main():
         print(f"Response: {response}")
         time.sleep(0.5)  # Delay for node communication
 
+    test_batches(nodes)
+    test_ttl(nodes)
+    test_versions(nodes)
+    test_pinned_scan(nodes)
+    print("All checks passed")
+
 if __name__ == "__main__":
     main()
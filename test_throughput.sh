@@ -1,14 +1,20 @@
 #!/bin/bash
+# PUT and then GET throughput and latency percentiles against one node, using
+# the load generator (built from loadgen.cpp if it is not there yet).
+# Usage: ./test_throughput.sh [host] [port] [seconds]
+# Extra loadgen flags can be passed in LOADGEN_FLAGS, e.g. "--pipeline 16"
+# or "--json" for results to diff between builds.
+HOST=${1:-127.0.0.1}
+PORT=${2:-8081}
+SECONDS_PER_RUN=${3:-10}
+LOADGEN=${LOADGEN:-./loadgen}
+
+if [ ! -x "$LOADGEN" ]; then
+    g++ -O2 -std=c++17 -pthread -o "$LOADGEN" "$(dirname "$0")/loadgen.cpp" || exit 1
+fi
 
-# Test throughput for PUT and GET
 echo "Testing PUT throughput"
-for i in {1..1000}
-do
-    echo "PUT key$i value$i" | nc 127.0.0.1 8081
-done
+$LOADGEN --host $HOST --port $PORT --seconds $SECONDS_PER_RUN --get-ratio 0 $LOADGEN_FLAGS
 
 echo "Testing GET throughput"
-for i in {1..1000}
-do
-    echo "GET key$i" | nc 127.0.0.1 8081
-done
+$LOADGEN --host $HOST --port $PORT --seconds $SECONDS_PER_RUN --get-ratio 1 $LOADGEN_FLAGS